@@ -0,0 +1,200 @@
+package guardianagent
+
+import (
+	"fmt"
+	"io"
+	"runtime"
+	"sort"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// Allocations are sampled on one session out of allocSampleInterval, since
+// reading the runtime's memory statistics briefly stops the world.
+const allocSampleInterval = 8
+
+type sessionPhase int
+
+const (
+	// Waiting for the policy or the user to approve the request.
+	phaseApproval sessionPhase = iota
+	// Waiting for the memory budget to admit the session.
+	phaseBudget
+	// Relaying and filtering the SSH handshake until handoff.
+	phaseRelay
+	numPhases
+)
+
+var phaseNames = [numPhases]string{"approval", "budget", "relay"}
+
+// sessionStats accounts for the work the guard does on behalf of one session.
+// The guard terminates SSH on both sides of the proxy before handoff, so every
+// byte counted here was decrypted or encrypted by the guard.
+type sessionStats struct {
+	scope     Scope
+	lastPhase time.Time
+	phases    [numPhases]time.Duration
+
+	approved        bool
+	handedOff       bool
+	clientBytes     int64
+	serverBytes     int64
+	filterFallbacks int32
+	// bufferPeak is the most budget the session held: its reservation and
+	// the peak its windows borrowed.
+	bufferPeak int64
+
+	sampled    bool
+	mallocs    uint64
+	allocBytes uint64
+
+	prefetchHit   bool
+	prefetchSaved time.Duration
+}
+
+// endPhase attributes the time since the previous phase ended to p.
+func (s *sessionStats) endPhase(p sessionPhase) {
+	now := time.Now()
+	s.phases[p] += now.Sub(s.lastPhase)
+	s.lastPhase = now
+}
+
+// countFallback is called from the proxy when the filter has to fall back to
+// asking for approval of all commands.
+func (s *sessionStats) countFallback() {
+	atomic.AddInt32(&s.filterFallbacks, 1)
+}
+
+// scopeUsage aggregates sessionStats for a scope.
+type scopeUsage struct {
+	sessions        int
+	approved        int
+	handedOff       int
+	phases          [numPhases]time.Duration
+	clientBytes     int64
+	serverBytes     int64
+	filterFallbacks int64
+	bufferPeak      int64
+
+	sampledSessions int
+	mallocs         uint64
+	allocBytes      uint64
+
+	prefetchHits  int
+	prefetchSaved time.Duration
+}
+
+type accounting struct {
+	mu       sync.Mutex
+	started  uint64
+	byScope  map[Scope]*scopeUsage
+	memStats runtime.MemStats
+}
+
+func newAccounting() *accounting {
+	return &accounting{byScope: make(map[Scope]*scopeUsage)}
+}
+
+func (a *accounting) start(scope Scope) *sessionStats {
+	a.mu.Lock()
+	a.started++
+	sampled := a.started%allocSampleInterval == 1
+	a.mu.Unlock()
+	return &sessionStats{scope: scope, lastPhase: time.Now(), sampled: sampled}
+}
+
+// sampleAllocs records the allocation counters at the start of the relay and
+// replaces them with the difference at its end. Concurrent sessions allocate
+// from the same heap, so the figures are an upper bound for the session.
+func (a *accounting) sampleAllocs(s *sessionStats, end bool) {
+	if !s.sampled {
+		return
+	}
+	a.mu.Lock()
+	runtime.ReadMemStats(&a.memStats)
+	mallocs, allocBytes := a.memStats.Mallocs, a.memStats.TotalAlloc
+	a.mu.Unlock()
+	if end {
+		s.mallocs, s.allocBytes = mallocs-s.mallocs, allocBytes-s.allocBytes
+	} else {
+		s.mallocs, s.allocBytes = mallocs, allocBytes
+	}
+}
+
+func (a *accounting) finish(s *sessionStats) {
+	a.mu.Lock()
+	defer a.mu.Unlock()
+	usage, ok := a.byScope[s.scope]
+	if !ok {
+		usage = &scopeUsage{}
+		a.byScope[s.scope] = usage
+	}
+	usage.sessions++
+	if s.approved {
+		usage.approved++
+	}
+	if s.handedOff {
+		usage.handedOff++
+	}
+	for p := range s.phases {
+		usage.phases[p] += s.phases[p]
+	}
+	usage.clientBytes += s.clientBytes
+	usage.serverBytes += s.serverBytes
+	usage.filterFallbacks += int64(atomic.LoadInt32(&s.filterFallbacks))
+	if s.bufferPeak > usage.bufferPeak {
+		usage.bufferPeak = s.bufferPeak
+	}
+	if s.prefetchHit {
+		usage.prefetchHits++
+		usage.prefetchSaved += s.prefetchSaved
+	}
+	if s.sampled && s.handedOff {
+		usage.sampledSessions++
+		usage.mallocs += s.mallocs
+		usage.allocBytes += s.allocBytes
+	}
+}
+
+// WriteDiagnostics writes per-scope session accounting, scopes with the most
+// time spent relaying handshakes first.
+func (ag *Agent) WriteDiagnostics(w io.Writer) {
+	a := ag.accounting
+	a.mu.Lock()
+	defer a.mu.Unlock()
+
+	scopes := make([]Scope, 0, len(a.byScope))
+	for scope := range a.byScope {
+		scopes = append(scopes, scope)
+	}
+	sort.Slice(scopes, func(i, j int) bool {
+		return a.byScope[scopes[i]].phases[phaseRelay] > a.byScope[scopes[j]].phases[phaseRelay]
+	})
+
+	fmt.Fprintf(w, "Guard up %s, %d sessions\n", time.Since(ag.startTime), a.started)
+	if ag.budget != nil {
+		inUse, limit := ag.budget.Usage()
+		fmt.Fprintf(w, "Session buffers: %d/%d bytes, peak %d\n", inUse, limit, ag.budget.Peak())
+	}
+	for _, scope := range scopes {
+		usage := a.byScope[scope]
+		fmt.Fprintf(w, "%s -> %s@%s: %d sessions, %d approved, %d handed off\n",
+			scope.Client, scope.ServiceUsername, scope.ServiceHostname, usage.sessions, usage.approved, usage.handedOff)
+		for p, d := range usage.phases {
+			fmt.Fprintf(w, "  %-8s %s\n", phaseNames[p], d)
+		}
+		fmt.Fprintf(w, "  relayed  %d bytes with client, %d bytes with server, %d filter fallbacks\n",
+			usage.clientBytes, usage.serverBytes, usage.filterFallbacks)
+		if usage.bufferPeak > 0 {
+			fmt.Fprintf(w, "  buffers  %d bytes peak/session\n", usage.bufferPeak)
+		}
+		fmt.Fprintf(w, "  prefetch %d/%d sessions hit, %s saved\n",
+			usage.prefetchHits, usage.approved, usage.prefetchSaved)
+		if usage.sampledSessions > 0 {
+			fmt.Fprintf(w, "  allocs   %d/session, %d bytes/session (%d sampled)\n",
+				usage.mallocs/uint64(usage.sampledSessions), usage.allocBytes/uint64(usage.sampledSessions), usage.sampledSessions)
+		}
+	}
+	ag.servers.writeDiagnostics(w)
+}
@@ -7,14 +7,28 @@ import (
 	"net"
 	"os"
 	"os/user"
-	"path"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
 
 	"github.com/hashicorp/yamux"
 	"golang.org/x/crypto/ssh"
-	"golang.org/x/crypto/ssh/knownhosts"
 	"golang.org/x/crypto/ssh/terminal"
 )
 
+// Each delegated session buffers up to one yamux window per stream, plus the
+// copy buffers of the relay in each direction. Over fixed channels only the
+// initial windows and the mux's frame buffers are reserved; the rest is
+// borrowed as the windows grow.
+const sessionStreamWindow = 256 * 1024
+const sessionReservation = 3*sessionStreamWindow + 4*32*1024
+const fixedChannelsReservation = numChannels*muxInitialWindow + 3*maxFramePayload + 4*32*1024
+
+// An approved session waits at most this long for its buffers to fit in the
+// memory budget before it is refused.
+const sessionBudgetWait = 30 * time.Second
+
 type InputType uint8
 
 const (
@@ -25,6 +39,19 @@ const (
 type Agent struct {
 	policy Policy
 	store  *Store
+
+	startTime     time.Time
+	firstApproval sync.Once
+
+	throttle   *throttle
+	budget     *MemoryBudget
+	accounting *accounting
+	prefetch   *prefetcher
+	servers    *serverCapsCache
+
+	// Outstanding tokens issued for approved batch plans.
+	grantsMu sync.Mutex
+	grants   map[string]batchGrant
 }
 
 func NewGuardian(policyConfigPath string, inType InputType) (*Agent, error) {
@@ -46,34 +73,81 @@ func NewGuardian(policyConfigPath string, inType InputType) (*Agent, error) {
 		return nil, fmt.Errorf("Failed to load policy store: %s", err)
 	}
 	return &Agent{
-			store:  store,
-			policy: Policy{Store: store, UI: ui}},
+			store:      store,
+			policy:     Policy{Store: store, UI: ui},
+			throttle:   newThrottle(),
+			accounting: newAccounting(),
+			prefetch:   newPrefetcher(),
+			servers:    loadServerCaps(policyConfigPath + ".servers"),
+			startTime:  time.Now()},
 		nil
 }
 
-func (agent *Agent) proxySSH(scope Scope, toClient net.Conn, toServer net.Conn, control net.Conn, fil *ssh.Filter) error {
+// SetRequestRate limits how often each client may cause the user to be
+// prompted: burst prompts at once, refilled at rate per second. Requests the
+// policy approves without asking are not limited. A rate of 0 disables the
+// limit.
+func (agent *Agent) SetRequestRate(rate float64, burst int) {
+	agent.throttle.setRate(rate, burst)
+}
+
+// SetMemoryBudget caps the buffer memory committed across all sessions. Each
+// session reserves a share for its windows and relay buffers; sessions beyond
+// the budget wait up to sessionBudgetWait for earlier ones to finish and are
+// then refused. Requests sent in chunks reserve their size while they are
+// reassembled. A limit of 0 disables it.
+func (agent *Agent) SetMemoryBudget(limit int64) {
+	if limit <= 0 {
+		agent.budget = nil
+		return
+	}
+	agent.budget = NewMemoryBudget(limit)
+}
+
+func (agent *Agent) proxySSH(stats *sessionStats, toClient net.Conn, toServer net.Conn, control net.Conn, fil *ssh.Filter) error {
+	scope := stats.scope
 	curuser, err := user.Current()
 	if err != nil {
 		return fmt.Errorf("Failed to get current user: %s", err)
 	}
 
+	hostKeyAlgs, hit, saved := agent.prefetch.hostKeyAlgs(scope.ServiceHostname, toServer.RemoteAddr(), userKnownHostsPath(curuser.HomeDir), false)
+	stats.prefetchHit, stats.prefetchSaved = hit, saved
+	if hit {
+		log.Printf("Session %s@%s for %s: prefetch hit, saved %s",
+			scope.ServiceUsername, scope.ServiceHostname, scope.Client, saved)
+	}
 	clientConfig := &ssh.ClientConfig{
 		User: scope.ServiceUsername,
 		HostKeyCallback: func(hostname string, remote net.Addr, key ssh.PublicKey) error {
 			return HostKeyCallback(hostname, remote, key, agent.policy.UI)
 		},
 		Auth:              getAuth(scope.ServiceUsername, scope.ServiceHostname, curuser.HomeDir, agent.policy.UI),
-		HostKeyAlgorithms: knownhosts.OrderHostKeyAlgs(scope.ServiceHostname, toServer.RemoteAddr(), path.Join(curuser.HomeDir, ".ssh", "known_hosts")),
+		HostKeyAlgorithms: hostKeyAlgs,
 	}
 
-	meteredConnToServer := CustomConn{Conn: toServer}
-	proxy, err := ssh.NewProxyConn(scope.ServiceHostname, toClient, &meteredConnToServer, clientConfig, fil)
+	meteredConnToClient := CustomConn{Conn: toClient}
+	sniffer := &serverHelloSniffer{Conn: toServer}
+	meteredConnToServer := CustomConn{Conn: sniffer}
+	agent.accounting.sampleAllocs(stats, false)
+	proxy, err := ssh.NewProxyConn(scope.ServiceHostname, &meteredConnToClient, &meteredConnToServer, clientConfig, fil)
 	if err != nil {
+		stats.endPhase(phaseRelay)
 		return err
 	}
 	done := proxy.Run()
 
 	err = <-done
+	stats.endPhase(phaseRelay)
+	agent.accounting.sampleAllocs(stats, true)
+	clientTraffic := meteredConnToClient.Traffic()
+	traffic := meteredConnToServer.Traffic()
+	stats.clientBytes = clientTraffic.BytesRead + clientTraffic.BytesWritten
+	stats.serverBytes = traffic.BytesRead + traffic.BytesWritten
+	stats.handedOff = err == nil
+	agent.servers.record(scope.ServiceHostname, sniffer.result(), atomic.LoadInt32(&stats.filterFallbacks) > 0, stats.handedOff)
+	log.Printf("Session %s@%s for %s: %d bytes from server, %d bytes to server before handoff",
+		scope.ServiceUsername, scope.ServiceHostname, scope.Client, traffic.BytesRead, traffic.BytesWritten)
 	var msgNum byte
 	var msg interface{}
 	if err != nil {
@@ -82,17 +156,31 @@ func (agent *Agent) proxySSH(scope Scope, toClient net.Conn, toServer net.Conn,
 
 	} else {
 		msg = HandoffCompleteMessage{
-			NextTransportByte: uint32(meteredConnToServer.BytesRead() - proxy.BufferedFromServer())}
+			NextTransportByte: uint32(traffic.BytesRead - int64(proxy.BufferedFromServer()))}
 		msgNum = MsgHandoffComplete
 	}
 	packet := ssh.Marshal(msg)
 	return WriteControlPacket(control, msgNum, packet)
 }
 
-func (agent *Agent) HandleConnection(conn net.Conn) error {
+// clientConn is a connection from an intermediary together with the options it
+// negotiated.
+type clientConn struct {
+	net.Conn
+	options extensionOptions
+
+	// Reassembles chunked requests.
+	chunks requestAssembler
+}
+
+func (agent *Agent) HandleConnection(c net.Conn) error {
 	log.Printf("New incoming connection")
 
+	conn := &clientConn{Conn: c}
+	conn.chunks.budget = agent.budget
+	defer conn.chunks.discard()
 	var scope Scope
+	prefetchPending := false
 	for {
 		msgNum, payload, err := ReadControlPacket(conn)
 		if err == io.EOF || err == io.ErrClosedPipe {
@@ -101,6 +189,24 @@ func (agent *Agent) HandleConnection(conn net.Conn) error {
 		if err != nil {
 			return fmt.Errorf("Failed to read control packet: %s", err)
 		}
+		if msgNum == MsgRequestChunk {
+			done, chunkedMsgNum, request, err := conn.chunks.add(payload, conn.options.maxRequest)
+			if err != nil {
+				return err
+			}
+			if !done {
+				continue
+			}
+			msgNum, payload = chunkedMsgNum, request
+		}
+		// The prefetch waits for the client's first message, so that
+		// sga-stub's periodic probes do not start one.
+		if prefetchPending && msgNum != MsgAgentForwardingNotice {
+			prefetchPending = false
+			if !isGuardProbe(msgNum, payload) {
+				agent.prefetch.start(scope.Client, conn.RemoteAddr())
+			}
+		}
 		switch msgNum {
 		case MsgAgentForwardingNotice:
 			notice := new(AgentForwardingNoticeMsg)
@@ -108,6 +214,7 @@ func (agent *Agent) HandleConnection(conn net.Conn) error {
 				return fmt.Errorf("Failed to unmarshal AgentForwardingNoticeMsg: %s", err)
 			}
 			scope.Client = notice.Client
+			prefetchPending = true
 		case MsgExecutionRequest:
 			execReq := new(ExecutionRequestMessage)
 			if err = ssh.Unmarshal(payload, execReq); err != nil {
@@ -116,11 +223,40 @@ func (agent *Agent) HandleConnection(conn net.Conn) error {
 			scope.ServiceHostname = execReq.Server
 			scope.ServiceUsername = execReq.User
 			agent.handleExecutionRequest(conn, scope, execReq.Command)
+		case MsgSubsystemRequest:
+			subsystemReq := new(SubsystemRequestMessage)
+			if err = ssh.Unmarshal(payload, subsystemReq); err != nil {
+				return fmt.Errorf("Failed to unmarshal SubsystemRequestMessage: %s", err)
+			}
+			scope.ServiceHostname = subsystemReq.Server
+			scope.ServiceUsername = subsystemReq.User
+			agent.handleSubsystemRequest(conn, scope, subsystemReq.Subsystem)
+		case MsgForwardingRequest:
+			forwardingReq := new(ForwardingRequestMessage)
+			if err = ssh.Unmarshal(payload, forwardingReq); err != nil {
+				return fmt.Errorf("Failed to unmarshal ForwardingRequestMessage: %s", err)
+			}
+			scope.ServiceHostname = forwardingReq.Server
+			scope.ServiceUsername = forwardingReq.User
+			agent.handleForwardingRequest(conn, scope, forwardingReq.Targets)
+		case MsgBatchExecutionRequest:
+			if err = agent.handleBatchRequest(conn, scope.Client, payload); err != nil {
+				return err
+			}
+		case MsgTokenExecutionRequest:
+			tokenReq := new(TokenExecutionRequestMessage)
+			if err = ssh.Unmarshal(payload, tokenReq); err != nil {
+				return fmt.Errorf("Failed to unmarshal TokenExecutionRequestMessage: %s", err)
+			}
+			scope.ServiceHostname = tokenReq.Server
+			scope.ServiceUsername = tokenReq.User
+			agent.handleTokenExecutionRequest(conn, scope, tokenReq.Command, tokenReq.Token)
 		case MsgAgentCExtension:
 			queryExtension := new(AgentCExtensionMsg)
 			ssh.Unmarshal(payload, queryExtension)
 			if queryExtension.ExtensionType == AgentGuardExtensionType {
-				WriteControlPacket(conn, MsgAgentSuccess, []byte{})
+				conn.options = parseExtensionOptions(queryExtension.Contents).accept()
+				WriteControlPacket(conn, MsgAgentSuccess, conn.options.marshal())
 				continue
 			}
 			fallthrough
@@ -131,41 +267,155 @@ func (agent *Agent) HandleConnection(conn net.Conn) error {
 	}
 }
 
-func (ag *Agent) handleExecutionRequest(conn net.Conn, scope Scope, cmd string) error {
-	err := ag.policy.RequestApproval(scope, cmd)
+func (ag *Agent) handleExecutionRequest(conn *clientConn, scope Scope, cmd string) error {
+	stats := ag.accounting.start(scope)
+	defer ag.accounting.finish(stats)
+	approveAll := ag.servers.lacksNoMoreSessions(scope.ServiceHostname)
+	gate := ag.throttle.gate(denialKey{Scope: scope, Command: cmd})
+	policy := ag.policy.gated(gate.admit)
+	var err error
+	if approveAll {
+		err = policy.RequestApprovalForAllCommands(scope, commandRequest(cmd))
+	} else {
+		err = policy.RequestApproval(scope, cmd)
+	}
+	gate.done(err)
+	stats.endPhase(phaseApproval)
 	if err != nil {
 		WriteControlPacket(conn, MsgExecutionDenied,
 			ssh.Marshal(ExecutionDeniedMessage{Reason: err.Error()}))
 		return nil
 	}
-	filter := ssh.NewFilter(cmd, func() error { return ag.policy.RequestApprovalForAllCommands(scope) })
-	WriteControlPacket(conn, MsgExecutionApproved, []byte{})
+	filter := ssh.NewFilter(cmd, ag.filterFallback(stats, approveAll, commandRequest(cmd)))
+	return ag.proxyApprovedSession(conn, stats, filter)
+}
 
-	ymux, err := yamux.Server(conn, nil)
+func (ag *Agent) handleSubsystemRequest(conn *clientConn, scope Scope, subsystem string) error {
+	stats := ag.accounting.start(scope)
+	defer ag.accounting.finish(stats)
+	approveAll := ag.servers.lacksNoMoreSessions(scope.ServiceHostname)
+	gate := ag.throttle.gate(denialKey{Scope: scope, Command: subsystem, Subsystem: true})
+	policy := ag.policy.gated(gate.admit)
+	var err error
+	if approveAll {
+		err = policy.RequestApprovalForAllCommands(scope, subsystemRequest(subsystem))
+	} else {
+		err = policy.RequestSubsystemApproval(scope, subsystem)
+	}
+	gate.done(err)
+	stats.endPhase(phaseApproval)
 	if err != nil {
-		return fmt.Errorf("Failed to start ymux: %s", err)
+		WriteControlPacket(conn, MsgExecutionDenied,
+			ssh.Marshal(ExecutionDeniedMessage{Reason: err.Error()}))
+		return nil
 	}
-	defer ymux.Close()
+	// The filter matches the subsystem name carried by the session's
+	// "subsystem" request, the same way it matches an "exec" command.
+	filter := ssh.NewFilter(subsystem, ag.filterFallback(stats, approveAll, subsystemRequest(subsystem)))
+	return ag.proxyApprovedSession(conn, stats, filter)
+}
 
-	control, err := ymux.Accept()
-	if err != nil {
-		return fmt.Errorf("Failed to accept control stream: %s", err)
+// filterFallback returns the fallback the filter calls when the server rejects
+// no-more-sessions, so the command alone cannot be enforced. If the request was
+// already approved for all commands, because the server was known not to
+// support it, the user is not asked again.
+func (ag *Agent) filterFallback(stats *sessionStats, approvedAll bool, request string) func() error {
+	return func() error {
+		stats.countFallback()
+		if approvedAll {
+			return nil
+		}
+		return ag.policy.RequestApprovalForAllCommands(stats.scope, request)
 	}
-	defer control.Close()
+}
 
-	sshData, err := ymux.Accept()
+// handleForwardingRequest only records the user's decision; the channels are
+// opened by the client after handoff, over its own connection to the server.
+func (ag *Agent) handleForwardingRequest(conn *clientConn, scope Scope, targets []string) {
+	gate := ag.throttle.gate(denialKey{Scope: scope, Command: strings.Join(targets, ","), Forwarding: true})
+	err := ag.policy.gated(gate.admit).RequestForwardingApproval(scope, targets)
+	gate.done(err)
 	if err != nil {
-		return fmt.Errorf("Failed to accept data stream: %s", err)
+		WriteControlPacket(conn, MsgExecutionDenied,
+			ssh.Marshal(ExecutionDeniedMessage{Reason: err.Error()}))
+		return
 	}
-	defer sshData.Close()
+	WriteControlPacket(conn, MsgExecutionApproved, []byte{})
+}
 
-	transport, err := ymux.Accept()
+// proxyApprovedSession reserves the session's buffers and tells the client it
+// was approved, or why it cannot proceed, then proxies it until handoff.
+func (ag *Agent) proxyApprovedSession(conn *clientConn, stats *sessionStats, filter *ssh.Filter) error {
+	scope := stats.scope
+	stats.approved = true
+	ag.prefetch.record(scope)
+	ag.firstApproval.Do(func() {
+		log.Printf("Time to first approved session: %s", time.Since(ag.startTime))
+	})
+
+	waitStart := time.Now()
+	reservation := int64(sessionReservation)
+	if conn.options.fixedChannels {
+		reservation = fixedChannelsReservation
+	}
+	reserved, err := ag.budget.Acquire(reservation, sessionBudgetWait)
+	stats.endPhase(phaseBudget)
 	if err != nil {
-		return fmt.Errorf("Failed to get transport stream: %s", err)
+		log.Printf("Session %s@%s for %s refused: %s", scope.ServiceUsername, scope.ServiceHostname, scope.Client, err)
+		ag.policy.UI.Alert(fmt.Sprintf("Request by %s on %s@%s was approved but could not start: %s",
+			scope.Client, scope.ServiceUsername, scope.ServiceHostname, err))
+		WriteControlPacket(conn, MsgExecutionDenied,
+			ssh.Marshal(ExecutionDeniedMessage{Reason: err.Error()}))
+		return nil
+	}
+	defer ag.budget.Release(reserved)
+	stats.bufferPeak = reserved
+	if ag.budget != nil {
+		inUse, limit := ag.budget.Usage()
+		log.Printf("Session %s@%s for %s: reserved %d buffer bytes after %s (guard total %d/%d)",
+			scope.ServiceUsername, scope.ServiceHostname, scope.Client, reserved, time.Since(waitStart), inUse, limit)
+	}
+	WriteControlPacket(conn, MsgExecutionApproved, []byte{})
+
+	var control, sshData, transport net.Conn
+	if conn.options.fixedChannels {
+		mux := newChanMux(conn.Conn, ag.budget)
+		defer func() {
+			mux.Close()
+			stats.bufferPeak += mux.PeakBorrowed()
+		}()
+		control = mux.Channel(controlChannel)
+		sshData = mux.Channel(dataChannel)
+		transport = mux.Channel(transportChannel)
+	} else {
+		ymuxConfig := yamux.DefaultConfig()
+		ymuxConfig.MaxStreamWindowSize = sessionStreamWindow
+		ymux, err := yamux.Server(conn.Conn, ymuxConfig)
+		if err != nil {
+			return fmt.Errorf("Failed to start ymux: %s", err)
+		}
+		defer ymux.Close()
+
+		control, err = ymux.Accept()
+		if err != nil {
+			return fmt.Errorf("Failed to accept control stream: %s", err)
+		}
+
+		sshData, err = ymux.Accept()
+		if err != nil {
+			control.Close()
+			return fmt.Errorf("Failed to accept data stream: %s", err)
+		}
+
+		transport, err = ymux.Accept()
+		if err != nil {
+			sshData.Close()
+			control.Close()
+			return fmt.Errorf("Failed to get transport stream: %s", err)
+		}
 	}
-	defer transport.Close()
 
-	err = ag.proxySSH(scope, sshData, transport, control, filter)
+	err = ag.proxySSH(stats, sshData, transport, control, filter)
 	transport.Close()
 	sshData.Close()
 	control.Close()
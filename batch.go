@@ -0,0 +1,280 @@
+package guardianagent
+
+import (
+	"crypto/rand"
+	"encoding/hex"
+	"encoding/json"
+	"fmt"
+	"io/ioutil"
+	"os"
+	"path"
+	"strings"
+	"time"
+
+	"golang.org/x/crypto/ssh"
+)
+
+// BatchTokenLifetime bounds how long a token handed out for a batch plan
+// stays redeemable.
+const BatchTokenLifetime = 10 * time.Minute
+
+const batchTokensName = ".agent-guard-tokens"
+
+type batchGrant struct {
+	scope   Scope
+	cmd     string
+	expires time.Time
+}
+
+func newBatchToken() (string, error) {
+	var b [16]byte
+	if _, err := rand.Read(b[:]); err != nil {
+		return "", err
+	}
+	return hex.EncodeToString(b[:]), nil
+}
+
+func (ag *Agent) handleBatchRequest(conn *clientConn, client string, payload []byte) error {
+	batchReq := new(BatchExecutionRequestMessage)
+	if err := ssh.Unmarshal(payload, batchReq); err != nil {
+		return fmt.Errorf("Failed to unmarshal BatchExecutionRequestMessage: %s", err)
+	}
+	packets, err := UnmarshalList(batchReq.Requests)
+	if err != nil {
+		return fmt.Errorf("Failed to parse batch request: %s", err)
+	}
+	items := make([]BatchItem, len(packets))
+	for idx, packet := range packets {
+		execReq := new(ExecutionRequestMessage)
+		if err = ssh.Unmarshal(packet, execReq); err != nil {
+			return fmt.Errorf("Failed to unmarshal batch item: %s", err)
+		}
+		items[idx] = BatchItem{
+			Scope: Scope{
+				Client:          client,
+				ServiceUsername: execReq.User,
+				ServiceHostname: execReq.Server,
+			},
+			Command: execReq.Command,
+		}
+	}
+
+	key := denialKey{Scope: Scope{Client: client}}
+	approved := ag.policy.gated(func() error { return ag.throttle.admit(key) }).RequestBatchApproval(client, items)
+
+	tokens := make([][]byte, len(items))
+	expires := time.Now().Add(BatchTokenLifetime)
+	ag.grantsMu.Lock()
+	if ag.grants == nil {
+		ag.grants = make(map[string]batchGrant)
+	}
+	for token, grant := range ag.grants {
+		if time.Now().After(grant.expires) {
+			delete(ag.grants, token)
+		}
+	}
+	for idx, item := range items {
+		if !approved[idx] {
+			continue
+		}
+		token, err := newBatchToken()
+		if err != nil {
+			ag.grantsMu.Unlock()
+			return fmt.Errorf("Failed to generate batch token: %s", err)
+		}
+		ag.grants[token] = batchGrant{scope: item.Scope, cmd: item.Command, expires: expires}
+		tokens[idx] = []byte(token)
+	}
+	ag.grantsMu.Unlock()
+
+	// A reply to a large plan can exceed a control packet, so it is chunked
+	// like the request.
+	return writeRequest(conn, conn.options.maxRequest, MsgBatchExecutionReply,
+		ssh.Marshal(BatchExecutionReplyMessage{Tokens: MarshalList(tokens)}))
+}
+
+// redeemBatchToken consumes token if it was granted for exactly this scope and
+// command.
+func (ag *Agent) redeemBatchToken(scope Scope, cmd string, token string) bool {
+	ag.grantsMu.Lock()
+	defer ag.grantsMu.Unlock()
+	grant, ok := ag.grants[token]
+	if !ok {
+		return false
+	}
+	delete(ag.grants, token)
+	return grant.scope == scope && grant.cmd == cmd && time.Now().Before(grant.expires)
+}
+
+func (ag *Agent) handleTokenExecutionRequest(conn *clientConn, scope Scope, cmd string, token string) error {
+	stats := ag.accounting.start(scope)
+	defer ag.accounting.finish(stats)
+	if !ag.redeemBatchToken(scope, cmd, token) {
+		WriteControlPacket(conn, MsgExecutionDenied,
+			ssh.Marshal(ExecutionDeniedMessage{Reason: "invalid or expired batch token"}))
+		return nil
+	}
+	ag.policy.UI.Inform(fmt.Sprintf("Request by %s to run '%s' on %s@%s APPROVED by batch token",
+		scope.Client, cmd, scope.ServiceUsername, scope.ServiceHostname))
+	// The plan approved this command only, which the server cannot be made to
+	// enforce if it lacks no-more-sessions.
+	approveAll := ag.servers.lacksNoMoreSessions(scope.ServiceHostname)
+	if approveAll {
+		gate := ag.throttle.gate(denialKey{Scope: scope, Command: cmd})
+		err := ag.policy.gated(gate.admit).RequestApprovalForAllCommands(scope, commandRequest(cmd))
+		gate.done(err)
+		if err != nil {
+			WriteControlPacket(conn, MsgExecutionDenied,
+				ssh.Marshal(ExecutionDeniedMessage{Reason: err.Error()}))
+			return nil
+		}
+	}
+	stats.endPhase(phaseApproval)
+	filter := ssh.NewFilter(cmd, ag.filterFallback(stats, approveAll, commandRequest(cmd)))
+	return ag.proxyApprovedSession(conn, stats, filter)
+}
+
+type batchToken struct {
+	Token   string `json:"Token"`
+	User    string `json:"User"`
+	Server  string `json:"Server"`
+	Command string `json:"Command"`
+	Expires int64  `json:"Expires"`
+}
+
+// batchTokensDir holds one file per token, named by the token, so that
+// sessions storing and taking tokens concurrently never rewrite each other's.
+// Removing a token's file is what claims it.
+func batchTokensDir() string {
+	return path.Join(UserRuntimeDir(), batchTokensName)
+}
+
+func saveBatchToken(t batchToken) error {
+	dir := batchTokensDir()
+	if err := os.MkdirAll(dir, 0700); err != nil {
+		return err
+	}
+	buf, err := json.Marshal(t)
+	if err != nil {
+		return err
+	}
+	// Written under a temporary name so that a reader never sees a partial
+	// token.
+	tmp, err := ioutil.TempFile(dir, ".tmp")
+	if err != nil {
+		return err
+	}
+	_, err = tmp.Write(buf)
+	if closeErr := tmp.Close(); err == nil {
+		err = closeErr
+	}
+	if err == nil {
+		err = os.Rename(tmp.Name(), path.Join(dir, t.Token))
+	}
+	if err != nil {
+		os.Remove(tmp.Name())
+	}
+	return err
+}
+
+// takeBatchToken removes and returns a token issued for exactly this command,
+// or "" if there is none. Expired tokens found along the way are removed.
+func takeBatchToken(user string, server string, cmd string) string {
+	dir := batchTokensDir()
+	files, err := ioutil.ReadDir(dir)
+	if err != nil {
+		return ""
+	}
+	now := time.Now().Unix()
+	for _, fi := range files {
+		if strings.HasPrefix(fi.Name(), ".") {
+			continue
+		}
+		file := path.Join(dir, fi.Name())
+		buf, err := ioutil.ReadFile(file)
+		if err != nil {
+			// Taken by another session.
+			continue
+		}
+		var t batchToken
+		if err = json.Unmarshal(buf, &t); err != nil || t.Expires <= now {
+			os.Remove(file)
+			continue
+		}
+		if t.User == user && t.Server == server && t.Command == cmd {
+			// Of sessions racing for the token, only the one whose removal
+			// succeeds may use it.
+			if os.Remove(file) == nil {
+				return t.Token
+			}
+		}
+	}
+	return ""
+}
+
+// RequestBatchApproval asks the agent to approve all cmds in one decision. The
+// tokens for approved commands are stored so that later sessions running
+// exactly those commands are approved without prompting. It returns which
+// commands were approved.
+func RequestBatchApproval(cmds []SSHCommand) ([]bool, error) {
+	cli := client{}
+	defer cli.Close()
+	if err := cli.connectToAgent(); err != nil {
+		return nil, err
+	}
+
+	packets := make([][]byte, len(cmds))
+	for idx, cmd := range cmds {
+		packets[idx] = ssh.Marshal(ExecutionRequestMessage{
+			User:    cmd.Username,
+			Command: cmd.Cmd,
+			Server:  cmd.HostPort,
+		})
+	}
+	batchReq := BatchExecutionRequestMessage{Requests: MarshalList(packets)}
+	err := writeRequest(cli.agentConn, cli.guardOptions.maxRequest, MsgBatchExecutionRequest, ssh.Marshal(batchReq))
+	if err != nil {
+		return nil, fmt.Errorf("failed to send MsgBatchExecutionRequest to agent: %s", err)
+	}
+
+	msgNum, msg, err := cli.readControlPacket()
+	if err != nil {
+		return nil, fmt.Errorf("failed to get batch approval from agent: %s", err)
+	}
+	if msgNum != MsgBatchExecutionReply {
+		return nil, fmt.Errorf("failed to get batch approval from agent, unknown reply: %d", msgNum)
+	}
+	reply := new(BatchExecutionReplyMessage)
+	if err = ssh.Unmarshal(msg, reply); err != nil {
+		return nil, fmt.Errorf("failed to unmarshal BatchExecutionReplyMessage: %s", err)
+	}
+	issued, err := UnmarshalList(reply.Tokens)
+	if err != nil || len(issued) != len(cmds) {
+		return nil, fmt.Errorf("malformed batch reply from agent")
+	}
+
+	approved := make([]bool, len(cmds))
+	expires := time.Now().Add(BatchTokenLifetime).Unix()
+	for idx, token := range issued {
+		if len(token) == 0 {
+			continue
+		}
+		// Tokens name files, so anything but the hex the guard generates is
+		// refused.
+		if _, err = hex.DecodeString(string(token)); err != nil {
+			return nil, fmt.Errorf("malformed batch token from agent")
+		}
+		approved[idx] = true
+		err = saveBatchToken(batchToken{
+			Token:   string(token),
+			User:    cmds[idx].Username,
+			Server:  cmds[idx].HostPort,
+			Command: cmds[idx].Cmd,
+			Expires: expires,
+		})
+		if err != nil {
+			return approved, fmt.Errorf("failed to store batch token: %s", err)
+		}
+	}
+	return approved, nil
+}
@@ -0,0 +1,103 @@
+package guardianagent
+
+import (
+	"bytes"
+	"fmt"
+	"io/ioutil"
+	"os"
+	"sync"
+	"testing"
+	"time"
+
+	"golang.org/x/crypto/ssh"
+)
+
+func TestBatchTokensTakenOnce(t *testing.T) {
+	dir, err := ioutil.TempDir("", "batch-tokens")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(dir)
+	oldRuntimeDir := os.Getenv("XDG_RUNTIME_DIR")
+	os.Setenv("XDG_RUNTIME_DIR", dir)
+	defer os.Setenv("XDG_RUNTIME_DIR", oldRuntimeDir)
+
+	const issued = 20
+	expires := time.Now().Add(BatchTokenLifetime).Unix()
+	for i := 0; i < issued; i++ {
+		token, err := newBatchToken()
+		if err != nil {
+			t.Fatal(err)
+		}
+		err = saveBatchToken(batchToken{Token: token, User: "u", Server: "s", Command: "c", Expires: expires})
+		if err != nil {
+			t.Fatal(err)
+		}
+	}
+	saveBatchToken(batchToken{Token: "00", User: "u", Server: "s", Command: "c", Expires: 1})
+
+	var mu sync.Mutex
+	taken := make(map[string]int)
+	var wg sync.WaitGroup
+	for i := 0; i < 2*issued; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			if token := takeBatchToken("u", "s", "c"); token != "" {
+				mu.Lock()
+				taken[token]++
+				mu.Unlock()
+			}
+		}()
+	}
+	wg.Wait()
+
+	if len(taken) != issued {
+		t.Errorf("%d distinct tokens taken, want %d", len(taken), issued)
+	}
+	for token, n := range taken {
+		if n != 1 {
+			t.Errorf("token %s taken %d times", token, n)
+		}
+	}
+	if _, ok := taken["00"]; ok {
+		t.Errorf("expired token taken")
+	}
+}
+
+func TestLargeBatchReplyRoundTrip(t *testing.T) {
+	tokens := make([][]byte, 5000)
+	for i := range tokens {
+		tokens[i] = []byte(fmt.Sprintf("%032x", i))
+	}
+	payload := ssh.Marshal(BatchExecutionReplyMessage{Tokens: MarshalList(tokens)})
+	if len(payload) <= MaxAgentPacketSize {
+		t.Fatalf("reply of %d bytes does not need chunking", len(payload))
+	}
+
+	var wire bytes.Buffer
+	if err := writeRequest(&wire, MaxChunkedRequestSize, MsgBatchExecutionReply, payload); err != nil {
+		t.Fatal(err)
+	}
+	var chunks requestAssembler
+	for {
+		msgNum, chunk, err := ReadControlPacket(&wire)
+		if err != nil {
+			t.Fatal(err)
+		}
+		if msgNum != MsgRequestChunk {
+			t.Fatalf("unexpected message %d", msgNum)
+		}
+		done, msgNum, reply, err := chunks.add(chunk, MaxChunkedRequestSize)
+		if err != nil {
+			t.Fatal(err)
+		}
+		if !done {
+			continue
+		}
+		if msgNum != MsgBatchExecutionReply || !bytes.Equal(reply, payload) {
+			t.Errorf("reassembled reply differs")
+		}
+		return
+	}
+}
@@ -0,0 +1,127 @@
+package guardianagent
+
+import (
+	"fmt"
+	"sync"
+	"time"
+)
+
+// MemoryBudget caps the bytes the guard may commit to session buffers across
+// all sessions. Each session reserves a floor up front, and Acquire waits, for
+// a bounded time, while the budget is exhausted. Beyond the floor, sessions
+// borrow with TryAcquire as their windows grow, and give bytes back while
+// other sessions wait for admission.
+type MemoryBudget struct {
+	mu      sync.Mutex
+	cond    *sync.Cond
+	limit   int64
+	inUse   int64
+	peak    int64
+	waiting int
+}
+
+func NewMemoryBudget(limit int64) *MemoryBudget {
+	b := &MemoryBudget{limit: limit}
+	b.cond = sync.NewCond(&b.mu)
+	return b
+}
+
+// Acquire reserves n bytes, waiting up to timeout until they are available. A
+// request larger than the whole budget is clamped to it so that it can still
+// make progress alone. It returns the number of bytes actually reserved.
+func (b *MemoryBudget) Acquire(n int64, timeout time.Duration) (int64, error) {
+	if b == nil {
+		return 0, nil
+	}
+	deadline := time.Now().Add(timeout)
+	// Taking the lock before broadcasting ensures the waiter is either
+	// waiting or has yet to check the deadline.
+	timer := time.AfterFunc(timeout, func() {
+		b.mu.Lock()
+		b.mu.Unlock()
+		b.cond.Broadcast()
+	})
+	defer timer.Stop()
+
+	b.mu.Lock()
+	defer b.mu.Unlock()
+	if n > b.limit {
+		n = b.limit
+	}
+	if b.inUse+n > b.limit {
+		b.waiting++
+		defer func() { b.waiting-- }()
+	}
+	for b.inUse+n > b.limit {
+		if !time.Now().Before(deadline) {
+			return 0, fmt.Errorf("guard buffer budget exhausted (%d of %d bytes in use after waiting %s)",
+				b.inUse, b.limit, timeout)
+		}
+		b.cond.Wait()
+	}
+	b.takeLocked(n)
+	return n, nil
+}
+
+// TryAcquire reserves n bytes if they are available and no session is
+// waiting for admission, without waiting. A nil budget always succeeds.
+func (b *MemoryBudget) TryAcquire(n int64) bool {
+	if b == nil {
+		return true
+	}
+	b.mu.Lock()
+	defer b.mu.Unlock()
+	if b.waiting > 0 || b.inUse+n > b.limit {
+		return false
+	}
+	b.takeLocked(n)
+	return true
+}
+
+func (b *MemoryBudget) takeLocked(n int64) {
+	b.inUse += n
+	if b.inUse > b.peak {
+		b.peak = b.inUse
+	}
+}
+
+// Contended reports whether a session is waiting for the budget to admit
+// it, in which case sessions should give back what they borrowed.
+func (b *MemoryBudget) Contended() bool {
+	if b == nil {
+		return false
+	}
+	b.mu.Lock()
+	defer b.mu.Unlock()
+	return b.waiting > 0
+}
+
+func (b *MemoryBudget) Release(n int64) {
+	if b == nil || n == 0 {
+		return
+	}
+	b.mu.Lock()
+	b.inUse -= n
+	b.mu.Unlock()
+	b.cond.Broadcast()
+}
+
+// Usage returns the bytes currently reserved and the budget limit.
+func (b *MemoryBudget) Usage() (inUse int64, limit int64) {
+	if b == nil {
+		return 0, 0
+	}
+	b.mu.Lock()
+	defer b.mu.Unlock()
+	return b.inUse, b.limit
+}
+
+// Peak returns the most bytes that have been reserved at once.
+func (b *MemoryBudget) Peak() int64 {
+	if b == nil {
+		return 0
+	}
+	b.mu.Lock()
+	defer b.mu.Unlock()
+	return b.peak
+}
@@ -0,0 +1,43 @@
+package guardianagent
+
+import (
+	"testing"
+	"time"
+)
+
+func TestMemoryBudgetWaitIsBounded(t *testing.T) {
+	b := NewMemoryBudget(100)
+	if _, err := b.Acquire(80, time.Second); err != nil {
+		t.Fatal(err)
+	}
+	start := time.Now()
+	if _, err := b.Acquire(80, 50*time.Millisecond); err == nil {
+		t.Fatalf("reservation beyond the budget succeeded")
+	}
+	if waited := time.Since(start); waited > time.Second {
+		t.Errorf("waited %s for a 50ms timeout", waited)
+	}
+	if inUse, _ := b.Usage(); inUse != 80 {
+		t.Errorf("%d bytes in use after a failed reservation, want 80", inUse)
+	}
+}
+
+func TestMemoryBudgetReleaseAdmitsWaiter(t *testing.T) {
+	b := NewMemoryBudget(100)
+	first, err := b.Acquire(80, time.Second)
+	if err != nil {
+		t.Fatal(err)
+	}
+	go func() {
+		time.Sleep(20 * time.Millisecond)
+		b.Release(first)
+	}()
+	if _, err = b.Acquire(80, 10*time.Second); err != nil {
+		t.Errorf("waiter not admitted after release: %s", err)
+	}
+	// Larger than the whole budget: clamped so it can run alone.
+	b.Release(80)
+	if n, err := b.Acquire(500, time.Second); err != nil || n != 100 {
+		t.Errorf("oversized reservation got %d, %v", n, err)
+	}
+}
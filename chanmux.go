@@ -0,0 +1,335 @@
+package guardianagent
+
+import (
+	"bufio"
+	"bytes"
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"io"
+	"net"
+	"sync"
+	"time"
+)
+
+// FixedChannelsFraming is advertised in the extension query (and echoed by the
+// agent) when both sides can replace yamux with chanMux.
+const FixedChannelsFraming = "fixed-channels"
+
+// A delegated session always carries exactly these three channels.
+const (
+	controlChannel = iota
+	dataChannel
+	transportChannel
+	numChannels
+)
+
+const (
+	frameData = iota
+	frameWindowUpdate
+	frameClose
+)
+
+// Frame header: channel id (1), frame type (1), payload length (4).
+const frameHeaderSize = 6
+const maxFramePayload = 32 * 1024
+
+// Every channel starts with this much credit. A receiver grows the window by
+// doubling, up to sessionStreamWindow.
+const muxInitialWindow = 64 * 1024
+
+var errMuxChannelClosed = errors.New("channel closed")
+
+// chanMux multiplexes the fixed session channels over one connection. Unlike
+// yamux there is no open handshake and no keepalive: every channel exists from
+// the start on both sides, with muxInitialWindow bytes of initial credit.
+// Receivers return credit in batches of half a window.
+//
+// The receive windows are what a peer can make the guard buffer, so a window
+// grows beyond its initial size only with bytes borrowed from the memory
+// budget, and shrinks back, giving them up, while other sessions wait for
+// admission. When the budget is exhausted the peer runs out of credit and
+// pauses instead of the guard buffering more.
+type chanMux struct {
+	conn     net.Conn
+	writeMu  sync.Mutex
+	wbuf     [frameHeaderSize + maxFramePayload]byte
+	channels [numChannels]*muxChannel
+
+	budget       *MemoryBudget
+	borrowMu     sync.Mutex
+	borrowed     int64
+	peakBorrowed int64
+	closed       bool
+}
+
+// newChanMux starts multiplexing conn. Windows grow with bytes from budget,
+// which may be nil for no limit.
+func newChanMux(conn net.Conn, budget *MemoryBudget) *chanMux {
+	mux := &chanMux{conn: conn, budget: budget}
+	for id := range mux.channels {
+		ch := &muxChannel{mux: mux, id: byte(id), sendCredit: muxInitialWindow, window: muxInitialWindow}
+		ch.cond = sync.NewCond(&ch.mu)
+		mux.channels[id] = ch
+	}
+	go mux.readLoop()
+	return mux
+}
+
+func (mux *chanMux) Channel(id int) net.Conn {
+	return mux.channels[id]
+}
+
+// Close tears down the underlying connection, fails all channels and gives
+// back what the windows borrowed.
+func (mux *chanMux) Close() error {
+	err := mux.conn.Close()
+	mux.fail(io.ErrClosedPipe)
+	mux.borrowMu.Lock()
+	if !mux.closed {
+		mux.closed = true
+		mux.budget.Release(mux.borrowed)
+		mux.borrowed = 0
+	}
+	mux.borrowMu.Unlock()
+	return err
+}
+
+// borrow takes n bytes from the budget for a window to grow by.
+func (mux *chanMux) borrow(n uint32) bool {
+	mux.borrowMu.Lock()
+	defer mux.borrowMu.Unlock()
+	if mux.closed || !mux.budget.TryAcquire(int64(n)) {
+		return false
+	}
+	mux.borrowed += int64(n)
+	if mux.borrowed > mux.peakBorrowed {
+		mux.peakBorrowed = mux.borrowed
+	}
+	return true
+}
+
+// giveBack returns n bytes a window shrank by to the budget.
+func (mux *chanMux) giveBack(n uint32) {
+	mux.borrowMu.Lock()
+	defer mux.borrowMu.Unlock()
+	if mux.closed {
+		return
+	}
+	mux.borrowed -= int64(n)
+	mux.budget.Release(int64(n))
+}
+
+// PeakBorrowed returns the most bytes the windows held beyond their initial
+// size at once.
+func (mux *chanMux) PeakBorrowed() int64 {
+	mux.borrowMu.Lock()
+	defer mux.borrowMu.Unlock()
+	return mux.peakBorrowed
+}
+
+func (mux *chanMux) fail(err error) {
+	for _, ch := range mux.channels {
+		ch.mu.Lock()
+		if ch.err == nil {
+			ch.err = err
+		}
+		ch.cond.Broadcast()
+		ch.mu.Unlock()
+	}
+}
+
+func (mux *chanMux) writeFrame(id byte, frameType byte, payload []byte) error {
+	mux.writeMu.Lock()
+	defer mux.writeMu.Unlock()
+	mux.wbuf[0] = id
+	mux.wbuf[1] = frameType
+	binary.BigEndian.PutUint32(mux.wbuf[2:], uint32(len(payload)))
+	n := copy(mux.wbuf[frameHeaderSize:], payload)
+	_, err := mux.conn.Write(mux.wbuf[:frameHeaderSize+n])
+	return err
+}
+
+func (mux *chanMux) readLoop() {
+	r := bufio.NewReaderSize(mux.conn, frameHeaderSize+maxFramePayload)
+	var header [frameHeaderSize]byte
+	payload := make([]byte, maxFramePayload)
+	for {
+		if _, err := io.ReadFull(r, header[:]); err != nil {
+			mux.fail(err)
+			return
+		}
+		id, frameType, length := header[0], header[1], binary.BigEndian.Uint32(header[2:])
+		if int(id) >= numChannels || length > maxFramePayload {
+			mux.fail(fmt.Errorf("invalid frame: channel %d, length %d", id, length))
+			mux.conn.Close()
+			return
+		}
+		if _, err := io.ReadFull(r, payload[:length]); err != nil {
+			mux.fail(err)
+			return
+		}
+
+		ch := mux.channels[id]
+		ch.mu.Lock()
+		switch frameType {
+		case frameData:
+			if ch.recvBuf.Len()+int(length) > int(ch.window) {
+				ch.mu.Unlock()
+				mux.fail(fmt.Errorf("channel %d exceeded its window", id))
+				mux.conn.Close()
+				return
+			}
+			ch.recvBuf.Write(payload[:length])
+		case frameWindowUpdate:
+			if length == 4 {
+				ch.sendCredit += binary.BigEndian.Uint32(payload)
+			}
+		case frameClose:
+			ch.recvEOF = true
+		}
+		ch.cond.Broadcast()
+		ch.mu.Unlock()
+	}
+}
+
+type muxChannel struct {
+	mux *chanMux
+	id  byte
+
+	mu          sync.Mutex
+	cond        *sync.Cond
+	recvBuf     bytes.Buffer
+	recvEOF     bool
+	unacked     uint32
+	window      uint32
+	sendCredit  uint32
+	writeClosed bool
+	err         error
+}
+
+func (ch *muxChannel) Read(p []byte) (int, error) {
+	ch.mu.Lock()
+	for ch.recvBuf.Len() == 0 && !ch.recvEOF && ch.err == nil {
+		ch.cond.Wait()
+	}
+	if ch.recvBuf.Len() == 0 {
+		err := ch.err
+		if ch.recvEOF || err == nil {
+			err = io.EOF
+		}
+		ch.mu.Unlock()
+		return 0, err
+	}
+	n, _ := ch.recvBuf.Read(p)
+	ch.unacked += uint32(n)
+	var credit uint32
+	if ch.unacked >= ch.window/2 {
+		credit = ch.retuneLocked(ch.unacked)
+		ch.unacked = 0
+	}
+	ch.mu.Unlock()
+
+	if credit > 0 {
+		var update [4]byte
+		binary.BigEndian.PutUint32(update[:], credit)
+		ch.mux.writeFrame(ch.id, frameWindowUpdate, update[:])
+	}
+	return n, nil
+}
+
+// retuneLocked returns the credit to grant the peer for consumed bytes,
+// resizing the window: it shrinks towards muxInitialWindow, by withholding
+// credit, while the budget is contended, and otherwise doubles while the
+// budget can cover it.
+func (ch *muxChannel) retuneLocked(consumed uint32) uint32 {
+	if ch.mux.budget.Contended() {
+		shrink := ch.window - muxInitialWindow
+		if shrink > consumed {
+			shrink = consumed
+		}
+		if shrink > 0 {
+			ch.window -= shrink
+			ch.mux.giveBack(shrink)
+		}
+		return consumed - shrink
+	}
+	if ch.window < sessionStreamWindow && ch.mux.borrow(ch.window) {
+		grow := ch.window
+		ch.window += grow
+		return consumed + grow
+	}
+	return consumed
+}
+
+func (ch *muxChannel) Write(p []byte) (int, error) {
+	written := 0
+	for written < len(p) {
+		ch.mu.Lock()
+		for ch.sendCredit == 0 && !ch.writeClosed && ch.err == nil {
+			ch.cond.Wait()
+		}
+		if ch.writeClosed {
+			ch.mu.Unlock()
+			return written, errMuxChannelClosed
+		}
+		if ch.err != nil {
+			err := ch.err
+			ch.mu.Unlock()
+			return written, err
+		}
+		chunk := len(p) - written
+		if chunk > maxFramePayload {
+			chunk = maxFramePayload
+		}
+		if uint32(chunk) > ch.sendCredit {
+			chunk = int(ch.sendCredit)
+		}
+		ch.sendCredit -= uint32(chunk)
+		ch.mu.Unlock()
+
+		if err := ch.mux.writeFrame(ch.id, frameData, p[written:written+chunk]); err != nil {
+			return written, err
+		}
+		written += chunk
+	}
+	return written, nil
+}
+
+// CloseWrite signals EOF to the peer; reading continues until the peer closes.
+func (ch *muxChannel) CloseWrite() error {
+	ch.mu.Lock()
+	if ch.writeClosed {
+		ch.mu.Unlock()
+		return nil
+	}
+	ch.writeClosed = true
+	ch.cond.Broadcast()
+	ch.mu.Unlock()
+	return ch.mux.writeFrame(ch.id, frameClose, nil)
+}
+
+// Close half-closes the channel, like closing a yamux stream.
+func (ch *muxChannel) Close() error {
+	return ch.CloseWrite()
+}
+
+func (ch *muxChannel) LocalAddr() net.Addr {
+	return ch.mux.conn.LocalAddr()
+}
+
+func (ch *muxChannel) RemoteAddr() net.Addr {
+	return ch.mux.conn.RemoteAddr()
+}
+
+func (ch *muxChannel) SetDeadline(t time.Time) error {
+	return errors.New("deadlines are not supported on session channels")
+}
+
+func (ch *muxChannel) SetReadDeadline(t time.Time) error {
+	return ch.SetDeadline(t)
+}
+
+func (ch *muxChannel) SetWriteDeadline(t time.Time) error {
+	return ch.SetDeadline(t)
+}
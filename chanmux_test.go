@@ -0,0 +1,367 @@
+package guardianagent
+
+import (
+	"bytes"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"net"
+	"runtime"
+	"sync"
+	"testing"
+	"time"
+
+	"github.com/hashicorp/yamux"
+)
+
+// tcpPair returns the two ends of a loopback TCP connection, which is what
+// the session framing runs over between the stub's socket and the guard.
+func tcpPair(t testing.TB) (client net.Conn, server net.Conn) {
+	l, err := net.Listen("tcp", "127.0.0.1:0")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer l.Close()
+	accepted := make(chan net.Conn, 1)
+	go func() {
+		c, _ := l.Accept()
+		accepted <- c
+	}()
+	client, err = net.Dial("tcp", l.Addr().String())
+	if err != nil {
+		t.Fatal(err)
+	}
+	server = <-accepted
+	if server == nil {
+		t.Fatal("accept failed")
+	}
+	return client, server
+}
+
+// sessionTransports opens the transport channel of a session on both ends,
+// with the framing selected by fixedChannels, configured as the client and
+// the guard configure it.
+func sessionTransports(t testing.TB, fixedChannels bool) (client net.Conn, server net.Conn, closeAll func()) {
+	clientConn, serverConn := tcpPair(t)
+	return muxTransports(t, clientConn, serverConn, fixedChannels)
+}
+
+// muxTransports is sessionTransports over the given connections.
+func muxTransports(t testing.TB, clientConn net.Conn, serverConn net.Conn, fixedChannels bool) (client net.Conn, server net.Conn, closeAll func()) {
+	if fixedChannels {
+		clientMux, serverMux := newChanMux(clientConn, nil), newChanMux(serverConn, nil)
+		return clientMux.Channel(transportChannel), serverMux.Channel(transportChannel), func() {
+			clientMux.Close()
+			serverMux.Close()
+		}
+	}
+
+	clientMux, err := yamux.Client(clientConn, nil)
+	if err != nil {
+		t.Fatal(err)
+	}
+	serverConfig := yamux.DefaultConfig()
+	serverConfig.MaxStreamWindowSize = sessionStreamWindow
+	serverMux, err := yamux.Server(serverConn, serverConfig)
+	if err != nil {
+		t.Fatal(err)
+	}
+	accepted := make(chan net.Conn, numChannels)
+	go func() {
+		for i := 0; i < numChannels; i++ {
+			stream, err := serverMux.Accept()
+			if err != nil {
+				close(accepted)
+				return
+			}
+			accepted <- stream
+		}
+	}()
+	for i := 0; i < numChannels; i++ {
+		if client, err = clientMux.Open(); err != nil {
+			t.Fatal(err)
+		}
+	}
+	for i := 0; i < numChannels; i++ {
+		server = <-accepted
+	}
+	if server == nil {
+		t.Fatal("failed to accept streams")
+	}
+	return client, server, func() {
+		clientMux.Close()
+		serverMux.Close()
+	}
+}
+
+func TestChanMuxTransfersInOrder(t *testing.T) {
+	client, server, closeAll := sessionTransports(t, true)
+	defer closeAll()
+
+	// Several windows, so that credit must be returned for it to complete.
+	sent := make([]byte, 4*sessionStreamWindow+123)
+	for i := range sent {
+		sent[i] = byte(i * 7)
+	}
+	go func() {
+		client.Write(sent)
+		client.Close()
+	}()
+	received, err := ioutil.ReadAll(server)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if !bytes.Equal(received, sent) {
+		t.Errorf("received %d bytes differing from the %d sent", len(received), len(sent))
+	}
+}
+
+func TestChanMuxWindowsStayWithinBudget(t *testing.T) {
+	// Room for one window to double, but not to reach sessionStreamWindow.
+	budget := NewMemoryBudget(muxInitialWindow)
+	clientConn, serverConn := tcpPair(t)
+	clientMux, serverMux := newChanMux(clientConn, nil), newChanMux(serverConn, budget)
+	client, server := clientMux.Channel(transportChannel), serverMux.Channel(transportChannel)
+
+	sent := make([]byte, 4*sessionStreamWindow)
+	go func() {
+		client.Write(sent)
+		client.Close()
+	}()
+	received, err := ioutil.ReadAll(server)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if len(received) != len(sent) {
+		t.Errorf("received %d of %d bytes", len(received), len(sent))
+	}
+	if peak := serverMux.PeakBorrowed(); peak != muxInitialWindow {
+		t.Errorf("windows borrowed %d bytes, want the whole %d-byte budget", peak, muxInitialWindow)
+	}
+	clientMux.Close()
+	serverMux.Close()
+	if inUse, _ := budget.Usage(); inUse != 0 {
+		t.Errorf("%d bytes still borrowed after close", inUse)
+	}
+}
+
+func TestChanMuxWindowsShrinkWhileContended(t *testing.T) {
+	budget := NewMemoryBudget(4 * sessionStreamWindow)
+	clientConn, serverConn := tcpPair(t)
+	clientMux, serverMux := newChanMux(clientConn, nil), newChanMux(serverConn, budget)
+	defer clientMux.Close()
+	defer serverMux.Close()
+	client, server := clientMux.Channel(transportChannel), serverMux.Channel(transportChannel)
+	go func() {
+		client.Write(make([]byte, 16*sessionStreamWindow))
+		client.Close()
+	}()
+
+	buf := make([]byte, maxFramePayload)
+	drain := func(n int) {
+		for ; n > 0; n -= len(buf) {
+			if _, err := io.ReadFull(server, buf); err != nil {
+				t.Fatal(err)
+			}
+		}
+	}
+	drain(4 * sessionStreamWindow)
+	if inUse, _ := budget.Usage(); inUse != sessionStreamWindow-muxInitialWindow {
+		t.Fatalf("window borrowed %d bytes, want %d", inUse, sessionStreamWindow-muxInitialWindow)
+	}
+
+	// Another session waits for the whole budget: the window gives back what
+	// it borrowed as it is drained, which admits the waiter.
+	admitted := make(chan error, 1)
+	go func() {
+		_, err := budget.Acquire(4*sessionStreamWindow, 10*time.Second)
+		admitted <- err
+	}()
+	for !budget.Contended() {
+		time.Sleep(time.Millisecond)
+	}
+	drain(2 * sessionStreamWindow)
+	if err := <-admitted; err != nil {
+		t.Fatal(err)
+	}
+}
+
+// bulkSession sends bulk from a client to a guard that drains its transport
+// channel slowly, as a relay writing to a congested server does, with the
+// guard's windows under budget.
+func bulkSession(budget *MemoryBudget, bulk []byte) error {
+	reserved, err := budget.Acquire(fixedChannelsReservation, sessionBudgetWait)
+	if err != nil {
+		return err
+	}
+	defer budget.Release(reserved)
+	clientConn, guardConn := net.Pipe()
+	clientMux, guardMux := newChanMux(clientConn, nil), newChanMux(guardConn, budget)
+	defer clientMux.Close()
+	defer guardMux.Close()
+
+	go func() {
+		client := clientMux.Channel(transportChannel)
+		client.Write(bulk)
+		client.Close()
+	}()
+	guard := guardMux.Channel(transportChannel)
+	buf := make([]byte, maxFramePayload)
+	for received := 0; received < len(bulk); {
+		n, err := guard.Read(buf)
+		if err != nil {
+			return err
+		}
+		received += n
+		time.Sleep(time.Millisecond)
+	}
+	return nil
+}
+
+// BenchmarkConcurrentBulkSessions runs 500 bulk sessions at once, under the
+// guard's default budget and with none, and reports the peak heap and, when
+// budgeted, the peak of the budget.
+func BenchmarkConcurrentBulkSessions(b *testing.B) {
+	const sessions = 500
+	// Shared by all senders, so that the heap holds only what is buffered.
+	bulk := make([]byte, 1024*1024)
+	for _, limit := range []int64{64 * 1024 * 1024, 0} {
+		name := "unbudgeted"
+		if limit > 0 {
+			name = fmt.Sprintf("budget%dMiB", limit>>20)
+		}
+		b.Run(name, func(b *testing.B) {
+			var budget *MemoryBudget
+			if limit > 0 {
+				budget = NewMemoryBudget(limit)
+			}
+			stopSampling := make(chan struct{})
+			peakHeap := make(chan uint64)
+			go func() {
+				var stats runtime.MemStats
+				var peak uint64
+				ticker := time.NewTicker(20 * time.Millisecond)
+				defer ticker.Stop()
+				for {
+					select {
+					case <-ticker.C:
+						runtime.ReadMemStats(&stats)
+						if stats.HeapInuse > peak {
+							peak = stats.HeapInuse
+						}
+					case <-stopSampling:
+						peakHeap <- peak
+						return
+					}
+				}
+			}()
+
+			b.SetBytes(int64(sessions * len(bulk)))
+			for i := 0; i < b.N; i++ {
+				var wg sync.WaitGroup
+				errs := make(chan error, sessions)
+				for s := 0; s < sessions; s++ {
+					wg.Add(1)
+					go func() {
+						defer wg.Done()
+						errs <- bulkSession(budget, bulk)
+					}()
+				}
+				wg.Wait()
+				close(errs)
+				for err := range errs {
+					if err != nil {
+						b.Fatal(err)
+					}
+				}
+			}
+			close(stopSampling)
+			b.ReportMetric(float64(<-peakHeap), "peak-heap-bytes")
+			if budget != nil {
+				if budget.Peak() > limit {
+					b.Errorf("budget peaked at %d bytes, beyond its %d-byte limit", budget.Peak(), limit)
+				}
+				b.ReportMetric(float64(budget.Peak()), "peak-budget-bytes")
+			}
+		})
+	}
+}
+
+// benchmarkSessionFraming measures bulk throughput over the transport
+// channel, the path of the server's output before handoff.
+func benchmarkSessionFraming(b *testing.B, fixedChannels bool) {
+	client, server, closeAll := sessionTransports(b, fixedChannels)
+	defer closeAll()
+
+	buf := make([]byte, 32*1024)
+	done := make(chan error, 1)
+	go func() {
+		_, err := io.CopyN(ioutil.Discard, server, int64(b.N)*int64(len(buf)))
+		done <- err
+	}()
+	b.SetBytes(int64(len(buf)))
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		if _, err := client.Write(buf); err != nil {
+			b.Fatal(err)
+		}
+	}
+	if err := <-done; err != nil {
+		b.Fatal(err)
+	}
+}
+
+func BenchmarkSessionFraming(b *testing.B) {
+	b.Run("chanMux", func(b *testing.B) {
+		benchmarkSessionFraming(b, true)
+	})
+	b.Run("yamux", func(b *testing.B) {
+		benchmarkSessionFraming(b, false)
+	})
+}
+
+// setupRTT is the round trip time of the link in BenchmarkSessionSetup.
+const setupRTT = 10 * time.Millisecond
+
+// benchmarkSessionSetup measures how long a session takes from the framing
+// starting on both ends of a link to a byte sent and echoed over the
+// transport channel, in round trips of the link.
+func benchmarkSessionSetup(b *testing.B, fixedChannels bool) {
+	var elapsed time.Duration
+	for i := 0; i < b.N; i++ {
+		b.StopTimer()
+		clientConn, serverConn := tcpPair(b)
+		start := time.Now()
+		b.StartTimer()
+		client, server, closeAll := muxTransports(b,
+			newLatencyConn(clientConn, setupRTT/2), newLatencyConn(serverConn, setupRTT/2), fixedChannels)
+		go func() {
+			buf := make([]byte, 1)
+			if _, err := io.ReadFull(server, buf); err == nil {
+				server.Write(buf)
+			}
+		}()
+		buf := []byte{1}
+		if _, err := client.Write(buf); err != nil {
+			b.Fatal(err)
+		}
+		if _, err := io.ReadFull(client, buf); err != nil {
+			b.Fatal(err)
+		}
+		elapsed += time.Since(start)
+		b.StopTimer()
+		closeAll()
+		b.StartTimer()
+	}
+	b.ReportMetric(float64(elapsed)/float64(setupRTT)/float64(b.N), "round-trips/op")
+}
+
+func BenchmarkSessionSetup(b *testing.B) {
+	b.Run("chanMux", func(b *testing.B) {
+		benchmarkSessionSetup(b, true)
+	})
+	b.Run("yamux", func(b *testing.B) {
+		benchmarkSessionSetup(b, false)
+	})
+}
@@ -0,0 +1,217 @@
+package main
+
+import (
+	"fmt"
+	"io"
+	"io/ioutil"
+	"log"
+	"os"
+	"os/user"
+	"path"
+	"strings"
+	"time"
+
+	guardianagent "github.com/StanfordSNR/guardian-agent"
+	flags "github.com/jessevdk/go-flags"
+	"github.com/pkg/sftp"
+)
+
+type CopyArgs struct {
+	Source string `required:"true" positional-arg-name:"source"`
+	Target string `required:"true" positional-arg-name:"target"`
+}
+
+type options struct {
+	guardianagent.CommonOptions
+
+	Port int `short:"P" description:"Port to connect to on the remote host" default:"22"`
+
+	PacketSize int `long:"packet-size" description:"Size of SFTP read/write requests in bytes" default:"131072"`
+
+	Requests int `long:"requests" description:"Maximum number of concurrent SFTP requests per file" default:"64"`
+
+	CopyArgs CopyArgs `positional-args:"true" required:"true"`
+}
+
+type remotePath struct {
+	Username string
+	Host     string
+	Path     string
+}
+
+// parseRemotePath splits a [user@]host:path argument. ok is false for local paths.
+func parseRemotePath(arg string) (rp remotePath, ok bool) {
+	colon := strings.Index(arg, ":")
+	if colon <= 0 || strings.Contains(arg[:colon], "/") {
+		return rp, false
+	}
+	userHost := arg[:colon]
+	rp.Path = arg[colon+1:]
+	if rp.Path == "" {
+		rp.Path = "."
+	}
+	if at := strings.LastIndex(userHost, "@"); at >= 0 {
+		rp.Username = userHost[:at]
+		rp.Host = userHost[at+1:]
+	} else {
+		rp.Host = userHost
+	}
+	return rp, true
+}
+
+func upload(client *sftp.Client, localPath string, remote string) (int64, error) {
+	local, err := os.Open(localPath)
+	if err != nil {
+		return 0, err
+	}
+	defer local.Close()
+
+	if fi, err := client.Stat(remote); err == nil && fi.IsDir() {
+		remote = path.Join(remote, path.Base(localPath))
+	}
+	dst, err := client.Create(remote)
+	if err != nil {
+		return 0, fmt.Errorf("failed to create remote file %s: %s", remote, err)
+	}
+	// ReadFrom pipelines concurrent write requests when the source size is known.
+	n, err := dst.ReadFrom(local)
+	if err != nil {
+		dst.Close()
+		return n, err
+	}
+	return n, dst.Close()
+}
+
+func download(client *sftp.Client, remote string, localPath string) (int64, error) {
+	src, err := client.Open(remote)
+	if err != nil {
+		return 0, fmt.Errorf("failed to open remote file %s: %s", remote, err)
+	}
+	defer src.Close()
+
+	if fi, err := os.Stat(localPath); err == nil && fi.IsDir() {
+		localPath = path.Join(localPath, path.Base(remote))
+	}
+	dst, err := os.Create(localPath)
+	if err != nil {
+		return 0, err
+	}
+	// WriteTo pipelines concurrent read requests ahead of the writer.
+	n, err := src.WriteTo(dst)
+	if err != nil {
+		dst.Close()
+		return n, err
+	}
+	return n, dst.Close()
+}
+
+func main() {
+	var opts options
+	var parser = flags.NewParser(&opts, flags.HelpFlag|flags.PassDoubleDash)
+
+	_, err := parser.Parse()
+	if opts.Version {
+		fmt.Println(guardianagent.Version)
+		os.Exit(0)
+	}
+
+	if err != nil {
+		if flagsErr, ok := err.(*flags.Error); ok {
+			if flagsErr.Type == flags.ErrHelp {
+				fmt.Println(flagsErr.Message)
+				os.Exit(0)
+			}
+			fmt.Fprintln(os.Stderr, flagsErr.Message)
+			os.Exit(255)
+		}
+		fmt.Fprintf(os.Stderr, "%s\n", err)
+		os.Exit(255)
+	}
+
+	log.SetFlags(log.LstdFlags | log.Lshortfile)
+	if opts.Debug {
+		if opts.LogFile == "" {
+			log.SetOutput(os.Stderr)
+		} else {
+			f, err := os.OpenFile(opts.LogFile, os.O_CREATE|os.O_APPEND|os.O_RDWR, 0644)
+			if err != nil {
+				fmt.Fprintf(os.Stderr, "%s: failed to open log file: %s", os.Args[0], err)
+				os.Exit(255)
+			}
+			log.SetOutput(f)
+		}
+	} else {
+		log.SetOutput(ioutil.Discard)
+	}
+
+	srcRemote, srcIsRemote := parseRemotePath(opts.CopyArgs.Source)
+	dstRemote, dstIsRemote := parseRemotePath(opts.CopyArgs.Target)
+	if srcIsRemote == dstIsRemote {
+		fmt.Fprintf(os.Stderr, "%s: exactly one of source and target must be a remote [user@]host:path\n", os.Args[0])
+		os.Exit(255)
+	}
+	remote := dstRemote
+	if srcIsRemote {
+		remote = srcRemote
+	}
+	if parser.FindOptionByShortName('l').IsSet() {
+		remote.Username = opts.Username
+	}
+	if remote.Username == "" {
+		curuser, err := user.Current()
+		if err == nil {
+			remote.Username = curuser.Username
+		}
+	}
+
+	// The SFTP client talks to the delegated session through a pair of pipes:
+	// requests are written into the session's stdin and replies are read
+	// from its stdout.
+	toSessionReader, toSessionWriter := io.Pipe()
+	fromSessionReader, fromSessionWriter := io.Pipe()
+	sshCmd := guardianagent.SSHCommand{
+		HostPort:  fmt.Sprintf("%s:%d", remote.Host, opts.Port),
+		Username:  remote.Username,
+		Cmd:       "sftp",
+		Subsystem: true,
+		Stdin:     toSessionReader,
+		Stdout:    fromSessionWriter,
+	}
+	sessionDone := make(chan error, 1)
+	go func() {
+		err := guardianagent.RunSSHCommand(sshCmd)
+		if err == nil {
+			err = io.EOF
+		}
+		fromSessionWriter.CloseWithError(err)
+		sessionDone <- err
+	}()
+
+	client, err := sftp.NewClientPipe(fromSessionReader, toSessionWriter,
+		sftp.MaxPacketUnchecked(opts.PacketSize),
+		sftp.MaxConcurrentRequestsPerFile(opts.Requests),
+		sftp.UseConcurrentReads(true),
+		sftp.UseConcurrentWrites(true))
+	if err != nil {
+		fmt.Fprintf(os.Stderr, "%s: failed to start sftp session on %s: %s\n", os.Args[0], remote.Host, err)
+		os.Exit(255)
+	}
+
+	start := time.Now()
+	var n int64
+	if srcIsRemote {
+		n, err = download(client, srcRemote.Path, opts.CopyArgs.Target)
+	} else {
+		n, err = upload(client, opts.CopyArgs.Source, dstRemote.Path)
+	}
+	elapsed := time.Since(start)
+	client.Close()
+	if sessionErr := <-sessionDone; sessionErr != io.EOF {
+		log.Printf("Delegated session finished: %s", sessionErr)
+	}
+	if err != nil {
+		fmt.Fprintf(os.Stderr, "%s: %s\n", os.Args[0], err)
+		os.Exit(1)
+	}
+	log.Printf("Copied %d bytes in %s (%.1f MiB/s)", n, elapsed, float64(n)/elapsed.Seconds()/(1<<20))
+}
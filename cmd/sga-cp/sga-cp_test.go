@@ -0,0 +1,261 @@
+package main
+
+import (
+	"bufio"
+	"bytes"
+	"crypto/ecdsa"
+	"crypto/elliptic"
+	"crypto/rand"
+	"encoding/binary"
+	"errors"
+	"flag"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"net"
+	"os"
+	"os/exec"
+	"path"
+	"strings"
+	"testing"
+
+	"github.com/pkg/sftp"
+	"golang.org/x/crypto/ssh"
+)
+
+// The benchmarks upload a file to an in-process SSH server over a direct
+// connection, which is what a delegated session is after handoff: once with
+// sga-cp's pipelined SFTP, and once with the scp protocol over an exec channel,
+// the way scp runs over sga-ssh. Use e.g. -transfer-size=4294967296 to compare
+// multi-GiB transfers.
+var transferSize = flag.Int64("transfer-size", 256<<20, "bytes uploaded per benchmark iteration")
+
+func newBenchSigner(b *testing.B) ssh.Signer {
+	key, err := ecdsa.GenerateKey(elliptic.P256(), rand.Reader)
+	if err != nil {
+		b.Fatal(err)
+	}
+	signer, err := ssh.NewSignerFromKey(key)
+	if err != nil {
+		b.Fatal(err)
+	}
+	return signer
+}
+
+// startBenchServer serves the sftp subsystem in-process and runs exec requests
+// as local commands, and returns a connected client.
+func startBenchServer(b *testing.B) (client *ssh.Client, stop func()) {
+	clientKey := newBenchSigner(b)
+	config := &ssh.ServerConfig{
+		PublicKeyCallback: func(conn ssh.ConnMetadata, key ssh.PublicKey) (*ssh.Permissions, error) {
+			if bytes.Equal(key.Marshal(), clientKey.PublicKey().Marshal()) {
+				return nil, nil
+			}
+			return nil, errors.New("unknown key")
+		},
+	}
+	config.AddHostKey(newBenchSigner(b))
+
+	l, err := net.Listen("tcp", "127.0.0.1:0")
+	if err != nil {
+		b.Fatal(err)
+	}
+	go func() {
+		for {
+			c, err := l.Accept()
+			if err != nil {
+				return
+			}
+			go serveBenchConn(c, config)
+		}
+	}()
+
+	client, err = ssh.Dial("tcp", l.Addr().String(), &ssh.ClientConfig{
+		User:            "bench",
+		Auth:            []ssh.AuthMethod{ssh.PublicKeys(clientKey)},
+		HostKeyCallback: ssh.InsecureIgnoreHostKey(),
+	})
+	if err != nil {
+		l.Close()
+		b.Fatal(err)
+	}
+	return client, func() {
+		client.Close()
+		l.Close()
+	}
+}
+
+func serveBenchConn(c net.Conn, config *ssh.ServerConfig) {
+	_, chans, reqs, err := ssh.NewServerConn(c, config)
+	if err != nil {
+		c.Close()
+		return
+	}
+	go ssh.DiscardRequests(reqs)
+	for newChannel := range chans {
+		channel, requests, err := newChannel.Accept()
+		if err != nil {
+			continue
+		}
+		go serveBenchSession(channel, requests)
+	}
+}
+
+func serveBenchSession(channel ssh.Channel, requests <-chan *ssh.Request) {
+	defer channel.Close()
+	for req := range requests {
+		var arg string
+		if len(req.Payload) >= 4 && int(binary.BigEndian.Uint32(req.Payload)) == len(req.Payload)-4 {
+			arg = string(req.Payload[4:])
+		}
+		switch {
+		case req.Type == "subsystem" && arg == "sftp":
+			req.Reply(true, nil)
+			server, err := sftp.NewServer(channel)
+			if err == nil {
+				server.Serve()
+			}
+			return
+		case req.Type == "exec":
+			req.Reply(true, nil)
+			fields := strings.Fields(arg)
+			cmd := exec.Command(fields[0], fields[1:]...)
+			cmd.Stdin = channel
+			cmd.Stdout = channel
+			cmd.Stderr = channel.Stderr()
+			status := uint32(0)
+			if err := cmd.Run(); err != nil {
+				status = 1
+			}
+			channel.CloseWrite()
+			channel.SendRequest("exit-status", false, ssh.Marshal(struct{ Status uint32 }{status}))
+			return
+		default:
+			req.Reply(false, nil)
+		}
+	}
+}
+
+// benchFiles creates a sparse source file of the transfer size and a target
+// directory.
+func benchFiles(b *testing.B) (source string, targetDir string, cleanup func()) {
+	dir, err := ioutil.TempDir("", "sga-cp-bench")
+	if err != nil {
+		b.Fatal(err)
+	}
+	source = path.Join(dir, "source")
+	f, err := os.Create(source)
+	if err == nil {
+		err = f.Truncate(*transferSize)
+		f.Close()
+	}
+	targetDir = path.Join(dir, "target")
+	if err == nil {
+		err = os.Mkdir(targetDir, 0700)
+	}
+	if err != nil {
+		os.RemoveAll(dir)
+		b.Fatal(err)
+	}
+	return source, targetDir, func() { os.RemoveAll(dir) }
+}
+
+func BenchmarkUploadSFTP(b *testing.B) {
+	source, targetDir, cleanup := benchFiles(b)
+	defer cleanup()
+	client, stop := startBenchServer(b)
+	defer stop()
+
+	session, err := client.NewSession()
+	if err != nil {
+		b.Fatal(err)
+	}
+	defer session.Close()
+	stdin, _ := session.StdinPipe()
+	stdout, _ := session.StdoutPipe()
+	if err = session.RequestSubsystem("sftp"); err != nil {
+		b.Fatal(err)
+	}
+	// The same options sga-cp uses by default.
+	sftpClient, err := sftp.NewClientPipe(stdout, stdin,
+		sftp.MaxPacketUnchecked(131072),
+		sftp.MaxConcurrentRequestsPerFile(64),
+		sftp.UseConcurrentReads(true),
+		sftp.UseConcurrentWrites(true))
+	if err != nil {
+		b.Fatal(err)
+	}
+	defer sftpClient.Close()
+
+	b.SetBytes(*transferSize)
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		if _, err := upload(sftpClient, source, targetDir); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+// scpUpload sends source with the scp protocol, as the remote "scp -t" sink
+// expects it.
+func scpUpload(client *ssh.Client, source string, targetDir string) error {
+	session, err := client.NewSession()
+	if err != nil {
+		return err
+	}
+	defer session.Close()
+	stdin, _ := session.StdinPipe()
+	stdout, _ := session.StdoutPipe()
+	if err = session.Start("scp -t " + targetDir); err != nil {
+		return err
+	}
+	acks := bufio.NewReader(stdout)
+	ack := func() error {
+		c, err := acks.ReadByte()
+		if err == nil && c != 0 {
+			line, _ := acks.ReadString('\n')
+			err = fmt.Errorf("scp: %s", strings.TrimSpace(line))
+		}
+		return err
+	}
+
+	f, err := os.Open(source)
+	if err != nil {
+		return err
+	}
+	defer f.Close()
+	if err = ack(); err != nil {
+		return err
+	}
+	fmt.Fprintf(stdin, "C0644 %d %s\n", *transferSize, path.Base(source))
+	if err = ack(); err != nil {
+		return err
+	}
+	if _, err = io.CopyN(stdin, f, *transferSize); err != nil {
+		return err
+	}
+	stdin.Write([]byte{0})
+	if err = ack(); err != nil {
+		return err
+	}
+	stdin.Close()
+	return session.Wait()
+}
+
+func BenchmarkUploadSCP(b *testing.B) {
+	if _, err := exec.LookPath("scp"); err != nil {
+		b.Skip("scp not installed")
+	}
+	source, targetDir, cleanup := benchFiles(b)
+	defer cleanup()
+	client, stop := startBenchServer(b)
+	defer stop()
+
+	b.SetBytes(*transferSize)
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		if err := scpUpload(client, source, targetDir); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
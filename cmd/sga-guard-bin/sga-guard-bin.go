@@ -6,8 +6,13 @@ import (
 	"log"
 	"net"
 	"os"
+	"os/exec"
+	"os/signal"
 	"runtime"
 	"strings"
+	"sync"
+	"syscall"
+	"time"
 
 	guardianagent "github.com/StanfordSNR/guardian-agent"
 	flags "github.com/jessevdk/go-flags"
@@ -30,6 +35,14 @@ type options struct {
 
 	PromptType string `long:"prompt" description:"Type of prompt to use." choice:"DISPLAY" choice:"TERMINAL" default:"DISPLAY"`
 
+	ControlPersist string `long:"control-persist" description:"Keep the guard's own ssh master open for this long after the guard exits, so that restarts can reuse it (ssh_config ControlPersist syntax, e.g. 10m; by default the master exits with the guard)"`
+
+	MemoryBudget int64 `long:"memory-budget" description:"Maximum bytes of session buffers across all sessions (0 for unlimited)" default:"67108864"`
+
+	PromptRate float64 `long:"prompt-rate" description:"Approval prompts per second each client may cause once its burst is used up (0 for unlimited)" default:"5"`
+
+	PromptBurst int `long:"prompt-burst" description:"Approval prompts each client may cause at once" default:"20"`
+
 	SSHCommand SSHCommand `positional-args:"true" required:"true"`
 }
 
@@ -95,49 +108,183 @@ func main() {
 	}
 
 	opts.PolicyConfig = os.ExpandEnv(opts.PolicyConfig)
+	if opts.PromptType == "DISPLAY" && (runtime.GOOS == "linux") && (os.Getenv("DISPLAY") == "") {
+		fmt.Fprintln(os.Stderr, `DISPLAY environment variable is not set. Using terminal for user prompts.`)
+		opts.PromptType = "TERMINAL"
+	}
+
+	// Policy load and warm-up run concurrently with forwarding setup; the
+	// stub only publishes the socket once both are done.
+	start := time.Now()
 	var ag *guardianagent.Agent
-	if opts.PromptType == "DISPLAY" {
-		if (runtime.GOOS == "linux") && (os.Getenv("DISPLAY") == "") {
-			fmt.Fprintln(os.Stderr, `DISPLAY environment variable is not set. Using terminal for user prompts.`)
-			opts.PromptType = "TERMINAL"
+	var agErr error
+	agentReady := make(chan struct{})
+	go func() {
+		defer close(agentReady)
+		if opts.PromptType == "TERMINAL" {
+			ag, agErr = guardianagent.NewGuardian(opts.PolicyConfig, guardianagent.Terminal)
 		} else {
-			ag, err = guardianagent.NewGuardian(opts.PolicyConfig, guardianagent.Display)
+			ag, agErr = guardianagent.NewGuardian(opts.PolicyConfig, guardianagent.Display)
 		}
-	}
-	if opts.PromptType == "TERMINAL" {
-		ag, err = guardianagent.NewGuardian(opts.PolicyConfig, guardianagent.Terminal)
-	}
-	if err != nil {
-		fmt.Fprintf(os.Stderr, "%s", err)
-		os.Exit(255)
-	}
+		if agErr == nil {
+			ag.SetMemoryBudget(opts.MemoryBudget)
+			ag.SetRequestRate(opts.PromptRate, opts.PromptBurst)
+			ag.Warmup()
+		}
+	}()
+
 	sshFwd := guardianagent.SSHFwd{
 		SSHProgram:         opts.SSHProgram,
 		SSHArgs:            sshOptions,
 		Host:               opts.SSHCommand.UserHost,
 		RemoteReadableName: readableName,
 		RemoteStubName:     opts.RemoteStubName,
+		ControlPersist:     opts.ControlPersist,
+		PrePublish: func() error {
+			<-agentReady
+			return agErr
+		},
 	}
 
-	fmt.Printf("Connecting to %s to set up forwarding...\n", readableName)
-	if err = sshFwd.SetupForwarding(); err != nil {
+	resumed, err := sshFwd.ResumeHandover()
+	if err != nil {
 		fmt.Fprintf(os.Stderr, "%s", err)
 		os.Exit(255)
 	}
+	if resumed {
+		if err = sshFwd.PrePublish(); err != nil {
+			fmt.Fprintf(os.Stderr, "%s", err)
+			os.Exit(255)
+		}
+		if err = sshFwd.HandoverReady(); err != nil {
+			log.Printf("Failed to signal handover readiness: %s", err)
+		}
+		log.Printf("Took over forwarding in %s", time.Since(start))
+	} else {
+		fmt.Printf("Connecting to %s to set up forwarding...\n", readableName)
+		if err = sshFwd.SetupForwarding(); err != nil {
+			fmt.Fprintf(os.Stderr, "%s", err)
+			os.Exit(255)
+		}
+		log.Printf("Guard ready in %s", time.Since(start))
+
+		fmt.Printf("Forwarding to %s setup successfully. Waiting for incoming requests...\n", readableName)
+	}
 
-	fmt.Printf("Forwarding to %s setup successfully. Waiting for incoming requests...\n", readableName)
+	// On UpgradeSignal, the guard started by autossh hands the listener over
+	// to a freshly started copy of itself and drains its own sessions. It
+	// then stays on as a supervisor: successors pass further upgrade
+	// requests on to it, and it starts every new generation as its own child
+	// and tells the previous one to drain and exit. It exits with the status
+	// of the generation currently serving, so that autossh keeps supervising
+	// the guard, and no chain of old guards builds up.
+	stopped := make(chan struct{})
+	var stopOnce sync.Once
+	stopServing := func() {
+		stopOnce.Do(func() {
+			close(stopped)
+			sshFwd.StopAccepting()
+		})
+	}
+	var currentMu sync.Mutex
+	var current *guardianagent.Successor
+	exited := make(chan generationExit)
+	if guardianagent.UpgradeSignal != nil {
+		upgradeCh := make(chan os.Signal, 1)
+		signal.Notify(upgradeCh, guardianagent.UpgradeSignal)
+		go func() {
+			for range upgradeCh {
+				if resumed {
+					if err := sshFwd.ForwardUpgrade(); err != nil {
+						log.Printf("Upgrade failed: %s", err)
+					}
+					continue
+				}
+				successor, err := sshFwd.Handover()
+				if err != nil {
+					log.Printf("Upgrade failed: %s", err)
+					continue
+				}
+				currentMu.Lock()
+				previous := current
+				current = successor
+				currentMu.Unlock()
+				go func() {
+					exited <- generationExit{successor, successor.Wait()}
+				}()
+				if previous == nil {
+					stopServing()
+				} else {
+					previous.Drain()
+				}
+			}
+		}()
+	}
+	if drain := sshFwd.DrainRequested(); drain != nil {
+		go func() {
+			<-drain
+			stopServing()
+		}()
+	}
 
-	var c net.Conn
+	if guardianagent.DiagnosticsSignal != nil {
+		diagCh := make(chan os.Signal, 1)
+		signal.Notify(diagCh, guardianagent.DiagnosticsSignal)
+		go func() {
+			for range diagCh {
+				ag.WriteDiagnostics(os.Stderr)
+			}
+		}()
+	}
+
+	var sessions sync.WaitGroup
 	for {
-		c, err = sshFwd.Accept()
+		c, err := sshFwd.Accept()
 		if err != nil {
+			select {
+			case <-stopped:
+				sessions.Wait()
+				if resumed {
+					log.Printf("Sessions drained, exiting")
+					os.Exit(0)
+				}
+				log.Printf("Sessions drained, supervising successors")
+				for exit := range exited {
+					currentMu.Lock()
+					serving := exit.successor == current
+					currentMu.Unlock()
+					if serving {
+						os.Exit(exitStatus(exit.err))
+					}
+				}
+			default:
+			}
 			log.Printf("Error forwarding: %s", err)
 			os.Exit(255)
 		}
-		go func() {
-			if err = ag.HandleConnection(c); err != nil {
+		sessions.Add(1)
+		go func(c net.Conn) {
+			defer sessions.Done()
+			if err := ag.HandleConnection(c); err != nil {
 				log.Printf("Error forwarding: %s", err)
 			}
-		}()
+		}(c)
+	}
+}
+
+type generationExit struct {
+	successor *guardianagent.Successor
+	err       error
+}
+
+func exitStatus(err error) int {
+	if err == nil {
+		return 0
+	}
+	if exitErr, ok := err.(*exec.ExitError); ok {
+		if status, ok := exitErr.Sys().(syscall.WaitStatus); ok {
+			return status.ExitStatus()
+		}
 	}
+	return 255
 }
@@ -11,6 +11,7 @@ import (
 	"os/user"
 	"strconv"
 	"strings"
+	"time"
 
 	"golang.org/x/crypto/ssh"
 
@@ -34,7 +35,21 @@ type options struct {
 
 	ForceTTY []bool `short:"t" description:"Forces TTY allocation"`
 
-	SSHCommand SSHCommand `positional-args:"true" required:"true"`
+	Subsystem bool `short:"s" description:"Requests invocation of a subsystem on the remote system"`
+
+	LocalForwards []string `short:"L" value-name:"[bind_address:]port:host:hostport" description:"Forwards connections to the local port to host:hostport through the remote host"`
+
+	DynamicForwards []string `short:"D" value-name:"[bind_address:]port" description:"Serves SOCKS on the local port, forwarding connections through the remote host"`
+
+	WaitForGuard time.Duration `long:"wait-for-guard" description:"If no agent guard is reachable, wait this long for one to appear (e.g. 30s) before connecting directly" default:"0"`
+
+	Direct bool `long:"direct" description:"Connects to the server directly, without delegating to an agent guard"`
+
+	Timing bool `long:"timing" description:"Reports setup latency, time to first byte, output throughput and sga-ssh's own CPU time on stderr when the session ends"`
+
+	Plan string `long:"plan" description:"Request approval for all commands in the file (one '[user@]hostname command' per line) in a single decision"`
+
+	SSHCommand SSHCommand `positional-args:"true"`
 
 	// Flags provided for compatibility with SCP (supporting only default values)
 	DisableXForwarding bool `short:"x" hidden:"true"`
@@ -72,6 +87,14 @@ func main() {
 		os.Exit(255)
 	}
 
+	if opts.Plan != "" {
+		os.Exit(runPlan(parser, &opts))
+	}
+	if opts.SSHCommand.UserHost == "" {
+		fmt.Fprintln(os.Stderr, "the required argument `[user@]hostname` was not provided")
+		os.Exit(255)
+	}
+
 	var proxyCommand string
 	for _, sshOption := range opts.SSHOptions {
 		parts := strings.SplitN(sshOption, "=", 2)
@@ -131,6 +154,24 @@ func main() {
 	proxyCommand = strings.Replace(proxyCommand, "%p", strconv.Itoa(opts.Port), -1)
 	proxyCommand = strings.Replace(proxyCommand, "%r", opts.Username, -1)
 
+	var forwards []guardianagent.Forward
+	for _, spec := range opts.LocalForwards {
+		fwd, err := guardianagent.ParseLocalForward(spec)
+		if err != nil {
+			fmt.Fprintf(os.Stderr, "%s: %s\n", os.Args[0], err)
+			os.Exit(255)
+		}
+		forwards = append(forwards, fwd)
+	}
+	for _, spec := range opts.DynamicForwards {
+		fwd, err := guardianagent.ParseDynamicForward(spec)
+		if err != nil {
+			fmt.Fprintf(os.Stderr, "%s: %s\n", os.Args[0], err)
+			os.Exit(255)
+		}
+		forwards = append(forwards, fwd)
+	}
+
 	sshCmd := guardianagent.SSHCommand{
 		HostPort:     fmt.Sprintf("%s:%d", host, opts.Port),
 		Username:     opts.Username,
@@ -138,6 +179,13 @@ func main() {
 		ProxyCommand: proxyCommand,
 		ForceTty:     len(opts.ForceTTY) == 2,
 		StdinNull:    opts.StdinNull,
+		Subsystem:    opts.Subsystem,
+		Forwards:     forwards,
+		WaitForGuard: opts.WaitForGuard,
+		Direct:       opts.Direct,
+	}
+	if opts.Timing {
+		sshCmd.Timing = os.Stderr
 	}
 	err = guardianagent.RunSSHCommand(sshCmd)
 	if err == nil {
@@ -155,6 +203,57 @@ func main() {
 
 }
 
+// runPlan requests batch approval for every command listed in opts.Plan and
+// reports the per-item decisions.
+func runPlan(parser *flags.Parser, opts *options) int {
+	planFile, err := os.Open(opts.Plan)
+	if err != nil {
+		fmt.Fprintf(os.Stderr, "%s: failed to open plan: %s\n", os.Args[0], err)
+		return 255
+	}
+	defer planFile.Close()
+
+	var cmds []guardianagent.SSHCommand
+	lineScanner := bufio.NewScanner(planFile)
+	for lineScanner.Scan() {
+		line := strings.TrimSpace(lineScanner.Text())
+		if line == "" || strings.HasPrefix(line, "#") {
+			continue
+		}
+		parts := strings.SplitN(line, " ", 2)
+		var cmd string
+		if len(parts) > 1 {
+			cmd = strings.TrimSpace(parts[1])
+		}
+		host, port, username := resolveRemote(parser, opts, parts[0])
+		cmds = append(cmds, guardianagent.SSHCommand{
+			HostPort: fmt.Sprintf("%s:%d", host, port),
+			Username: username,
+			Cmd:      cmd,
+		})
+	}
+	if err = lineScanner.Err(); err != nil {
+		fmt.Fprintf(os.Stderr, "%s: failed to read plan: %s\n", os.Args[0], err)
+		return 255
+	}
+
+	approved, err := guardianagent.RequestBatchApproval(cmds)
+	if err != nil {
+		fmt.Fprintf(os.Stderr, "%s: %s\n", os.Args[0], err)
+		return 255
+	}
+	status := 0
+	for idx, cmd := range cmds {
+		decision := "approved"
+		if !approved[idx] {
+			decision = "denied"
+			status = 1
+		}
+		fmt.Printf("%s\t%s@%s\t%s\n", decision, cmd.Username, cmd.HostPort, cmd.Cmd)
+	}
+	return status
+}
+
 func resolveRemote(parser *flags.Parser, opts *options, userAndHost string) (host string, port int, username string) {
 	sshCommandLine := []string{"-G", userAndHost}
 	if !parser.FindOptionByLongName("port").IsSetDefault() {
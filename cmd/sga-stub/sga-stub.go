@@ -6,6 +6,7 @@ import (
 	"log"
 	"os"
 	"path"
+	"time"
 
 	"github.com/StanfordSNR/guardian-agent"
 )
@@ -38,6 +39,35 @@ func main() {
 	if err := os.Symlink(tempSocket, permanentSocket); err != nil {
 		log.Fatalf("Failed to create symlink %s --> %s : %s", permanentSocket, tempSocket, err)
 	}
+	defer guardianagent.RemoveGuardRecord(tempSocket)
 	fmt.Println("OK")
+
+	// The guard only starts serving once it has read our OK, so the first
+	// check happens afterwards.
+	go func() {
+		refreshGuardRecord(tempSocket)
+		for range time.Tick(guardianagent.GuardRecordRefresh) {
+			refreshGuardRecord(tempSocket)
+		}
+	}()
 	reader.ReadLine()
 }
+
+// refreshGuardRecord checks that the guard answers on socket and records what
+// it supports, so that sga-ssh can skip the check. If the guard does not
+// answer, the record is removed and sga-ssh checks for itself.
+func refreshGuardRecord(socket string) {
+	options, err := guardianagent.ProbeGuard(socket)
+	if err != nil {
+		guardianagent.RemoveGuardRecord(socket)
+		return
+	}
+	record := guardianagent.GuardRecord{
+		Socket:  socket,
+		Options: string(options),
+		Checked: time.Now(),
+	}
+	if err = guardianagent.WriteGuardRecord(record); err != nil {
+		log.Printf("Failed to write guard record: %s", err)
+	}
+}
@@ -6,6 +6,7 @@ import (
 	"encoding/binary"
 	"encoding/hex"
 	"encoding/pem"
+	"errors"
 	"fmt"
 	"io"
 	"io/ioutil"
@@ -15,9 +16,10 @@ import (
 	"os/user"
 	"path"
 	"strings"
+	"sync"
+	"sync/atomic"
 
 	"golang.org/x/crypto/ssh"
-	"golang.org/x/crypto/ssh/agent"
 	"golang.org/x/crypto/ssh/knownhosts"
 )
 
@@ -51,8 +53,17 @@ type AgentForwardingNoticeMsg struct {
 const MsgExecutionRequest = 1
 const MsgExecutionDenied = 2
 const MsgExecutionApproved = 3
+const MsgSubsystemRequest = 4
+
+// 5 and 6 are not used, as MsgAgentFailure and MsgAgentSuccess are sent on
+// the same connection.
+const MsgTokenExecutionRequest = 7
+const MsgRequestChunk = 8
+const MsgForwardingRequest = 9
 const MsgHandoffComplete = 10
 const MsgHandoffFailed = 11
+const MsgBatchExecutionRequest = 12
+const MsgBatchExecutionReply = 13
 
 const MaxAgentPacketSize = 10 * 1024
 
@@ -69,6 +80,48 @@ type ExecutionRequestMessage struct {
 	Server  string
 }
 
+type SubsystemRequestMessage struct {
+	User      string
+	Subsystem string
+	Server    string
+}
+
+// BatchExecutionRequestMessage carries a whole plan of execution requests,
+// each a marshaled ExecutionRequestMessage (see MarshalList).
+type BatchExecutionRequestMessage struct {
+	Requests []byte `ssh:"rest"`
+}
+
+// BatchExecutionReplyMessage holds one token per requested item, in order.
+// Denied items get an empty token.
+type BatchExecutionReplyMessage struct {
+	Tokens []byte `ssh:"rest"`
+}
+
+type TokenExecutionRequestMessage struct {
+	Token   string
+	User    string
+	Command string
+	Server  string
+}
+
+// ForwardingRequestMessage asks for approval to open direct-tcpip channels to
+// Targets ("host:port", or DynamicForwardTarget for any destination) over the
+// sessions that follow on the same connection.
+type ForwardingRequestMessage struct {
+	User    string
+	Targets []string
+	Server  string
+}
+
+// RequestChunkMessage carries part of a request too large for one control
+// packet: the request's message number followed by its payload, Total bytes in
+// all.
+type RequestChunkMessage struct {
+	Total uint32
+	Data  []byte `ssh:"rest"`
+}
+
 type HandoffCompleteMessage struct {
 	NextTransportByte uint32
 }
@@ -77,11 +130,35 @@ type HandoffFailedMessage struct {
 	Msg string
 }
 
+// byteCounter is a traffic counter padded out to its own cache line, so that
+// the read and write directions, updated by different copy goroutines, do not
+// false-share.
+type byteCounter struct {
+	n int64
+	_ [56]byte
+}
+
+func (bc *byteCounter) add(n int) {
+	atomic.AddInt64(&bc.n, int64(n))
+}
+
+func (bc *byteCounter) load() int64 {
+	return atomic.LoadInt64(&bc.n)
+}
+
+// TrafficSnapshot is a point-in-time copy of a CustomConn's counters.
+type TrafficSnapshot struct {
+	BytesRead    int64
+	BytesWritten int64
+}
+
 type CustomConn struct {
+	// The counters come first to keep them 64-bit aligned for atomic access.
+	bytesRead    byteCounter
+	bytesWritten byteCounter
+
 	net.Conn
 	RemoteAddress net.Addr
-	bytesRead     int
-	bytesWritten  int
 }
 
 func (cc *CustomConn) RemoteAddr() net.Addr {
@@ -92,22 +169,29 @@ func (cc *CustomConn) RemoteAddr() net.Addr {
 }
 
 func (cc *CustomConn) BytesRead() int {
-	return cc.bytesRead
+	return int(cc.bytesRead.load())
 }
 
 func (cc *CustomConn) BytesWritten() int {
-	return cc.bytesWritten
+	return int(cc.bytesWritten.load())
+}
+
+func (cc *CustomConn) Traffic() TrafficSnapshot {
+	return TrafficSnapshot{
+		BytesRead:    cc.bytesRead.load(),
+		BytesWritten: cc.bytesWritten.load(),
+	}
 }
 
 func (cc *CustomConn) Read(p []byte) (n int, err error) {
 	n, err = cc.Conn.Read(p)
-	cc.bytesRead += n
+	cc.bytesRead.add(n)
 	return
 }
 
 func (cc *CustomConn) Write(b []byte) (n int, err error) {
 	n, err = cc.Conn.Write(b)
-	cc.bytesWritten += n
+	cc.bytesWritten.add(n)
 	return
 }
 
@@ -121,6 +205,9 @@ func ReadControlPacket(r io.Reader) (msgNum byte, payload []byte, err error) {
 	if debugCommon {
 		log.Printf("read len bytes: %s, len: %d", hex.EncodeToString(packetLenBytes[:]), length)
 	}
+	if length == 0 || length > MaxAgentPacketSize {
+		return 0, nil, fmt.Errorf("invalid control packet length: %d", length)
+	}
 	payload = make([]byte, length)
 	_, err = io.ReadFull(r, payload[:])
 	if debugCommon {
@@ -130,20 +217,66 @@ func ReadControlPacket(r io.Reader) (msgNum byte, payload []byte, err error) {
 	return payload[0], payload[1:], err
 }
 
+// controlPacketPool holds the buffers WriteControlPacket assembles packets in.
+var controlPacketPool = sync.Pool{
+	New: func() interface{} {
+		b := make([]byte, 0, 5+MaxAgentPacketSize)
+		return &b
+	},
+}
+
+// WriteControlPacket writes the header and payload with a single Write, so
+// that a packet costs one stream frame / syscall rather than two.
 func WriteControlPacket(w io.Writer, msgNum byte, payload []byte) error {
-	var packetHeader [5]byte
-	binary.BigEndian.PutUint32(packetHeader[:], uint32(len(payload)+1))
-	packetHeader[4] = msgNum
+	bp := controlPacketPool.Get().(*[]byte)
+	packet := append((*bp)[:0], 0, 0, 0, 0, msgNum)
+	binary.BigEndian.PutUint32(packet, uint32(len(payload)+1))
+	packet = append(packet, payload...)
 	if debugCommon {
 		log.Printf("written len: %d", len(payload)+1)
 	}
-	if _, err := w.Write(packetHeader[:]); err != nil {
-		return err
+	_, err := w.Write(packet)
+	// Buffers grown by oversized payloads are left to the garbage collector.
+	if cap(packet) <= 5+MaxAgentPacketSize {
+		*bp = packet
+		controlPacketPool.Put(bp)
 	}
-	_, err := w.Write(payload)
 	return err
 }
 
+// MarshalList encodes a list of byte strings, each prefixed by its uint32 length.
+func MarshalList(items [][]byte) []byte {
+	size := 0
+	for _, item := range items {
+		size += 4 + len(item)
+	}
+	out := make([]byte, 0, size)
+	var lenBytes [4]byte
+	for _, item := range items {
+		binary.BigEndian.PutUint32(lenBytes[:], uint32(len(item)))
+		out = append(out, lenBytes[:]...)
+		out = append(out, item...)
+	}
+	return out
+}
+
+func UnmarshalList(b []byte) ([][]byte, error) {
+	var items [][]byte
+	for len(b) > 0 {
+		if len(b) < 4 {
+			return nil, errors.New("truncated list length")
+		}
+		length := binary.BigEndian.Uint32(b)
+		b = b[4:]
+		if uint32(len(b)) < length {
+			return nil, errors.New("truncated list item")
+		}
+		items = append(items, b[:length])
+		b = b[length:]
+	}
+	return items, nil
+}
+
 func ReplaceSSHAuthSockEnv(env []string, newVal string) (newEnv []string, err error) {
 	i := 0
 	for i = 0; i < len(env); i++ {
@@ -188,6 +321,12 @@ type CommonOptions struct {
 	Version bool `long:"version" short:"V" description:"Display the version number and exit"`
 }
 
+// userKnownHostsPath returns the known_hosts file of the user with the given
+// home directory. Tests replace it to use a file of their own.
+var userKnownHostsPath = func(homeDir string) string {
+	return path.Join(homeDir, ".ssh", "known_hosts")
+}
+
 // Adapted from https://github.com/coreos/fleet/blob/master/ssh/known_hosts.go
 func putHostKey(knownHostsPath string, addr string, hostKey ssh.PublicKey) error {
 	// Make necessary directories if needed
@@ -244,8 +383,8 @@ func HostKeyCallback(hostname string, remote net.Addr, key ssh.PublicKey, ui UI)
 		return fmt.Errorf("Failed to get current user: %s", err)
 	}
 	keyFingerprintStr := md5String(md5.Sum(key.Marshal()))
-	knownHostsPath := path.Join(curuser.HomeDir, ".ssh", "known_hosts")
-	if kh, err := knownhosts.New(knownHostsPath); err == nil {
+	knownHostsPath := userKnownHostsPath(curuser.HomeDir)
+	if kh, err := userKnownHosts.callback(knownHostsPath); err == nil {
 		if err = kh(hostname, remote, key); err == nil {
 			return nil
 		}
@@ -267,6 +406,8 @@ func HostKeyCallback(hostname string, remote net.Addr, key ssh.PublicKey, ui UI)
 	return &knownhosts.KeyError{}
 }
 
+var errEncryptedKey = errors.New("key is encrypted")
+
 func getKeyFileAuth(keyPath string, ui UI) (ssh.Signer, error) {
 	buf, err := ioutil.ReadFile(keyPath)
 	if err != nil {
@@ -282,6 +423,9 @@ func getKeyFileAuth(keyPath string, ui UI) (ssh.Signer, error) {
 		Headers: p.Headers,
 	}
 	if x509.IsEncryptedPEMBlock(&pBlock) {
+		if ui == nil {
+			return nil, errEncryptedKey
+		}
 		password, err := ui.AskPassword(fmt.Sprintf("Enter passphrase for key '%s':", keyPath))
 		rawkey, err := ssh.ParsePrivateKeyWithPassphrase(buf, []byte(password))
 		if err != nil {
@@ -301,33 +445,5 @@ func getAuth(username string, host string, homeDir string, ui UI) []ssh.AuthMeth
 	passwordAuthMethod := ssh.PasswordCallback(func() (string, error) {
 		return ui.AskPassword(fmt.Sprintf("%s@%s password:", username, host))
 	})
-	realAgentPath := os.Getenv("SSH_AUTH_SOCK")
-	if realAgentPath != "" {
-		realAgent, err := net.Dial("unix", realAgentPath)
-		if err == nil {
-			agentClient := agent.NewClient(realAgent)
-			agentKeys, err := agentClient.List()
-			if err == nil && len(agentKeys) > 0 {
-				return []ssh.AuthMethod{
-					ssh.PublicKeysCallback(agentClient.Signers),
-					passwordAuthMethod,
-				}
-			}
-		}
-	}
-
-	var signers []ssh.Signer
-	for _, keyFile := range []string{"identity", "id_dsa", "id_rsa", "id_ecdsa", "id_ed25519"} {
-		keyPath := path.Join(homeDir, ".ssh", keyFile)
-		if _, err := os.Stat(keyPath); os.IsNotExist(err) {
-			continue
-		}
-		signer, err := getKeyFileAuth(keyPath, ui)
-		if err != nil {
-			log.Printf("Error parsing private key: %s: %s", keyPath, err)
-			continue
-		}
-		signers = append(signers, signer)
-	}
-	return []ssh.AuthMethod{ssh.PublicKeys(signers...), passwordAuthMethod}
+	return append(userSigners.authMethods(homeDir, ui), passwordAuthMethod)
 }
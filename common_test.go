@@ -0,0 +1,264 @@
+package guardianagent
+
+import (
+	"bytes"
+	"io"
+	"io/ioutil"
+	"net"
+	"sync"
+	"testing"
+	"time"
+)
+
+// discardConn is a net.Conn whose reads and writes succeed immediately, so
+// that benchmarks of wrappers measure only the wrapper.
+type discardConn struct {
+	net.Conn
+}
+
+func (discardConn) Read(p []byte) (int, error)  { return len(p), nil }
+func (discardConn) Write(p []byte) (int, error) { return len(p), nil }
+
+func BenchmarkCustomConnRead(b *testing.B) {
+	cc := &CustomConn{Conn: discardConn{}}
+	buf := make([]byte, 32*1024)
+	b.SetBytes(int64(len(buf)))
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		cc.Read(buf)
+	}
+}
+
+func BenchmarkCustomConnWrite(b *testing.B) {
+	cc := &CustomConn{Conn: discardConn{}}
+	buf := make([]byte, 32*1024)
+	b.SetBytes(int64(len(buf)))
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		cc.Write(buf)
+	}
+}
+
+// latencyConn delivers each write to the wrapped connection after a fixed
+// delay, emulating a link's one-way latency without limiting its bandwidth.
+type latencyConn struct {
+	net.Conn
+	delay time.Duration
+	queue chan delayedWrite
+	done  chan struct{}
+	once  sync.Once
+}
+
+type delayedWrite struct {
+	due  time.Time
+	data []byte
+	// Set for the marker queued by CloseWrite, closed once it is delivered.
+	closeWrite chan struct{}
+}
+
+func newLatencyConn(conn net.Conn, delay time.Duration) *latencyConn {
+	c := &latencyConn{
+		Conn:  conn,
+		delay: delay,
+		queue: make(chan delayedWrite, 4096),
+		done:  make(chan struct{}),
+	}
+	go c.deliver()
+	return c
+}
+
+func (c *latencyConn) deliver() {
+	for {
+		select {
+		case w := <-c.queue:
+			time.Sleep(time.Until(w.due))
+			if w.closeWrite != nil {
+				if cw, ok := c.Conn.(CloseWriter); ok {
+					cw.CloseWrite()
+				}
+				close(w.closeWrite)
+				continue
+			}
+			if _, err := c.Conn.Write(w.data); err != nil {
+				c.once.Do(func() { close(c.done) })
+				return
+			}
+		case <-c.done:
+			return
+		}
+	}
+}
+
+func (c *latencyConn) Write(p []byte) (int, error) {
+	w := delayedWrite{due: time.Now().Add(c.delay), data: append([]byte(nil), p...)}
+	select {
+	case c.queue <- w:
+		return len(p), nil
+	case <-c.done:
+		return 0, io.ErrClosedPipe
+	}
+}
+
+// CloseWrite half-closes the wrapped connection once the writes before it have
+// been delivered, and waits for that.
+func (c *latencyConn) CloseWrite() error {
+	w := delayedWrite{due: time.Now().Add(c.delay), closeWrite: make(chan struct{})}
+	select {
+	case c.queue <- w:
+	case <-c.done:
+		return io.ErrClosedPipe
+	}
+	select {
+	case <-w.closeWrite:
+		return nil
+	case <-c.done:
+		return io.ErrClosedPipe
+	}
+}
+
+func (c *latencyConn) Close() error {
+	c.once.Do(func() { close(c.done) })
+	return c.Conn.Close()
+}
+
+// copyConn copies every read and write through its own buffers, standing in
+// for the copy a socket makes, so that the counters' cost is seen relative to
+// moving the data.
+type copyConn struct {
+	net.Conn
+	in  []byte
+	out []byte
+}
+
+func newCopyConn() *copyConn {
+	return &copyConn{in: make([]byte, 32*1024), out: make([]byte, 32*1024)}
+}
+
+func (c *copyConn) Read(p []byte) (int, error)  { return copy(p, c.in), nil }
+func (c *copyConn) Write(p []byte) (int, error) { return copy(c.out, p), nil }
+
+// benchmarkDuplex reads and writes conn from two goroutines, as the relay's
+// copy goroutines do, while a third polls snapshot if it is set, as handoff
+// and the session metrics do.
+func benchmarkDuplex(b *testing.B, conn net.Conn, snapshot func()) {
+	buf := make([]byte, 32*1024)
+	b.SetBytes(int64(2 * len(buf)))
+	b.ReportAllocs()
+	stop := make(chan struct{})
+	polled := make(chan struct{})
+	go func() {
+		defer close(polled)
+		for {
+			select {
+			case <-stop:
+				return
+			default:
+			}
+			if snapshot != nil {
+				snapshot()
+			}
+		}
+	}()
+	var wg sync.WaitGroup
+	wg.Add(2)
+	b.ResetTimer()
+	go func() {
+		defer wg.Done()
+		rbuf := make([]byte, len(buf))
+		for i := 0; i < b.N; i++ {
+			conn.Read(rbuf)
+		}
+	}()
+	go func() {
+		defer wg.Done()
+		for i := 0; i < b.N; i++ {
+			conn.Write(buf)
+		}
+	}()
+	wg.Wait()
+	b.StopTimer()
+	close(stop)
+	<-polled
+}
+
+// BenchmarkCustomConnContended compares a bare connection with one whose
+// traffic is counted while another goroutine takes snapshots in a tight loop,
+// far more often than handoff and the session metrics do.
+func BenchmarkCustomConnContended(b *testing.B) {
+	b.Run("raw", func(b *testing.B) {
+		benchmarkDuplex(b, newCopyConn(), nil)
+	})
+	b.Run("counted", func(b *testing.B) {
+		cc := &CustomConn{Conn: newCopyConn()}
+		benchmarkDuplex(b, cc, func() { cc.Traffic() })
+	})
+}
+
+func BenchmarkWriteControlPacket(b *testing.B) {
+	payload := make([]byte, 256)
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		if err := WriteControlPacket(ioutil.Discard, MsgExecutionRequest, payload); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+func BenchmarkReadControlPacket(b *testing.B) {
+	var packet bytes.Buffer
+	WriteControlPacket(&packet, MsgExecutionRequest, make([]byte, 256))
+	r := bytes.NewReader(packet.Bytes())
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		r.Seek(0, io.SeekStart)
+		if _, _, err := ReadControlPacket(r); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+func TestControlPacketRoundTrip(t *testing.T) {
+	var buf bytes.Buffer
+	for _, size := range []int{0, 1, MaxAgentPacketSize - 1} {
+		payload := bytes.Repeat([]byte{0xab}, size)
+		if err := WriteControlPacket(&buf, MsgExecutionRequest, payload); err != nil {
+			t.Fatal(err)
+		}
+		msgNum, got, err := ReadControlPacket(&buf)
+		if err != nil {
+			t.Fatalf("size %d: %s", size, err)
+		}
+		if msgNum != MsgExecutionRequest || !bytes.Equal(got, payload) {
+			t.Errorf("size %d: got message %d with %d bytes", size, msgNum, len(got))
+		}
+	}
+}
+
+// The guard connection carries both the agent protocol's replies and the
+// guard's own messages, so no two of them may share a number.
+func TestControlMessageNumbersDistinct(t *testing.T) {
+	numbers := map[string]byte{
+		"MsgAgentSuccess":          MsgAgentSuccess,
+		"MsgAgentFailure":          MsgAgentFailure,
+		"MsgAgentCExtension":       MsgAgentCExtension,
+		"MsgAgentForwardingNotice": MsgAgentForwardingNotice,
+		"MsgExecutionRequest":      MsgExecutionRequest,
+		"MsgExecutionDenied":       MsgExecutionDenied,
+		"MsgExecutionApproved":     MsgExecutionApproved,
+		"MsgSubsystemRequest":      MsgSubsystemRequest,
+		"MsgTokenExecutionRequest": MsgTokenExecutionRequest,
+		"MsgRequestChunk":          MsgRequestChunk,
+		"MsgForwardingRequest":     MsgForwardingRequest,
+		"MsgHandoffComplete":       MsgHandoffComplete,
+		"MsgHandoffFailed":         MsgHandoffFailed,
+		"MsgBatchExecutionRequest": MsgBatchExecutionRequest,
+		"MsgBatchExecutionReply":   MsgBatchExecutionReply,
+	}
+	seen := make(map[byte]string)
+	for name, number := range numbers {
+		if other, ok := seen[number]; ok {
+			t.Errorf("%s and %s are both %d", name, other, number)
+		}
+		seen[number] = name
+	}
+}
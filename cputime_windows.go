@@ -0,0 +1,12 @@
+// +build windows
+
+package guardianagent
+
+import (
+	"time"
+)
+
+// processCPUTime is not measured on Windows.
+func processCPUTime() time.Duration {
+	return 0
+}
@@ -13,6 +13,7 @@ import (
 	"os/user"
 	"path"
 	"sync"
+	"time"
 
 	"github.com/hashicorp/yamux"
 	"golang.org/x/crypto/ssh"
@@ -28,39 +29,83 @@ type SSHCommand struct {
 	ProxyCommand string
 	StdinNull    bool
 	ForceTty     bool
+	// Subsystem indicates that Cmd names a subsystem (e.g. "sftp") to be
+	// requested instead of a command to be executed.
+	Subsystem bool
+	// Forwards are local listeners relayed over the connection, after
+	// approval by the agent (ssh -L and -D).
+	Forwards []Forward
+	// WaitForGuard is how long to wait for a guard to appear if none is
+	// reachable, e.g. while the guard reconnects. Zero fails over right away.
+	WaitForGuard time.Duration
+	// Direct connects to the server without the agent guard, even if one is
+	// reachable.
+	Direct bool
+	// Timing, if set, receives a one-line report of the session's setup
+	// latency, time to first byte, output throughput and CPU use.
+	Timing io.Writer
+
+	// Stdin, Stdout and Stderr are the streams the remote session is wired
+	// to after startup. If nil, the process's own standard streams are used.
+	Stdin  io.Reader
+	Stdout io.Writer
+	Stderr io.Writer
 }
 
 type client struct {
 	SSHCommand
 
 	agentConn        net.Conn
+	guardOptions     extensionOptions
 	sshClient        *ssh.Client
 	session          *ssh.Session
 	stdin            io.WriteCloser
 	stdout           io.Reader
 	stderr           io.Reader
 	oldTerminalState *terminal.State
+
+	// Set until the reply to a pipelined extension query has been read. If
+	// the session fails before then, the guard may be gone although the
+	// record said otherwise, and the client connects directly instead.
+	queryReplyPending bool
+	// Reassembles replies the guard sent in chunks.
+	replyChunks requestAssembler
+
+	timing *sessionTiming
 }
 
 func (c *client) connectToAgent() error {
+	// With a fresh record from sga-stub, the extension query is pipelined with
+	// the first request instead of waiting for its reply here; the reply is
+	// consumed by readControlPacket.
+	if record := freshGuardRecord(); record != nil {
+		sock, err := net.Dial("unix", record.Socket)
+		if err == nil {
+			if err = WriteControlPacket(sock, MsgAgentCExtension, guardQuery(false)); err == nil {
+				c.agentConn = sock
+				c.guardOptions = parseExtensionOptions([]byte(record.Options))
+				c.queryReplyPending = true
+				return nil
+			}
+			sock.Close()
+		}
+	}
+
 	locations := []string{path.Join(UserRuntimeDir(), AgentGuardSockName)}
 	for _, loc := range locations {
 		sock, err := net.Dial("unix", loc)
 		if err != nil {
 			continue
 		}
-		query := AgentCExtensionMsg{
-			ExtensionType: AgentGuardExtensionType,
-		}
-
-		err = WriteControlPacket(sock, MsgAgentCExtension, ssh.Marshal(query))
+		err = WriteControlPacket(sock, MsgAgentCExtension, guardQuery(false))
 		if err != nil {
 			continue
 		}
 
-		msgNum, _, err := ReadControlPacket(sock)
+		msgNum, reply, err := ReadControlPacket(sock)
 		if err == nil && msgNum == MsgAgentSuccess {
 			c.agentConn = sock
+			c.guardOptions = parseExtensionOptions(reply)
 			return nil
 		}
 		sock.Close()
@@ -68,6 +113,35 @@ func (c *client) connectToAgent() error {
 	return fmt.Errorf("Failed to connect to agent guard. Did you setup agent guard forwarding to this host?")
 }
 
+// readControlPacket reads the agent's next reply, first consuming the reply to
+// a pipelined extension query, and reassembles replies sent in chunks.
+func (c *client) readControlPacket() (msgNum byte, payload []byte, err error) {
+	if c.queryReplyPending {
+		msgNum, reply, err := ReadControlPacket(c.agentConn)
+		if err != nil {
+			return 0, nil, err
+		}
+		if msgNum != MsgAgentSuccess {
+			return 0, nil, fmt.Errorf("agent guard rejected the extension query")
+		}
+		c.guardOptions = parseExtensionOptions(reply)
+		c.queryReplyPending = false
+	}
+	for {
+		msgNum, payload, err = ReadControlPacket(c.agentConn)
+		if err != nil || msgNum != MsgRequestChunk {
+			return msgNum, payload, err
+		}
+		done, chunkedMsgNum, reply, err := c.replyChunks.add(payload, c.guardOptions.maxRequest)
+		if err != nil {
+			return 0, nil, err
+		}
+		if done {
+			return chunkedMsgNum, reply, nil
+		}
+	}
+}
+
 type settableWriter struct {
 	w    io.Writer
 	mu   sync.Mutex
@@ -136,7 +210,7 @@ func (c *client) startCommand(conn *ssh.Client, cmd string) (err error) {
 		return fmt.Errorf("failed to setup stderr: %s", err)
 	}
 
-	if cmd == "" || c.ForceTty {
+	if (cmd == "" || c.ForceTty) && !c.Subsystem {
 		// Set up terminal modes -- use some reasonable defaults
 		modes := ssh.TerminalModes{
 			ssh.TTY_OP_ISPEED: 38400, // baud in
@@ -215,7 +289,9 @@ func (c *client) startCommand(conn *ssh.Client, cmd string) (err error) {
 			}
 		}
 	}
-	if cmd == "" {
+	if c.Subsystem {
+		err = c.session.RequestSubsystem(cmd)
+	} else if cmd == "" {
 		err = c.session.Shell()
 	} else {
 		err = c.session.Start(cmd)
@@ -229,19 +305,43 @@ func (c *client) startCommand(conn *ssh.Client, cmd string) (err error) {
 }
 
 func (c *client) resume() error {
+	if len(c.Forwards) > 0 {
+		stopForwards, err := c.startForwards(c.sshClient)
+		if err != nil {
+			return err
+		}
+		defer stopForwards()
+	}
+	var stdin io.Reader = os.Stdin
+	if c.Stdin != nil {
+		stdin = c.Stdin
+	}
+	var stdout io.Writer = os.Stdout
+	if c.Stdout != nil {
+		stdout = c.Stdout
+	}
+	var stderr io.Writer = os.Stderr
+	if c.Stderr != nil {
+		stderr = c.Stderr
+	}
 	go func() {
 		if !c.StdinNull {
-			io.Copy(c.stdin, os.Stdin)
+			io.Copy(c.stdin, stdin)
 		}
 		c.stdin.Close()
 	}()
+	sessionOut := c.stdout
+	if c.timing != nil {
+		c.timing.sessionReady()
+		sessionOut = c.timing.countOutput(sessionOut)
+	}
 	done := make(chan error)
 	go func() {
-		_, err := io.Copy(os.Stdout, c.stdout)
+		_, err := io.Copy(stdout, sessionOut)
 		done <- err
 	}()
 	go func() {
-		_, err := io.Copy(os.Stderr, c.stderr)
+		_, err := io.Copy(stderr, c.stderr)
 		done <- err
 	}()
 
@@ -345,13 +445,34 @@ func (c *client) connectToServer() (reader io.ReadCloser, writer io.WriteCloser,
 func RunSSHCommand(cmd SSHCommand) error {
 	cli := client{SSHCommand: cmd}
 	defer cli.Close()
-	if cli.connectToAgent() == nil {
-		return cli.runDelegated()
+	if cmd.Timing != nil {
+		cli.timing = newSessionTiming()
+		defer cli.timing.report(cmd.Timing)
+	}
+	if cmd.Direct {
+		return cli.runDirect()
+	}
+	err := cli.connectToAgent()
+	if err != nil && cmd.WaitForGuard > 0 {
+		log.Printf("%s, waiting up to %s", err, cmd.WaitForGuard)
+		err = cli.waitForGuard(cmd.WaitForGuard)
+	}
+	if err == nil {
+		err = cli.runDelegated()
+		if err == nil || !cli.queryReplyPending {
+			return err
+		}
+		log.Printf("Agent guard did not answer (%s), connecting directly", err)
+		cli.agentConn.Close()
+		cli.agentConn = nil
 	}
 	return cli.runDirect()
 }
 
 func (c *client) runDirect() error {
+	if c.timing != nil {
+		c.timing.path = "direct"
+	}
 	serverReader, serverWriter, err := c.connectToServer()
 	if err != nil {
 		return err
@@ -402,216 +523,226 @@ func (c *client) runDirect() error {
 
 }
 
-func (c *client) runDelegated() error {
-	serverReader, serverWriter, err := c.connectToServer()
-	if err != nil {
-		return err
-	}
-
-	execReq := ExecutionRequestMessage{
-		User:    c.Username,
-		Command: c.Cmd,
-		Server:  c.HostPort,
-	}
-
-	execReqPacket := ssh.Marshal(execReq)
-	err = WriteControlPacket(c.agentConn, MsgExecutionRequest, execReqPacket)
-	if err != nil {
-		return fmt.Errorf("failed to send MsgExecutionRequest to agent: %s", err)
-	}
-
-	// Wait for response before opening data connection
-	msgNum, msg, err := ReadControlPacket(c.agentConn)
+// readApproval reads the agent's reply to an execution request. denyReason is
+// set if the agent denied the request.
+func (c *client) readApproval() (denyReason string, err error) {
+	msgNum, msg, err := c.readControlPacket()
 	if err != nil {
-		return fmt.Errorf("failed to get approval from agent: %s", err)
+		return "", fmt.Errorf("failed to get approval from agent: %s", err)
 	}
 	switch msgNum {
 	case MsgExecutionApproved:
-		break
+		return "", nil
 	case MsgExecutionDenied:
 		var denyMsg ExecutionDeniedMessage
 		ssh.Unmarshal(msg, &denyMsg)
-		return fmt.Errorf("execution denied by agent: %s", denyMsg.Reason)
+		return denyMsg.Reason, nil
 	default:
-		return fmt.Errorf("failed to get approval from agent, unknown reply: %d", msgNum)
+		return "", fmt.Errorf("failed to get approval from agent, unknown reply: %d", msgNum)
 	}
+}
 
-	ymux, err := yamux.Client(c.agentConn, nil)
-	control, err := ymux.Open()
-	if err != nil {
-		return fmt.Errorf("failed to get control stream: %s", err)
-	}
-	// Proceed with approval
-	agentData, err := ymux.Open()
-	if err != nil {
-		return fmt.Errorf("failed to get data stream: %s", err)
-	}
-	pt, err := ymux.Open()
-	if err != nil {
-		return fmt.Errorf("failed to get transport stream: %s", err)
+// requestApproval asks the agent to approve the session. If a batch token was
+// issued for this exact command it is redeemed first, falling back to a
+// regular request if the agent no longer honors it.
+func (c *client) requestApproval() error {
+	if len(c.Forwards) > 0 {
+		if err := c.requestForwarding(); err != nil {
+			return err
+		}
 	}
-	agentTransport := CustomConn{Conn: pt}
-
-	sshClientConn, sshPipe := net.Pipe()
-
-	// Initially, the SSH connection is wired to the agent data,
-	// and the server connection is wired to the agent transport.
-	sshOut := settableWriter{w: agentData}
-	serverOut := settableWriter{w: &agentTransport}
-	// To be used to buffer traffic that needs to be replayed to the client
-	// after the handoff (since the transport layer might deliver to the agent
-	// packets that the server has sent after msgNewKeys).
-	bufferedTraffic := new(bytes.Buffer)
-	bufferedOffset := 0
-
-	runningRoutines := sync.WaitGroup{}
-	defer runningRoutines.Wait()
-
-	runningRoutines.Add(1)
-	go func() {
-		defer runningRoutines.Done()
-
-		_, err := io.Copy(&sshOut, sshPipe)
-		if err != nil {
-			log.Printf("Error copying outgoing SSH data: %s", err)
-		} else {
-			log.Printf("Finished copying outgoing SSH data")
+	if !c.Subsystem {
+		if token := takeBatchToken(c.Username, c.HostPort, c.Cmd); token != "" {
+			tokenReq := TokenExecutionRequestMessage{
+				Token:   token,
+				User:    c.Username,
+				Command: c.Cmd,
+				Server:  c.HostPort,
+			}
+			err := writeRequest(c.agentConn, c.guardOptions.maxRequest, MsgTokenExecutionRequest, ssh.Marshal(tokenReq))
+			if err != nil {
+				return fmt.Errorf("failed to send MsgTokenExecutionRequest to agent: %s", err)
+			}
+			denyReason, err := c.readApproval()
+			if err != nil {
+				return err
+			}
+			if denyReason == "" {
+				return nil
+			}
+			log.Printf("Batch token not accepted (%s), requesting approval", denyReason)
 		}
-		sshOut.mu.Lock()
-		sshOut.Close()
-		sshOut.w = nil
-		sshOut.mu.Unlock()
-	}()
+	}
 
-	agentDone := make(chan error, 1)
-	runningRoutines.Add(1)
-	go func() {
-		defer runningRoutines.Done()
-		_, err := io.Copy(sshPipe, agentData)
-		if debugClient {
-			log.Printf("Finished copying ssh data from agent: %s", err)
+	if c.Subsystem {
+		subsystemReq := SubsystemRequestMessage{
+			User:      c.Username,
+			Subsystem: c.Cmd,
+			Server:    c.HostPort,
 		}
+		err := writeRequest(c.agentConn, c.guardOptions.maxRequest, MsgSubsystemRequest, ssh.Marshal(subsystemReq))
 		if err != nil {
-			sshPipe.Close()
-			agentDone <- fmt.Errorf("failed to read ssh data from agent: %s", err)
-			return
+			return fmt.Errorf("failed to send MsgSubsystemRequest to agent: %s", err)
 		}
-
-		serverOut.mu.Lock()
-		defer serverOut.mu.Unlock()
-
-		handoffByte, err := getHandoffNextTransportByte(control)
-
-		if err != nil {
-			agentDone <- err
-			sshPipe.Close()
-			return
+	} else {
+		execReq := ExecutionRequestMessage{
+			User:    c.Username,
+			Command: c.Cmd,
+			Server:  c.HostPort,
 		}
 
-		syncBufferedTraffic(bufferedTraffic, bufferedOffset, handoffByte)
-		n, err := bufferedTraffic.WriteTo(sshPipe)
+		execReqPacket := ssh.Marshal(execReq)
+		err := writeRequest(c.agentConn, c.guardOptions.maxRequest, MsgExecutionRequest, execReqPacket)
 		if err != nil {
-			agentDone <- fmt.Errorf("failed to backfill traffic from server to client: %s", err)
-			sshPipe.Close()
-			return
-		}
-		if debugClient {
-			log.Printf("Backfilled %d bytes from server to client", n)
+			return fmt.Errorf("failed to send MsgExecutionRequest to agent: %s", err)
 		}
+	}
 
-		agentDone <- nil
+	// Wait for response before opening data connection
+	denyReason, err := c.readApproval()
+	if err != nil {
+		return err
+	}
+	if denyReason != "" {
+		return fmt.Errorf("execution denied by agent: %s", denyReason)
+	}
+	return nil
+}
 
-		if serverOut.werr != nil {
-			io.Copy(sshPipe, serverReader)
-			sshPipe.Close()
-		} else {
-			agentTransport.Close()
-			serverOut.w = sshPipe
-		}
+type serverConnection struct {
+	reader  io.ReadCloser
+	writer  io.WriteCloser
+	err     error
+	elapsed time.Duration
+}
 
-	}()
+func (conn serverConnection) close() {
+	if conn.err == nil {
+		conn.writer.Close()
+		conn.reader.Close()
+	}
+}
+
+// A server connection opened while approval is pending is dropped after
+// preconnectLimit. Until it authenticates it holds one of the server's
+// MaxStartups slots, and the server closes it after LoginGraceTime (120s by
+// default), so a slow approval reconnects instead.
+const preconnectLimit = 20 * time.Second
+
+// serverPreconnect is a connection to the server opened in the background.
+type serverPreconnect struct {
+	done  chan struct{}
+	conn  serverConnection
+	timer *time.Timer
+
+	mu      sync.Mutex
+	taken   bool
+	dropped bool
+}
 
-	runningRoutines.Add(1)
+func (c *client) preconnect() *serverPreconnect {
+	p := &serverPreconnect{done: make(chan struct{})}
 	go func() {
-		defer runningRoutines.Done()
-		_, err := io.Copy(&serverOut, serverReader)
-		if debugClient {
-			log.Printf("Finished copying transport data to agent")
-		}
-		serverOut.Close()
-		if err != nil && err != os.ErrClosed && err != yamux.ErrStreamClosed {
-			log.Printf("To agent transport forwarding failed: %s", err)
-		}
+		start := time.Now()
+		reader, writer, err := c.connectToServer()
+		p.conn = serverConnection{reader: reader, writer: writer, err: err, elapsed: time.Since(start)}
+		close(p.done)
 	}()
-	fromAgentTransportDone := make(chan error, 1)
+	p.timer = time.AfterFunc(preconnectLimit, p.drop)
+	return p
+}
 
-	runningRoutines.Add(1)
-	go func() {
-		defer runningRoutines.Done()
+// drop closes the connection unless it was taken already.
+func (p *serverPreconnect) drop() {
+	<-p.done
+	p.mu.Lock()
+	defer p.mu.Unlock()
+	if p.taken || p.dropped {
+		return
+	}
+	p.dropped = true
+	p.conn.close()
+}
 
-		_, err := io.Copy(serverWriter, &agentTransport)
-		if debugClient {
-			log.Printf("Finished copying transport data from agent")
-		}
+// take waits for the connection to be established and returns it. ok is false
+// if it was dropped.
+func (p *serverPreconnect) take() (conn serverConnection, ok bool) {
+	p.timer.Stop()
+	<-p.done
+	p.mu.Lock()
+	defer p.mu.Unlock()
+	if p.dropped {
+		return serverConnection{}, false
+	}
+	p.taken = true
+	return p.conn, true
+}
 
-		sshOut.mu.Lock()
-		if sshOut.w != nil {
-			sshOut.Close()
-			sshOut.w = serverWriter
-		} else {
-			if cw, ok := serverWriter.(CloseWriter); ok {
-				log.Printf("CloseWrite serverWriter")
-				cw.CloseWrite()
-			} else {
-				log.Printf("Close serverWriter")
-				serverWriter.Close()
-			}
-		}
-		sshOut.mu.Unlock()
+func (c *client) runDelegated() error {
+	if c.timing != nil {
+		c.timing.path = "delegated"
+	}
+	// Connecting to the server and getting the agent's approval are
+	// independent, so the connection is started right away and is only
+	// read from once approved (the server's banner waits in the socket).
+	pre := c.preconnect()
 
-		if err != nil {
-			fromAgentTransportDone <- fmt.Errorf("failed to copy data from agent to server: %s", err)
-		} else {
-			fromAgentTransportDone <- nil
-		}
-	}()
+	approvalStart := time.Now()
+	if err := c.requestApproval(); err != nil {
+		go pre.drop()
+		return err
+	}
+	approvalTime := time.Since(approvalStart)
 
-	doHandoffOnKex := make(chan chan error, 1)
-	kexCallback := func() {
-		if debugClient {
-			log.Printf("KexCallback called")
-		}
-		var done chan error
-		select {
-		case done = <-doHandoffOnKex:
-			break
-		default:
-			return
+	serverConn, preconnected := pre.take()
+	if !preconnected {
+		log.Printf("Approval took %s, reconnecting to the server", approvalTime)
+		start := time.Now()
+		reader, writer, err := c.connectToServer()
+		serverConn = serverConnection{reader: reader, writer: writer, err: err, elapsed: time.Since(start)}
+	}
+	if serverConn.err != nil {
+		return serverConn.err
+	}
+	serverReader, serverWriter := serverConn.reader, serverConn.writer
+	if debugClient {
+		saved := serverConn.elapsed
+		if approvalTime < saved {
+			saved = approvalTime
 		}
+		log.Printf("Session timing: server connect %s, agent approval %s, saved %s by overlapping",
+			serverConn.elapsed, approvalTime, saved)
+	}
 
+	control, agentData, pt, err := c.openSessionStreams()
+	if err != nil {
+		return err
+	}
+	agentTransport := CustomConn{Conn: pt}
+	defer func() {
 		if debugClient {
-			log.Printf("Starting transport rewiring")
-		}
-
-		if err = <-fromAgentTransportDone; err != nil {
-			done <- fmt.Errorf("failed to forward agent transport data: %s", err)
-			return
+			traffic := agentTransport.Traffic()
+			log.Printf("Relayed through agent: %d bytes from server, %d bytes to server",
+				traffic.BytesWritten, traffic.BytesRead)
 		}
+	}()
 
-		go func() {
-			done <- <-agentDone
-		}()
-	}
+	// Initially, the SSH connection is wired to the agent data,
+	// and the server connection is wired to the agent transport.
+	relay := newHandoffRelay(control, agentData, &agentTransport, serverReader, serverWriter)
+	runningRoutines := sync.WaitGroup{}
+	defer runningRoutines.Wait()
+	relay.start(&runningRoutines)
 
 	config := ssh.ClientConfig{
 		Config: ssh.Config{
-			KexCallback: kexCallback,
+			KexCallback: relay.onKex,
 		},
 		HostKeyCallback:          ssh.InsecureIgnoreHostKey(),
 		DeferHostKeyVerification: true,
 	}
 
-	cc, chans, reqs, err := ssh.NewClientConn(sshClientConn, c.HostPort, &config)
+	cc, chans, reqs, err := ssh.NewClientConn(relay, c.HostPort, &config)
 	if err != nil {
 		return fmt.Errorf("failed to connect to %s: %s", c.HostPort, err)
 	}
@@ -634,9 +765,6 @@ func (c *client) runDelegated() error {
 		log.Printf("%s request denied, continuing", ssh.NoMoreSessionRequestName)
 	}
 
-	handoffComplete := make(chan error, 1)
-	doHandoffOnKex <- handoffComplete
-
 	if debugClient {
 		log.Printf("Initiating Handoff Key Exchange")
 	}
@@ -644,32 +772,42 @@ func (c *client) runDelegated() error {
 	// First start buffering traffic from the server, since packets
 	// sent by ther server after msgNewKeys might need to replayed
 	// to the client after the handoff.
-	serverOut.mu.Lock()
-	serverOut.w = io.MultiWriter(bufferedTraffic, serverOut.w)
-	bufferedOffset = agentTransport.BytesWritten()
-	serverOut.mu.Unlock()
+	relay.startBuffering()
 
 	c.sshClient.RequestKeyChange()
-	errChan := make(chan error)
 	go func() {
-		errChan <- c.sshClient.Wait()
+		relay.sessionEnded(c.sshClient.Wait())
 	}()
 
-	select {
-	case err = <-handoffComplete:
-		if err != nil {
-			return err
-		}
-		if debugClient {
-			log.Printf("Handoff Complete")
-		}
-	case err = <-errChan:
-		if debugClient {
-			log.Printf("Command finished before handoff: %s", err)
-		}
-		if err != nil {
-			return err
-		}
+	if err = relay.waitHandoff(); err != nil {
+		return err
 	}
 	return c.resume()
 }
+
+// openSessionStreams returns the control, data and transport streams of an
+// approved session, over fixed channels if the guard agreed to them.
+func (c *client) openSessionStreams() (control net.Conn, data net.Conn, transport net.Conn, err error) {
+	if c.guardOptions.fixedChannels {
+		mux := newChanMux(c.agentConn, nil)
+		return mux.Channel(controlChannel), mux.Channel(dataChannel), mux.Channel(transportChannel), nil
+	}
+
+	ymux, err := yamux.Client(c.agentConn, nil)
+	if err != nil {
+		return nil, nil, nil, fmt.Errorf("failed to start ymux: %s", err)
+	}
+	control, err = ymux.Open()
+	if err != nil {
+		return nil, nil, nil, fmt.Errorf("failed to get control stream: %s", err)
+	}
+	data, err = ymux.Open()
+	if err != nil {
+		return nil, nil, nil, fmt.Errorf("failed to get data stream: %s", err)
+	}
+	transport, err = ymux.Open()
+	if err != nil {
+		return nil, nil, nil, fmt.Errorf("failed to get transport stream: %s", err)
+	}
+	return control, data, transport, nil
+}
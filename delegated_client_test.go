@@ -0,0 +1,67 @@
+package guardianagent
+
+import (
+	"bytes"
+	"io"
+	"io/ioutil"
+	"net"
+	"testing"
+	"time"
+)
+
+func BenchmarkSettableWriterContended(b *testing.B) {
+	sw := &settableWriter{w: ioutil.Discard}
+	buf := make([]byte, 32*1024)
+	b.SetBytes(int64(len(buf)))
+	b.ReportAllocs()
+	b.RunParallel(func(pb *testing.PB) {
+		for pb.Next() {
+			sw.Write(buf)
+		}
+	})
+}
+
+func BenchmarkSyncBufferedTraffic(b *testing.B) {
+	const buffered = 16 * 1024 * 1024
+	traffic := make([]byte, buffered)
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		buf := bytes.NewBuffer(traffic)
+		// The agent consumed the first half of the buffered traffic.
+		if err := syncBufferedTraffic(buf, 1000, 1000+buffered/2); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+func newTestPreconnect(limit time.Duration) (p *serverPreconnect, server net.Conn) {
+	client, server := net.Pipe()
+	p = &serverPreconnect{
+		done: make(chan struct{}),
+		conn: serverConnection{reader: client, writer: client},
+	}
+	close(p.done)
+	p.timer = time.AfterFunc(limit, p.drop)
+	return p, server
+}
+
+func TestPreconnectDroppedAfterLimit(t *testing.T) {
+	p, server := newTestPreconnect(10 * time.Millisecond)
+	time.Sleep(50 * time.Millisecond)
+	if _, ok := p.take(); ok {
+		t.Fatalf("connection taken after the limit")
+	}
+	server.SetReadDeadline(time.Now().Add(time.Second))
+	if _, err := server.Read(make([]byte, 1)); err != io.EOF {
+		t.Errorf("dropped connection not closed: %v", err)
+	}
+}
+
+func TestPreconnectTakenWithinLimit(t *testing.T) {
+	p, _ := newTestPreconnect(time.Hour)
+	conn, ok := p.take()
+	if !ok || conn.reader == nil {
+		t.Fatalf("connection not taken within the limit")
+	}
+	conn.close()
+}
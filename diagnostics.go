@@ -0,0 +1,12 @@
+// +build darwin dragonfly freebsd linux netbsd openbsd solaris
+
+package guardianagent
+
+import (
+	"os"
+	"syscall"
+)
+
+// DiagnosticsSignal asks a running guard to write its session accounting to
+// standard error.
+var DiagnosticsSignal os.Signal = syscall.SIGUSR1
@@ -0,0 +1,10 @@
+// +build windows
+
+package guardianagent
+
+import (
+	"os"
+)
+
+// DiagnosticsSignal is nil since Windows has no spare signal to use.
+var DiagnosticsSignal os.Signal
@@ -0,0 +1,175 @@
+package guardianagent
+
+import (
+	"fmt"
+	"io"
+	"strconv"
+	"strings"
+
+	"golang.org/x/crypto/ssh"
+)
+
+// MaxChunkedRequestSize bounds a request reassembled from RequestChunk
+// messages. The size actually used is the smaller of the client's and the
+// guard's limits, agreed in the extension query.
+const MaxChunkedRequestSize = 1024 * 1024
+
+// Each chunk leaves room in a control packet for its message number and the
+// RequestChunkMessage header.
+const requestChunkSize = MaxAgentPacketSize - 64
+
+const maxRequestOption = "max-request="
+
+// probeOption marks the query of a connection that only checks that the guard
+// answers, such as sga-stub's (see ProbeGuard), and makes no requests.
+const probeOption = "probe"
+
+// extensionOptions are exchanged as space-separated words in the contents of
+// the AgentGuardExtensionType query. The client lists the options it supports
+// and the guard echoes the ones it accepted. Guards that predate the options
+// reply with empty contents, which leaves every option off.
+type extensionOptions struct {
+	fixedChannels bool
+	maxRequest    uint32
+	probe         bool
+}
+
+func parseExtensionOptions(contents []byte) extensionOptions {
+	var opts extensionOptions
+	for _, word := range strings.Fields(string(contents)) {
+		switch {
+		case word == FixedChannelsFraming:
+			opts.fixedChannels = true
+		case word == probeOption:
+			opts.probe = true
+		case strings.HasPrefix(word, maxRequestOption):
+			size, err := strconv.ParseUint(word[len(maxRequestOption):], 10, 32)
+			if err == nil {
+				opts.maxRequest = uint32(size)
+			}
+		}
+	}
+	return opts
+}
+
+func (opts extensionOptions) marshal() []byte {
+	var words []string
+	if opts.fixedChannels {
+		words = append(words, FixedChannelsFraming)
+	}
+	if opts.maxRequest > 0 {
+		words = append(words, maxRequestOption+strconv.FormatUint(uint64(opts.maxRequest), 10))
+	}
+	if opts.probe {
+		words = append(words, probeOption)
+	}
+	return []byte(strings.Join(words, " "))
+}
+
+// accept returns the options the guard supports out of those the client asked
+// for.
+func (opts extensionOptions) accept() extensionOptions {
+	if opts.maxRequest > MaxChunkedRequestSize {
+		opts.maxRequest = MaxChunkedRequestSize
+	}
+	opts.probe = false
+	return opts
+}
+
+// isGuardProbe reports whether a message is the extension query of a probe.
+func isGuardProbe(msgNum byte, payload []byte) bool {
+	if msgNum != MsgAgentCExtension {
+		return false
+	}
+	query := new(AgentCExtensionMsg)
+	if ssh.Unmarshal(payload, query) != nil || query.ExtensionType != AgentGuardExtensionType {
+		return false
+	}
+	return parseExtensionOptions(query.Contents).probe
+}
+
+// writeRequest sends a request to the guard, or a reply to the client, as a
+// single control packet if it fits, and otherwise as a sequence of
+// RequestChunk messages, provided the negotiated limit allows that size.
+func writeRequest(w io.Writer, maxRequest uint32, msgNum byte, payload []byte) error {
+	total := 1 + len(payload)
+	if total <= MaxAgentPacketSize {
+		return WriteControlPacket(w, msgNum, payload)
+	}
+	if total > int(maxRequest) {
+		return fmt.Errorf("message of %d bytes exceeds the negotiated limit of %d bytes", total, maxRequest)
+	}
+
+	request := make([]byte, total)
+	request[0] = msgNum
+	copy(request[1:], payload)
+	for sent := 0; sent < total; sent += requestChunkSize {
+		end := sent + requestChunkSize
+		if end > total {
+			end = total
+		}
+		chunk := RequestChunkMessage{Total: uint32(total), Data: request[sent:end]}
+		if err := WriteControlPacket(w, MsgRequestChunk, ssh.Marshal(chunk)); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+// requestAssembler reassembles a request sent as RequestChunk messages. The
+// guard uses one per client connection, and the client one for the guard's
+// replies. Before approval the request is all a client can make the guard
+// hold, so the declared size is reserved from budget (nil for no limit) for
+// as long as the request is pending, and the buffer only grows with the
+// chunks that actually arrive.
+type requestAssembler struct {
+	budget   *MemoryBudget
+	pending  []byte
+	total    uint32
+	reserved int64
+}
+
+// add appends a chunk to the request being reassembled, which may be at most
+// maxRequest bytes. Once the request is complete it returns its message number
+// and payload.
+func (a *requestAssembler) add(payload []byte, maxRequest uint32) (done bool, msgNum byte, request []byte, err error) {
+	chunk := new(RequestChunkMessage)
+	if err = ssh.Unmarshal(payload, chunk); err != nil {
+		return false, 0, nil, fmt.Errorf("Failed to unmarshal RequestChunkMessage: %s", err)
+	}
+	if chunk.Total <= MaxAgentPacketSize || chunk.Total > maxRequest {
+		return false, 0, nil, fmt.Errorf("Invalid chunked request size: %d", chunk.Total)
+	}
+	if a.total == 0 {
+		if !a.budget.TryAcquire(int64(chunk.Total)) {
+			return false, 0, nil, fmt.Errorf("No buffer budget for a chunked request of %d bytes", chunk.Total)
+		}
+		if a.budget != nil {
+			a.reserved = int64(chunk.Total)
+		}
+		a.total = chunk.Total
+	}
+	if chunk.Total != a.total || len(a.pending)+len(chunk.Data) > int(a.total) {
+		a.discard()
+		return false, 0, nil, fmt.Errorf("Inconsistent chunked request")
+	}
+	a.pending = append(a.pending, chunk.Data...)
+	if len(a.pending) < int(a.total) {
+		return false, 0, nil, nil
+	}
+
+	// The request is unmarshalled as soon as it is returned, so its
+	// reservation ends here.
+	request = a.pending
+	a.discard()
+	if request[0] == MsgRequestChunk {
+		return false, 0, nil, fmt.Errorf("Nested chunked request")
+	}
+	return true, request[0], request[1:], nil
+}
+
+// discard drops the request being reassembled and releases its reservation.
+func (a *requestAssembler) discard() {
+	a.budget.Release(a.reserved)
+	a.pending, a.total, a.reserved = nil, 0, 0
+}
@@ -0,0 +1,143 @@
+package guardianagent
+
+import (
+	"net"
+	"strings"
+	"testing"
+
+	"golang.org/x/crypto/ssh"
+)
+
+func TestProbeOptionNotEchoed(t *testing.T) {
+	query := extensionOptions{fixedChannels: true, maxRequest: MaxChunkedRequestSize, probe: true}
+	opts := parseExtensionOptions(query.marshal())
+	if opts != query {
+		t.Fatalf("parsed %+v from the query, want %+v", opts, query)
+	}
+	accepted := opts.accept()
+	if accepted.probe || !accepted.fixedChannels {
+		t.Errorf("guard accepted %+v", accepted)
+	}
+}
+
+// chunkedConnection starts a guard with the given budget on one end of a
+// pipe and negotiates the largest chunked request size on the other.
+func chunkedConnection(t *testing.T, budget int64) (client net.Conn, ui *scriptedUI, ag *Agent, handled chan error, cleanup func()) {
+	store, removeStore := newTestStore(t)
+	ui = &scriptedUI{}
+	ag = &Agent{
+		store:      store,
+		policy:     Policy{Store: store, UI: ui},
+		throttle:   newThrottle(),
+		accounting: newAccounting(),
+		prefetch:   newPrefetcher(),
+		servers:    loadServerCaps(store.path + ".servers"),
+	}
+	ag.SetMemoryBudget(budget)
+	client, guard := net.Pipe()
+	handled = make(chan error, 1)
+	go func() {
+		handled <- ag.HandleConnection(guard)
+		guard.Close()
+	}()
+
+	query := AgentCExtensionMsg{
+		ExtensionType: AgentGuardExtensionType,
+		Contents:      extensionOptions{maxRequest: MaxChunkedRequestSize}.marshal(),
+	}
+	if err := WriteControlPacket(client, MsgAgentCExtension, ssh.Marshal(query)); err != nil {
+		t.Fatal(err)
+	}
+	if msgNum, _, err := ReadControlPacket(client); err != nil || msgNum != MsgAgentSuccess {
+		t.Fatalf("extension query answered with %d, %v", msgNum, err)
+	}
+	return client, ui, ag, handled, func() {
+		client.Close()
+		removeStore()
+	}
+}
+
+func TestChunkedRequestReassembled(t *testing.T) {
+	client, ui, ag, _, cleanup := chunkedConnection(t, 64*1024*1024)
+	defer cleanup()
+
+	// About 500 KiB: some fifty chunks.
+	command := strings.Repeat("echo chunked; ", 500*1024/14)
+	request := ExecutionRequestMessage{User: benchScope.ServiceUsername, Server: benchScope.ServiceHostname, Command: command}
+	if err := writeRequest(client, MaxChunkedRequestSize, MsgExecutionRequest, ssh.Marshal(request)); err != nil {
+		t.Fatal(err)
+	}
+	msgNum, payload, err := ReadControlPacket(client)
+	if err != nil || msgNum != MsgExecutionDenied {
+		t.Fatalf("request answered with %d, %v", msgNum, err)
+	}
+	// The guard received the whole command, which is too long to show for
+	// approval.
+	denied := new(ExecutionDeniedMessage)
+	if err := ssh.Unmarshal(payload, denied); err != nil {
+		t.Fatal(err)
+	}
+	if !strings.Contains(denied.Reason, "too long") || ui.asked != 0 {
+		t.Errorf("denied with %q after %d prompts", denied.Reason, ui.asked)
+	}
+	if inUse, _ := ag.budget.Usage(); inUse != 0 {
+		t.Errorf("%d bytes of budget still reserved after the request", inUse)
+	}
+}
+
+func TestChunkedRequestCountedAgainstBudget(t *testing.T) {
+	client, _, ag, handled, cleanup := chunkedConnection(t, 256*1024)
+	defer cleanup()
+
+	chunk := RequestChunkMessage{Total: MaxChunkedRequestSize, Data: make([]byte, requestChunkSize)}
+	chunk.Data[0] = MsgExecutionRequest
+	if err := WriteControlPacket(client, MsgRequestChunk, ssh.Marshal(chunk)); err != nil {
+		t.Fatal(err)
+	}
+	if err := <-handled; err == nil || !strings.Contains(err.Error(), "budget") {
+		t.Errorf("chunked request beyond the budget ended with %v", err)
+	}
+	if inUse, _ := ag.budget.Usage(); inUse != 0 {
+		t.Errorf("%d bytes of budget reserved by a refused request", inUse)
+	}
+}
+
+func TestChunkedRequestRejected(t *testing.T) {
+	const maxRequest = 64 * 1024
+	chunk := func(total uint32, data ...byte) []byte {
+		if len(data) == 0 {
+			data = make([]byte, requestChunkSize)
+			data[0] = MsgExecutionRequest
+		}
+		return ssh.Marshal(RequestChunkMessage{Total: total, Data: data})
+	}
+	nested := make([]byte, requestChunkSize)
+	nested[0] = MsgRequestChunk
+	tests := []struct {
+		name   string
+		chunks [][]byte
+	}{
+		{"fits in one packet", [][]byte{chunk(MaxAgentPacketSize)}},
+		{"beyond the negotiated limit", [][]byte{chunk(maxRequest + 1)}},
+		{"inconsistent totals", [][]byte{chunk(3 * requestChunkSize), chunk(2 * requestChunkSize)}},
+		{"more data than the total", [][]byte{chunk(requestChunkSize + 1), chunk(requestChunkSize + 1)}},
+		{"nested chunk", [][]byte{chunk(2*requestChunkSize, nested...), chunk(2 * requestChunkSize)}},
+	}
+	for _, test := range tests {
+		budget := NewMemoryBudget(maxRequest)
+		a := requestAssembler{budget: budget}
+		var err error
+		for _, c := range test.chunks {
+			if _, _, _, err = a.add(c, maxRequest); err != nil {
+				break
+			}
+		}
+		if err == nil {
+			t.Errorf("%s: accepted", test.name)
+		}
+		a.discard()
+		if inUse, _ := budget.Usage(); inUse != 0 {
+			t.Errorf("%s: %d bytes of budget still reserved", test.name, inUse)
+		}
+	}
+}
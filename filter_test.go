@@ -0,0 +1,222 @@
+package guardianagent
+
+import (
+	"bytes"
+	"crypto/ecdsa"
+	"crypto/elliptic"
+	"crypto/rand"
+	"encoding/binary"
+	"errors"
+	"net"
+	"sync/atomic"
+	"testing"
+	"time"
+
+	"golang.org/x/crypto/ssh"
+)
+
+// These tests run the vendored library's proxy and command filter between an
+// in-process client and server, as proxySSH does before handoff, to check
+// that approving a subsystem lets exactly that subsystem through without the
+// filter falling back to approving all commands.
+
+type testRequest struct {
+	Type string
+	Arg  string
+}
+
+type testServer struct {
+	listener  net.Listener
+	config    *ssh.ServerConfig
+	clientKey ssh.Signer
+	requests  chan testRequest
+}
+
+func newTestSigner(t testing.TB) ssh.Signer {
+	key, err := ecdsa.GenerateKey(elliptic.P256(), rand.Reader)
+	if err != nil {
+		t.Fatal(err)
+	}
+	signer, err := ssh.NewSignerFromKey(key)
+	if err != nil {
+		t.Fatal(err)
+	}
+	return signer
+}
+
+// startTestServer accepts the test client's key, replies to no-more-sessions
+// and accepts every session request, recording each one.
+func startTestServer(t testing.TB) *testServer {
+	srv := &testServer{
+		clientKey: newTestSigner(t),
+		requests:  make(chan testRequest, 100),
+	}
+	srv.config = &ssh.ServerConfig{
+		PublicKeyCallback: func(conn ssh.ConnMetadata, key ssh.PublicKey) (*ssh.Permissions, error) {
+			if bytes.Equal(key.Marshal(), srv.clientKey.PublicKey().Marshal()) {
+				return nil, nil
+			}
+			return nil, errors.New("unknown key")
+		},
+	}
+	srv.config.AddHostKey(newTestSigner(t))
+	var err error
+	srv.listener, err = net.Listen("tcp", "127.0.0.1:0")
+	if err != nil {
+		t.Fatal(err)
+	}
+	go func() {
+		for {
+			c, err := srv.listener.Accept()
+			if err != nil {
+				return
+			}
+			go srv.serve(c)
+		}
+	}()
+	return srv
+}
+
+func (srv *testServer) Close() {
+	srv.listener.Close()
+}
+
+func (srv *testServer) serve(c net.Conn) {
+	_, chans, reqs, err := ssh.NewServerConn(c, srv.config)
+	if err != nil {
+		c.Close()
+		return
+	}
+	go func() {
+		for req := range reqs {
+			srv.requests <- testRequest{Type: req.Type}
+			req.Reply(req.Type == ssh.NoMoreSessionRequestName, nil)
+		}
+	}()
+	for newChannel := range chans {
+		if newChannel.ChannelType() != "session" {
+			newChannel.Reject(ssh.UnknownChannelType, "")
+			continue
+		}
+		channel, channelReqs, err := newChannel.Accept()
+		if err != nil {
+			continue
+		}
+		go func() {
+			defer channel.Close()
+			for req := range channelReqs {
+				var arg string
+				if len(req.Payload) >= 4 && int(binary.BigEndian.Uint32(req.Payload)) == len(req.Payload)-4 {
+					arg = string(req.Payload[4:])
+				}
+				srv.requests <- testRequest{Type: req.Type, Arg: arg}
+				req.Reply(true, nil)
+			}
+		}()
+	}
+}
+
+// connectThroughFilter connects a client to srv through the library's proxy,
+// as runDelegated and proxySSH do. done receives the proxy's result.
+func connectThroughFilter(t testing.TB, srv *testServer, fil *ssh.Filter) (client *ssh.Client, done <-chan error) {
+	toServer, err := net.Dial("tcp", srv.listener.Addr().String())
+	if err != nil {
+		t.Fatal(err)
+	}
+	clientSide, proxySide := net.Pipe()
+	proxyDone := make(chan error, 1)
+	go func() {
+		config := &ssh.ClientConfig{
+			User:            "test",
+			Auth:            []ssh.AuthMethod{ssh.PublicKeys(srv.clientKey)},
+			HostKeyCallback: ssh.InsecureIgnoreHostKey(),
+		}
+		proxy, err := ssh.NewProxyConn(srv.listener.Addr().String(), proxySide, toServer, config, fil)
+		if err != nil {
+			proxyDone <- err
+			return
+		}
+		proxyDone <- <-proxy.Run()
+	}()
+
+	config := &ssh.ClientConfig{
+		HostKeyCallback:          ssh.InsecureIgnoreHostKey(),
+		DeferHostKeyVerification: true,
+	}
+	cc, chans, reqs, err := ssh.NewClientConn(clientSide, srv.listener.Addr().String(), config)
+	if err != nil {
+		t.Fatalf("client handshake through proxy failed: %s", err)
+	}
+	return ssh.NewClient(cc, chans, reqs), proxyDone
+}
+
+// seen reports whether srv received a request of type typ with argument arg.
+// Requests are recorded before they are answered, so everything a completed
+// request caused is already recorded.
+func (srv *testServer) seen(typ string, arg string) bool {
+	for {
+		select {
+		case req := <-srv.requests:
+			if req.Type == typ && req.Arg == arg {
+				return true
+			}
+		default:
+			return false
+		}
+	}
+}
+
+func TestFilterPassesApprovedSubsystem(t *testing.T) {
+	srv := startTestServer(t)
+	defer srv.Close()
+
+	var fallbacks int32
+	fil := ssh.NewFilter("sftp", func() error {
+		atomic.AddInt32(&fallbacks, 1)
+		return errors.New("fallback not approved")
+	})
+	client, _ := connectThroughFilter(t, srv, fil)
+	defer client.Close()
+
+	session, err := client.NewSession()
+	if err != nil {
+		t.Fatalf("failed to open session: %s", err)
+	}
+	if err = session.RequestSubsystem("sftp"); err != nil {
+		t.Fatalf("approved subsystem request failed: %s", err)
+	}
+	ok, _, err := client.SendRequest(ssh.NoMoreSessionRequestName, true, nil)
+	if err != nil || !ok {
+		t.Fatalf("%s failed: %t, %v", ssh.NoMoreSessionRequestName, ok, err)
+	}
+	if !srv.seen("subsystem", "sftp") {
+		t.Errorf("server did not receive the approved subsystem request")
+	}
+	if n := atomic.LoadInt32(&fallbacks); n != 0 {
+		t.Errorf("filter fell back %d times for the approved subsystem", n)
+	}
+}
+
+func TestFilterBlocksOtherSubsystem(t *testing.T) {
+	srv := startTestServer(t)
+	defer srv.Close()
+
+	fil := ssh.NewFilter("sftp", func() error {
+		return errors.New("fallback not approved")
+	})
+	client, _ := connectThroughFilter(t, srv, fil)
+	defer client.Close()
+
+	session, err := client.NewSession()
+	if err != nil {
+		t.Fatalf("failed to open session: %s", err)
+	}
+	if err = session.RequestSubsystem("netconf"); err == nil {
+		t.Errorf("unapproved subsystem request succeeded")
+	}
+	// Give a request that slipped through time to be recorded.
+	time.Sleep(100 * time.Millisecond)
+	if srv.seen("subsystem", "netconf") {
+		t.Errorf("server received the unapproved subsystem request")
+	}
+}
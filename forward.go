@@ -0,0 +1,336 @@
+package guardianagent
+
+import (
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"io"
+	"log"
+	"net"
+	"strconv"
+	"strings"
+	"sync"
+	"sync/atomic"
+
+	"golang.org/x/crypto/ssh"
+)
+
+// DynamicForwardTarget stands for any destination, as requested by a dynamic
+// (SOCKS) forward.
+const DynamicForwardTarget = "*"
+
+// Forward is a local listener whose connections are forwarded through the
+// server to Target, or to the destination requested over SOCKS if Target is
+// DynamicForwardTarget.
+type Forward struct {
+	Listen string
+	Target string
+}
+
+// Each direction of a forwarded connection, like each end a handoffRelay
+// pumps, waits for data with a small buffer of its own, and only takes a pooled forwardBufferSize buffer after a read
+// fills the small one, as in a bulk transfer. The pooled buffer is returned
+// after the first short read, so thousands of mostly idle connections do not
+// each keep a large buffer.
+const (
+	forwardIdleBufferSize = 2 * 1024
+	forwardBufferSize     = 32 * 1024
+)
+
+// forwardBufferTakes counts the pooled buffers copyPooled has taken, one per
+// burst, so that benchmarks can report the pool traffic.
+var forwardBufferTakes int64
+
+// The pool holds pointers, so that returning a buffer does not allocate.
+var forwardBuffers = sync.Pool{
+	New: func() interface{} {
+		buf := make([]byte, forwardBufferSize)
+		return &buf
+	},
+}
+
+// splitForwardSpec splits an ssh -L/-D argument on colons, keeping bracketed
+// IPv6 addresses together.
+func splitForwardSpec(spec string) []string {
+	var parts []string
+	for len(spec) > 0 {
+		var part string
+		if spec[0] == '[' {
+			end := strings.IndexByte(spec, ']')
+			if end < 0 {
+				return append(parts, spec)
+			}
+			part, spec = spec[1:end], spec[end+1:]
+			spec = strings.TrimPrefix(spec, ":")
+		} else if i := strings.IndexByte(spec, ':'); i >= 0 {
+			part, spec = spec[:i], spec[i+1:]
+		} else {
+			part, spec = spec, ""
+		}
+		parts = append(parts, part)
+	}
+	return parts
+}
+
+func listenAddress(bind string, port string) string {
+	if bind == "" {
+		bind = "localhost"
+	} else if bind == "*" {
+		bind = ""
+	}
+	return net.JoinHostPort(bind, port)
+}
+
+// ParseLocalForward parses an ssh -L argument: [bind_address:]port:host:hostport.
+func ParseLocalForward(spec string) (Forward, error) {
+	parts := splitForwardSpec(spec)
+	switch len(parts) {
+	case 3:
+		return Forward{Listen: listenAddress("", parts[0]), Target: net.JoinHostPort(parts[1], parts[2])}, nil
+	case 4:
+		return Forward{Listen: listenAddress(parts[0], parts[1]), Target: net.JoinHostPort(parts[2], parts[3])}, nil
+	}
+	return Forward{}, fmt.Errorf("bad local forwarding specification '%s'", spec)
+}
+
+// ParseDynamicForward parses an ssh -D argument: [bind_address:]port.
+func ParseDynamicForward(spec string) (Forward, error) {
+	parts := splitForwardSpec(spec)
+	switch len(parts) {
+	case 1:
+		return Forward{Listen: listenAddress("", parts[0]), Target: DynamicForwardTarget}, nil
+	case 2:
+		return Forward{Listen: listenAddress(parts[0], parts[1]), Target: DynamicForwardTarget}, nil
+	}
+	return Forward{}, fmt.Errorf("bad dynamic forwarding specification '%s'", spec)
+}
+
+func forwardTargets(forwards []Forward) []string {
+	var targets []string
+	for _, fwd := range forwards {
+		if !containsString(targets, fwd.Target) {
+			targets = append(targets, fwd.Target)
+		}
+	}
+	return targets
+}
+
+// requestForwarding asks the agent to approve the forwards before the session
+// itself is requested.
+func (c *client) requestForwarding() error {
+	forwardingReq := ForwardingRequestMessage{
+		User:    c.Username,
+		Targets: forwardTargets(c.Forwards),
+		Server:  c.HostPort,
+	}
+	err := writeRequest(c.agentConn, c.guardOptions.maxRequest, MsgForwardingRequest, ssh.Marshal(forwardingReq))
+	if err != nil {
+		return fmt.Errorf("failed to send MsgForwardingRequest to agent: %s", err)
+	}
+	denyReason, err := c.readApproval()
+	if err != nil {
+		return err
+	}
+	if denyReason != "" {
+		return fmt.Errorf("forwarding denied by agent: %s", denyReason)
+	}
+	return nil
+}
+
+// startForwards listens on every forward and relays accepted connections over
+// conn until the returned function is called.
+func (c *client) startForwards(conn *ssh.Client) (stop func(), err error) {
+	var listeners []net.Listener
+	stop = func() {
+		for _, l := range listeners {
+			l.Close()
+		}
+	}
+	for _, fwd := range c.Forwards {
+		l, err := net.Listen("tcp", fwd.Listen)
+		if err != nil {
+			stop()
+			return nil, fmt.Errorf("failed to listen on %s: %s", fwd.Listen, err)
+		}
+		listeners = append(listeners, l)
+		go serveForward(conn, l, fwd.Target)
+	}
+	return stop, nil
+}
+
+func serveForward(conn *ssh.Client, l net.Listener, target string) {
+	for {
+		local, err := l.Accept()
+		if err != nil {
+			return
+		}
+		go func() {
+			defer local.Close()
+			dest := target
+			var err error
+			if dest == DynamicForwardTarget {
+				if dest, err = socksHandshake(local); err != nil {
+					log.Printf("SOCKS request from %s failed: %s", local.RemoteAddr(), err)
+					return
+				}
+			}
+			remote, err := conn.Dial("tcp", dest)
+			if target == DynamicForwardTarget {
+				socksReply(local, err)
+			}
+			if err != nil {
+				log.Printf("Failed to forward connection to %s: %s", dest, err)
+				return
+			}
+			defer remote.Close()
+			relayForwarded(local, remote)
+		}()
+	}
+}
+
+// relayForwarded copies in both directions, propagating half-closes, until
+// both directions are done.
+func relayForwarded(a net.Conn, b net.Conn) {
+	var wg sync.WaitGroup
+	copyHalf := func(dst net.Conn, src net.Conn) {
+		defer wg.Done()
+		copyPooled(dst, src)
+		if cw, ok := dst.(CloseWriter); ok {
+			cw.CloseWrite()
+		} else {
+			dst.Close()
+		}
+	}
+	wg.Add(2)
+	go copyHalf(a, b)
+	copyHalf(b, a)
+	wg.Wait()
+}
+
+// copyPooled copies src to dst until either fails, switching between the idle
+// and pooled buffers as described at forwardBufferSize. Like io.Copy, it
+// returns nil at the end of src.
+func copyPooled(dst io.Writer, src io.Reader) error {
+	idle := make([]byte, forwardIdleBufferSize)
+	for {
+		n, err := src.Read(idle)
+		if n > 0 {
+			if _, werr := dst.Write(idle[:n]); werr != nil {
+				return werr
+			}
+		}
+		if err != nil {
+			return eofToNil(err)
+		}
+		if n < len(idle) {
+			continue
+		}
+
+		pooled := forwardBuffers.Get().(*[]byte)
+		atomic.AddInt64(&forwardBufferTakes, 1)
+		buf := *pooled
+		for {
+			n, err = src.Read(buf)
+			if n > 0 {
+				if _, werr := dst.Write(buf[:n]); werr != nil {
+					err = werr
+				}
+			}
+			if err != nil || n < len(buf) {
+				break
+			}
+		}
+		forwardBuffers.Put(pooled)
+		if err != nil {
+			return eofToNil(err)
+		}
+	}
+}
+
+func eofToNil(err error) error {
+	if err == io.EOF {
+		return nil
+	}
+	return err
+}
+
+const (
+	socksVersion      = 5
+	socksNoAuth       = 0
+	socksConnect      = 1
+	socksAddrIPv4     = 1
+	socksAddrDomain   = 3
+	socksAddrIPv6     = 4
+	socksSucceeded    = 0
+	socksHostFailure  = 4
+	socksNoAcceptable = 0xff
+)
+
+// socksHandshake serves the greeting and CONNECT request of a SOCKS5 client
+// and returns the requested destination.
+func socksHandshake(conn net.Conn) (string, error) {
+	var header [2]byte
+	if _, err := io.ReadFull(conn, header[:]); err != nil {
+		return "", err
+	}
+	if header[0] != socksVersion {
+		return "", fmt.Errorf("unsupported SOCKS version %d", header[0])
+	}
+	methods := make([]byte, header[1])
+	if _, err := io.ReadFull(conn, methods); err != nil {
+		return "", err
+	}
+	if strings.IndexByte(string(methods), socksNoAuth) < 0 {
+		conn.Write([]byte{socksVersion, socksNoAcceptable})
+		return "", errors.New("client requires authentication")
+	}
+	if _, err := conn.Write([]byte{socksVersion, socksNoAuth}); err != nil {
+		return "", err
+	}
+
+	var request [4]byte
+	if _, err := io.ReadFull(conn, request[:]); err != nil {
+		return "", err
+	}
+	if request[1] != socksConnect {
+		return "", fmt.Errorf("unsupported SOCKS command %d", request[1])
+	}
+	var host string
+	switch request[3] {
+	case socksAddrIPv4, socksAddrIPv6:
+		addr := make([]byte, net.IPv4len)
+		if request[3] == socksAddrIPv6 {
+			addr = make([]byte, net.IPv6len)
+		}
+		if _, err := io.ReadFull(conn, addr); err != nil {
+			return "", err
+		}
+		host = net.IP(addr).String()
+	case socksAddrDomain:
+		var length [1]byte
+		if _, err := io.ReadFull(conn, length[:]); err != nil {
+			return "", err
+		}
+		domain := make([]byte, length[0])
+		if _, err := io.ReadFull(conn, domain); err != nil {
+			return "", err
+		}
+		host = string(domain)
+	default:
+		return "", fmt.Errorf("unsupported SOCKS address type %d", request[3])
+	}
+	var port [2]byte
+	if _, err := io.ReadFull(conn, port[:]); err != nil {
+		return "", err
+	}
+	return net.JoinHostPort(host, strconv.Itoa(int(binary.BigEndian.Uint16(port[:])))), nil
+}
+
+func socksReply(conn net.Conn, err error) {
+	status := byte(socksSucceeded)
+	if err != nil {
+		status = socksHostFailure
+	}
+	// The bound address is not known for a forwarded channel; report 0.0.0.0:0.
+	conn.Write([]byte{socksVersion, status, 0, socksAddrIPv4, 0, 0, 0, 0, 0, 0})
+}
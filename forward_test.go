@@ -0,0 +1,228 @@
+package guardianagent
+
+import (
+	"bytes"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"net"
+	"sync"
+	"sync/atomic"
+	"testing"
+	"time"
+)
+
+func TestRelayForwardedSwitchesBuffers(t *testing.T) {
+	localClient, local := tcpPair(t)
+	remote, remoteServer := tcpPair(t)
+	go relayForwarded(local, remote)
+
+	// Short writes stay on the idle buffer; the bulk one moves to a pooled
+	// buffer and back.
+	var sent []byte
+	for _, size := range []int{10, forwardIdleBufferSize, 3*forwardBufferSize + 17, 5} {
+		chunk := bytes.Repeat([]byte{byte(size)}, size)
+		sent = append(sent, chunk...)
+		if _, err := localClient.Write(chunk); err != nil {
+			t.Fatal(err)
+		}
+	}
+	localClient.Close()
+	received, err := ioutil.ReadAll(remoteServer)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if !bytes.Equal(received, sent) {
+		t.Errorf("relayed %d bytes differing from the %d sent", len(received), len(sent))
+	}
+	remoteServer.Close()
+}
+
+// startForwarding relays connections accepted on a local listener to a target
+// served by serve, as serveForward does. A loopback TCP connection stands in
+// for the server's direct-tcpip channel.
+func startForwarding(t testing.TB, serve func(net.Conn)) (addr string, stop func()) {
+	target, err := net.Listen("tcp", "127.0.0.1:0")
+	if err != nil {
+		t.Fatal(err)
+	}
+	local, err := net.Listen("tcp", "127.0.0.1:0")
+	if err != nil {
+		t.Fatal(err)
+	}
+	go func() {
+		for {
+			c, err := target.Accept()
+			if err != nil {
+				return
+			}
+			go serve(c)
+		}
+	}()
+	go func() {
+		for {
+			c, err := local.Accept()
+			if err != nil {
+				return
+			}
+			go func() {
+				defer c.Close()
+				remote, err := net.Dial("tcp", target.Addr().String())
+				if err != nil {
+					return
+				}
+				defer remote.Close()
+				relayForwarded(c, remote)
+			}()
+		}
+	}()
+	return local.Addr().String(), func() {
+		local.Close()
+		target.Close()
+	}
+}
+
+// BenchmarkForwardedConnections measures forwarded connections per second,
+// each making one one-byte exchange with the target.
+func BenchmarkForwardedConnections(b *testing.B) {
+	addr, stop := startForwarding(b, func(c net.Conn) {
+		defer c.Close()
+		var buf [1]byte
+		if _, err := io.ReadFull(c, buf[:]); err == nil {
+			c.Write(buf[:])
+		}
+	})
+	defer stop()
+
+	b.ResetTimer()
+	start := time.Now()
+	for i := 0; i < b.N; i++ {
+		c, err := net.Dial("tcp", addr)
+		if err != nil {
+			b.Fatal(err)
+		}
+		var buf [1]byte
+		if _, err = c.Write(buf[:]); err == nil {
+			_, err = io.ReadFull(c, buf[:])
+		}
+		c.Close()
+		if err != nil {
+			b.Fatal(err)
+		}
+	}
+	b.ReportMetric(float64(b.N)/time.Since(start).Seconds(), "conns/s")
+}
+
+// benchmarkForwardedThroughput sends b.N chunks spread over conns concurrent
+// forwarded connections.
+func benchmarkForwardedThroughput(b *testing.B, conns int) {
+	var received sync.WaitGroup
+	addr, stop := startForwarding(b, func(c net.Conn) {
+		defer c.Close()
+		io.Copy(ioutil.Discard, c)
+		received.Done()
+	})
+	defer stop()
+
+	chunk := make([]byte, 32*1024)
+	clients := make([]net.Conn, conns)
+	for i := range clients {
+		c, err := net.Dial("tcp", addr)
+		if err != nil {
+			b.Fatal(err)
+		}
+		defer c.Close()
+		clients[i] = c
+	}
+	received.Add(conns)
+	takes := atomic.LoadInt64(&forwardBufferTakes)
+	b.SetBytes(int64(len(chunk)))
+	b.ResetTimer()
+	var sent sync.WaitGroup
+	for i, c := range clients {
+		n := b.N / conns
+		if i < b.N%conns {
+			n++
+		}
+		sent.Add(1)
+		go func(c net.Conn, n int) {
+			defer sent.Done()
+			for j := 0; j < n; j++ {
+				if _, err := c.Write(chunk); err != nil {
+					b.Error(err)
+					return
+				}
+			}
+			c.(*net.TCPConn).CloseWrite()
+		}(c, n)
+	}
+	sent.Wait()
+	received.Wait()
+	b.StopTimer()
+	b.ReportMetric(float64(atomic.LoadInt64(&forwardBufferTakes)-takes)/float64(b.N), "pool-gets/op")
+}
+
+func BenchmarkForwardedThroughput(b *testing.B) {
+	for _, conns := range []int{1, 100, 1000} {
+		b.Run(fmt.Sprintf("%dconns", conns), func(b *testing.B) {
+			benchmarkForwardedThroughput(b, conns)
+		})
+	}
+}
+
+// messageReader returns total bytes as messages of size bytes, each ending in
+// a short read, like request/response traffic on a forwarded connection.
+type messageReader struct {
+	size  int
+	left  int
+	total int
+}
+
+func (r *messageReader) Read(p []byte) (int, error) {
+	if r.total == 0 {
+		return 0, io.EOF
+	}
+	if r.left == 0 {
+		r.left = r.size
+	}
+	n := len(p)
+	if n > r.left {
+		n = r.left
+	}
+	if n > r.total {
+		n = r.total
+	}
+	r.left -= n
+	r.total -= n
+	return n, nil
+}
+
+// BenchmarkCopyPooled compares copyPooled with io.CopyBuffer on a dedicated
+// buffer, one message per op. Messages larger than the idle buffer take a
+// pooled buffer and give it back at their final short read, which is the
+// pool traffic reported as pool-gets/op.
+func BenchmarkCopyPooled(b *testing.B) {
+	for _, size := range []int{512, 4 * 1024, 64 * 1024, 1024 * 1024} {
+		b.Run(fmt.Sprintf("%dB/pooled", size), func(b *testing.B) {
+			src := &messageReader{size: size, total: b.N * size}
+			takes := atomic.LoadInt64(&forwardBufferTakes)
+			b.SetBytes(int64(size))
+			b.ReportAllocs()
+			b.ResetTimer()
+			if err := copyPooled(ioutil.Discard, src); err != nil {
+				b.Fatal(err)
+			}
+			b.ReportMetric(float64(atomic.LoadInt64(&forwardBufferTakes)-takes)/float64(b.N), "pool-gets/op")
+		})
+		b.Run(fmt.Sprintf("%dB/copyBuffer", size), func(b *testing.B) {
+			src := &messageReader{size: size, total: b.N * size}
+			b.SetBytes(int64(size))
+			b.ReportAllocs()
+			b.ResetTimer()
+			buf := make([]byte, forwardBufferSize)
+			if _, err := io.CopyBuffer(struct{ io.Writer }{ioutil.Discard}, src, buf); err != nil {
+				b.Fatal(err)
+			}
+		})
+	}
+}
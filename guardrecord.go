@@ -0,0 +1,128 @@
+package guardianagent
+
+import (
+	"encoding/json"
+	"fmt"
+	"io/ioutil"
+	"net"
+	"os"
+	"path"
+	"time"
+
+	"golang.org/x/crypto/ssh"
+)
+
+// GuardRecordName is the file sga-stub writes next to AgentGuardSockName,
+// recording that the socket leads to a guard and what the guard supports, so
+// that clients need not query the guard before every request.
+const GuardRecordName = AgentGuardSockName + ".caps"
+
+// GuardRecordRefresh is how often sga-stub re-checks the guard. Clients ignore
+// records not refreshed within twice this interval.
+const GuardRecordRefresh = 30 * time.Second
+
+type GuardRecord struct {
+	// Socket is the forwarded socket the AgentGuardSockName link pointed to
+	// when the guard was checked.
+	Socket string `json:"Socket"`
+	// Options is the guard's reply to the extension query.
+	Options string    `json:"Options"`
+	Checked time.Time `json:"Checked"`
+}
+
+func guardRecordPath() string {
+	return path.Join(UserRuntimeDir(), GuardRecordName)
+}
+
+func guardQuery(probe bool) []byte {
+	// Older guards ignore the contents and reply with an empty payload, in
+	// which case the session streams fall back to yamux and requests must fit
+	// in one control packet.
+	query := AgentCExtensionMsg{
+		ExtensionType: AgentGuardExtensionType,
+		Contents: extensionOptions{
+			fixedChannels: true,
+			maxRequest:    MaxChunkedRequestSize,
+			probe:         probe,
+		}.marshal(),
+	}
+	return ssh.Marshal(query)
+}
+
+// ProbeGuard sends the extension query to the guard at socketPath and returns
+// its reply. The query is marked as a probe, so the guard does not prefetch
+// for a session that will not follow.
+func ProbeGuard(socketPath string) ([]byte, error) {
+	sock, err := net.Dial("unix", socketPath)
+	if err != nil {
+		return nil, err
+	}
+	defer sock.Close()
+	if err = WriteControlPacket(sock, MsgAgentCExtension, guardQuery(true)); err != nil {
+		return nil, err
+	}
+	msgNum, reply, err := ReadControlPacket(sock)
+	if err != nil {
+		return nil, err
+	}
+	if msgNum != MsgAgentSuccess {
+		return nil, fmt.Errorf("not an agent guard")
+	}
+	return reply, nil
+}
+
+// WriteGuardRecord atomically replaces the guard record.
+func WriteGuardRecord(record GuardRecord) error {
+	data, err := json.Marshal(record)
+	if err != nil {
+		return err
+	}
+	tmp, err := ioutil.TempFile(UserRuntimeDir(), GuardRecordName)
+	if err != nil {
+		return err
+	}
+	_, err = tmp.Write(data)
+	if closeErr := tmp.Close(); err == nil {
+		err = closeErr
+	}
+	if err == nil {
+		err = os.Rename(tmp.Name(), guardRecordPath())
+	}
+	if err != nil {
+		os.Remove(tmp.Name())
+	}
+	return err
+}
+
+// RemoveGuardRecord removes the guard record if it describes socket.
+func RemoveGuardRecord(socket string) {
+	if record := readGuardRecord(); record != nil && record.Socket == socket {
+		os.Remove(guardRecordPath())
+	}
+}
+
+func readGuardRecord() *GuardRecord {
+	data, err := ioutil.ReadFile(guardRecordPath())
+	if err != nil {
+		return nil
+	}
+	record := new(GuardRecord)
+	if err = json.Unmarshal(data, record); err != nil {
+		return nil
+	}
+	return record
+}
+
+// freshGuardRecord returns the guard record if it was refreshed recently and
+// still describes the socket the AgentGuardSockName link points to.
+func freshGuardRecord() *GuardRecord {
+	record := readGuardRecord()
+	if record == nil || time.Since(record.Checked) > 2*GuardRecordRefresh {
+		return nil
+	}
+	target, err := os.Readlink(path.Join(UserRuntimeDir(), AgentGuardSockName))
+	if err != nil || target != record.Socket {
+		return nil
+	}
+	return record
+}
@@ -0,0 +1,241 @@
+// +build darwin dragonfly freebsd linux netbsd openbsd solaris
+
+package guardianagent
+
+import (
+	"bufio"
+	"encoding/json"
+	"fmt"
+	"log"
+	"net"
+	"os"
+	"os/exec"
+	"syscall"
+)
+
+// UpgradeSignal asks a running guard to hand over to a fresh copy of its
+// executable.
+var UpgradeSignal os.Signal = syscall.SIGUSR2
+
+const handoverEnv = "SGA_GUARD_HANDOVER"
+
+// Descriptors passed to the successor, starting at fd 3.
+const (
+	handoverListenerFd = 3 + iota
+	handoverStubStdinFd
+	handoverStubStdoutFd
+	handoverReadyFd
+	handoverDrainFd
+)
+
+// Successor is a guard started by Handover, as a child of this process.
+type Successor struct {
+	cmd   *exec.Cmd
+	drain *os.File
+}
+
+// Drain tells the successor to stop accepting, finish its sessions and exit,
+// by closing its drain pipe. The successor also drains if this process exits.
+func (s *Successor) Drain() {
+	s.drain.Close()
+}
+
+func (s *Successor) Wait() error {
+	return s.cmd.Wait()
+}
+
+type handoverState struct {
+	LocalSocket  string
+	RemoteSocket string
+	SSHArgs      []string
+	OwnsMaster   bool
+}
+
+// dupFile duplicates the descriptor behind an *os.File-backed pipe end, so the
+// copy can be passed on and closed independently of the original.
+func dupFile(f interface{}, name string) (*os.File, error) {
+	fder, ok := f.(interface {
+		Fd() uintptr
+	})
+	if !ok {
+		return nil, fmt.Errorf("%s does not support handover", name)
+	}
+	fd, err := syscall.Dup(int(fder.Fd()))
+	if err != nil {
+		return nil, fmt.Errorf("failed to dup %s: %s", name, err)
+	}
+	return os.NewFile(uintptr(fd), name), nil
+}
+
+// Handover starts a new instance of the running executable with the same
+// arguments and passes it the forwarded listener and the stub's pipes. It
+// returns once the successor reports that it is ready to serve, at which point
+// both processes accept on the same socket; the caller should then stop
+// accepting itself, or drain its previous successor.
+//
+// Only the guard started by the user or autossh hands over: successors pass
+// upgrade requests on to it with ForwardUpgrade, so every generation is its
+// child. It keeps its own copy of the listener to pass on to later
+// generations.
+func (fwd *SSHFwd) Handover() (*Successor, error) {
+	if fwd.listenerFile == nil {
+		unixListener, ok := fwd.listener.(*net.UnixListener)
+		if !ok {
+			return nil, fmt.Errorf("listener does not support handover")
+		}
+		listenerFile, err := unixListener.File()
+		if err != nil {
+			return nil, fmt.Errorf("failed to get listener fd: %s", err)
+		}
+		fwd.listenerFile = listenerFile
+	}
+	stubStdin, err := dupFile(fwd.stubStdin, "stub-stdin")
+	if err != nil {
+		return nil, err
+	}
+	defer stubStdin.Close()
+	stubStdout, err := dupFile(fwd.stubStdout, "stub-stdout")
+	if err != nil {
+		return nil, err
+	}
+	defer stubStdout.Close()
+
+	state, err := json.Marshal(handoverState{
+		LocalSocket:  fwd.localSocket,
+		RemoteSocket: fwd.remoteSocket,
+		SSHArgs:      fwd.SSHArgs,
+		OwnsMaster:   fwd.ownsMaster,
+	})
+	if err != nil {
+		return nil, err
+	}
+
+	exe, err := os.Executable()
+	if err != nil {
+		return nil, fmt.Errorf("failed to find executable: %s", err)
+	}
+	readyReader, readyWriter, err := os.Pipe()
+	if err != nil {
+		return nil, err
+	}
+	defer readyReader.Close()
+	drainReader, drainWriter, err := os.Pipe()
+	if err != nil {
+		readyWriter.Close()
+		return nil, err
+	}
+
+	successor := exec.Command(exe, os.Args[1:]...)
+	successor.Stdin = os.Stdin
+	successor.Stdout = os.Stdout
+	successor.Stderr = os.Stderr
+	successor.Env = append(os.Environ(), handoverEnv+"="+string(state))
+	successor.ExtraFiles = []*os.File{
+		fwd.listenerFile,
+		stubStdin,
+		stubStdout,
+		readyWriter,
+		drainReader,
+	}
+	err = successor.Start()
+	readyWriter.Close()
+	drainReader.Close()
+	if err != nil {
+		drainWriter.Close()
+		return nil, fmt.Errorf("failed to start successor: %s", err)
+	}
+
+	ready, err := bufio.NewReader(readyReader).ReadString('\n')
+	if err != nil || ready != "ready\n" {
+		drainWriter.Close()
+		successor.Process.Kill()
+		successor.Wait()
+		return nil, fmt.Errorf("successor failed to start")
+	}
+	log.Printf("Handed over to pid %d", successor.Process.Pid)
+	return &Successor{cmd: successor, drain: drainWriter}, nil
+}
+
+// ForwardUpgrade passes an upgrade request on to the guard that started this
+// one, which starts the next generation.
+func (fwd *SSHFwd) ForwardUpgrade() error {
+	ppid := os.Getppid()
+	if ppid == 1 {
+		return fmt.Errorf("the guard that started this one has exited")
+	}
+	return syscall.Kill(ppid, syscall.SIGUSR2)
+}
+
+// DrainRequested returns a channel that is closed once the guard that started
+// this one asks it to drain, or exits. It is nil if this guard was not started
+// by Handover.
+func (fwd *SSHFwd) DrainRequested() <-chan struct{} {
+	return fwd.drainRequested
+}
+
+// StopAccepting closes this process's copy of the listener without removing
+// the socket, which a successor keeps serving.
+func (fwd *SSHFwd) StopAccepting() {
+	if unixListener, ok := fwd.listener.(*net.UnixListener); ok {
+		unixListener.SetUnlinkOnClose(false)
+	}
+	fwd.listener.Close()
+}
+
+// ResumeHandover takes over forwarding from a predecessor guard, if this
+// process was started by Handover. It returns false otherwise.
+func (fwd *SSHFwd) ResumeHandover() (bool, error) {
+	stateStr := os.Getenv(handoverEnv)
+	if stateStr == "" {
+		return false, nil
+	}
+	os.Unsetenv(handoverEnv)
+
+	var state handoverState
+	if err := json.Unmarshal([]byte(stateStr), &state); err != nil {
+		return true, fmt.Errorf("invalid handover state: %s", err)
+	}
+	listenerFile := os.NewFile(handoverListenerFd, "listener")
+	listener, err := net.FileListener(listenerFile)
+	listenerFile.Close()
+	if err != nil {
+		return true, fmt.Errorf("failed to resume listener: %s", err)
+	}
+
+	fwd.SSHArgs = state.SSHArgs
+	fwd.localSocket = state.LocalSocket
+	fwd.remoteSocket = state.RemoteSocket
+	fwd.ownsMaster = state.OwnsMaster
+	fwd.listener = listener
+	fwd.stubStdin = os.NewFile(handoverStubStdinFd, "stub-stdin")
+	fwd.stubStdout = os.NewFile(handoverStubStdoutFd, "stub-stdout")
+
+	drain := os.NewFile(handoverDrainFd, "drain")
+	fwd.drainRequested = make(chan struct{})
+	go func() {
+		var buf [1]byte
+		drain.Read(buf[:])
+		drain.Close()
+		close(fwd.drainRequested)
+	}()
+
+	// The stub is no longer our child; its stdout closing tells us it is gone.
+	go func() {
+		var buf [512]byte
+		for {
+			if _, err := fwd.stubStdout.Read(buf[:]); err != nil {
+				break
+			}
+		}
+		fwd.listener.Close()
+	}()
+	return true, nil
+}
+
+// HandoverReady tells the predecessor that this process now serves requests.
+func (fwd *SSHFwd) HandoverReady() error {
+	readyFile := os.NewFile(handoverReadyFd, "ready")
+	defer readyFile.Close()
+	_, err := readyFile.WriteString("ready\n")
+	return err
+}
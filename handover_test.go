@@ -0,0 +1,125 @@
+// +build darwin dragonfly freebsd linux netbsd openbsd solaris
+
+package guardianagent
+
+import (
+	"bufio"
+	"io/ioutil"
+	"net"
+	"os"
+	"path"
+	"testing"
+	"time"
+)
+
+// handoverPolicyEnv passes the policy path to the successor, which is this
+// test binary started again by Handover with the arguments in os.Args.
+const handoverPolicyEnv = "SGA_TEST_HANDOVER_POLICY"
+
+// handoverSuccessor is the successor's side of TestHandover: it resumes
+// forwarding, saves a rule, reports ready, answers one connection and exits
+// once drained.
+func handoverSuccessor() {
+	fwd := &SSHFwd{}
+	if resumed, err := fwd.ResumeHandover(); !resumed || err != nil {
+		os.Exit(2)
+	}
+	store, err := NewStore(os.Getenv(handoverPolicyEnv))
+	if err != nil || store.AllowCommand(benchScope, "make successor") != nil {
+		os.Exit(3)
+	}
+	if err = fwd.HandoverReady(); err != nil {
+		os.Exit(4)
+	}
+	conn, err := fwd.Accept()
+	if err != nil {
+		os.Exit(5)
+	}
+	conn.Write([]byte("successor\n"))
+	conn.Close()
+	<-fwd.DrainRequested()
+	os.Exit(0)
+}
+
+func TestHandover(t *testing.T) {
+	if os.Getenv(handoverEnv) != "" {
+		handoverSuccessor()
+	}
+
+	dir, err := ioutil.TempDir("", "sga-handover")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(dir)
+	policyPath := path.Join(dir, "sga_policy")
+	os.Setenv(handoverPolicyEnv, policyPath)
+	defer os.Unsetenv(handoverPolicyEnv)
+	// Loaded before the handover, like the draining guard's store.
+	store, err := NewStore(policyPath)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	listener, err := net.Listen("unix", path.Join(dir, "sock"))
+	if err != nil {
+		t.Fatal(err)
+	}
+	stubStdinReader, stubStdin, err := os.Pipe()
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer stubStdinReader.Close()
+	stubStdout, stubStdoutWriter, err := os.Pipe()
+	if err != nil {
+		t.Fatal(err)
+	}
+	// Open for as long as the stub would be running.
+	defer stubStdoutWriter.Close()
+	fwd := &SSHFwd{listener: listener, stubStdin: stubStdin, stubStdout: stubStdout}
+
+	args := os.Args
+	os.Args = []string{args[0], "-test.run=^TestHandover$"}
+	successor, err := fwd.Handover()
+	os.Args = args
+	if err != nil {
+		t.Fatal(err)
+	}
+	exited := make(chan error, 1)
+	go func() { exited <- successor.Wait() }()
+	fwd.StopAccepting()
+
+	conn, err := net.Dial("unix", path.Join(dir, "sock"))
+	if err != nil {
+		t.Fatalf("socket not served after the handover: %s", err)
+	}
+	reply, err := bufio.NewReader(conn).ReadString('\n')
+	conn.Close()
+	if err != nil || reply != "successor\n" {
+		t.Errorf("connection answered with %q, %v, want the successor", reply, err)
+	}
+
+	// The draining guard approves a command after the successor saved its
+	// own rule.
+	if err = store.AllowCommand(benchScope, "make predecessor"); err != nil {
+		t.Fatal(err)
+	}
+	loaded, err := NewStore(policyPath)
+	if err != nil {
+		t.Fatal(err)
+	}
+	for _, cmd := range []string{"make successor", "make predecessor"} {
+		if !loaded.IsAllowed(benchScope, cmd) {
+			t.Errorf("rule for %q lost between generations", cmd)
+		}
+	}
+
+	successor.Drain()
+	select {
+	case err := <-exited:
+		if err != nil {
+			t.Errorf("successor exited with %s", err)
+		}
+	case <-time.After(10 * time.Second):
+		t.Errorf("successor did not exit after draining")
+	}
+}
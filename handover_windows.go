@@ -0,0 +1,43 @@
+// +build windows
+
+package guardianagent
+
+import (
+	"errors"
+	"os"
+)
+
+// UpgradeSignal is nil since handover is not supported on Windows.
+var UpgradeSignal os.Signal
+
+type Successor struct{}
+
+func (s *Successor) Drain() {}
+
+func (s *Successor) Wait() error {
+	return errors.New("handover is not supported on this platform")
+}
+
+func (fwd *SSHFwd) Handover() (*Successor, error) {
+	return nil, errors.New("handover is not supported on this platform")
+}
+
+func (fwd *SSHFwd) ForwardUpgrade() error {
+	return errors.New("handover is not supported on this platform")
+}
+
+func (fwd *SSHFwd) DrainRequested() <-chan struct{} {
+	return nil
+}
+
+func (fwd *SSHFwd) StopAccepting() {
+	fwd.listener.Close()
+}
+
+func (fwd *SSHFwd) ResumeHandover() (bool, error) {
+	return false, nil
+}
+
+func (fwd *SSHFwd) HandoverReady() error {
+	return nil
+}
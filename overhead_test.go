@@ -0,0 +1,474 @@
+// +build darwin dragonfly freebsd linux netbsd openbsd solaris
+
+package guardianagent
+
+import (
+	"bufio"
+	"bytes"
+	"crypto/ecdsa"
+	"crypto/elliptic"
+	"crypto/rand"
+	"encoding/binary"
+	"errors"
+	"flag"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"log"
+	"net"
+	"os"
+	"os/exec"
+	"path"
+	"strconv"
+	"strings"
+	"sync"
+	"testing"
+	"time"
+
+	"golang.org/x/crypto/ssh"
+	"golang.org/x/crypto/ssh/agent"
+	"golang.org/x/crypto/ssh/knownhosts"
+)
+
+// BenchmarkOverhead runs the command scripts/sga-bench runs on real hosts
+// against an in-process server, in the three ways it compares them: with the
+// x/crypto client authenticating through a forwarded agent as ssh -A does,
+// through runDirect, and through runDelegated. The guard runs in a separate
+// process so that its CPU time is reported apart from this one's, which also
+// runs the server. The links to the server, to the forwarded agent and to the
+// guard are each delayed by -overhead-rtt.
+var (
+	overheadRTT  = flag.Duration("overhead-rtt", 20*time.Millisecond, "round trip time of each link in BenchmarkOverhead")
+	overheadSize = flag.Int64("overhead-size", 16<<20, "bytes output by each session in BenchmarkOverhead")
+)
+
+// overheadGuardEnv names the benchmark's directory to the guard process, which
+// is this test binary started again to run TestOverheadGuard.
+const overheadGuardEnv = "SGA_TEST_OVERHEAD_GUARD"
+
+type overheadEnv struct {
+	dir        string
+	clientKey  *ecdsa.PrivateKey
+	serverLink string
+	guard      *exec.Cmd
+	guardIn    io.WriteCloser
+	guardOut   *bufio.Reader
+	closers    []io.Closer
+}
+
+// startOverheadEnv starts the server, the agent holding the client's key and
+// the guard, and the delayed links to each. The guard's policy allows every
+// command on the server, so that no session waits for the user.
+func startOverheadEnv(b *testing.B) *overheadEnv {
+	dir, err := ioutil.TempDir("", "sga-overhead")
+	if err != nil {
+		b.Fatal(err)
+	}
+	env := &overheadEnv{dir: dir}
+	env.clientKey, err = ecdsa.GenerateKey(elliptic.P256(), rand.Reader)
+	if err != nil {
+		b.Fatal(err)
+	}
+	clientSigner, err := ssh.NewSignerFromKey(env.clientKey)
+	if err != nil {
+		b.Fatal(err)
+	}
+	hostKey := newTestSigner(b)
+	server := env.listen(b, "tcp", "127.0.0.1:0")
+	go serveOverhead(server, clientSigner.PublicKey(), hostKey)
+	serverLink := env.listen(b, "tcp", "127.0.0.1:0")
+	startLink(serverLink, "tcp", server.Addr().String(), *overheadRTT)
+	env.serverLink = serverLink.Addr().String()
+
+	knownHostsLine := knownhosts.Line([]string{env.serverLink}, hostKey.PublicKey())
+	if err = ioutil.WriteFile(path.Join(dir, "known_hosts"), []byte(knownHostsLine+"\n"), 0600); err != nil {
+		b.Fatal(err)
+	}
+
+	keyring := agent.NewKeyring()
+	if err = keyring.Add(agent.AddedKey{PrivateKey: env.clientKey}); err != nil {
+		b.Fatal(err)
+	}
+	agentSock := env.listen(b, "unix", path.Join(dir, "agent.sock"))
+	go func() {
+		for {
+			c, err := agentSock.Accept()
+			if err != nil {
+				return
+			}
+			go func() {
+				agent.ServeAgent(keyring, c)
+				c.Close()
+			}()
+		}
+	}()
+	agentLink := env.listen(b, "unix", path.Join(dir, "agent-link.sock"))
+	startLink(agentLink, "unix", agentSock.Addr().String(), *overheadRTT)
+
+	store, err := NewStore(path.Join(dir, "sga_policy"))
+	if err != nil {
+		b.Fatal(err)
+	}
+	if err = store.AllowAll(Scope{ServiceUsername: "bench", ServiceHostname: env.serverLink}); err != nil {
+		b.Fatal(err)
+	}
+	env.startGuard(b)
+	guardLink := env.listen(b, "unix", path.Join(dir, AgentGuardSockName))
+	startLink(guardLink, "unix", path.Join(dir, "guard.sock"), *overheadRTT)
+	return env
+}
+
+func (env *overheadEnv) listen(b *testing.B, network string, address string) net.Listener {
+	l, err := net.Listen(network, address)
+	if err != nil {
+		b.Fatal(err)
+	}
+	env.closers = append(env.closers, l)
+	return l
+}
+
+// startGuard starts the guard process and waits for it to listen. Like a
+// guard on the user's machine, it uses the agent without a link.
+func (env *overheadEnv) startGuard(b *testing.B) {
+	env.guard = exec.Command(os.Args[0], "-test.run=^TestOverheadGuard$")
+	env.guard.Env = append(os.Environ(),
+		overheadGuardEnv+"="+env.dir,
+		"SSH_AUTH_SOCK="+path.Join(env.dir, "agent.sock"))
+	env.guard.Stderr = os.Stderr
+	var err error
+	if env.guardIn, err = env.guard.StdinPipe(); err != nil {
+		b.Fatal(err)
+	}
+	guardOut, err := env.guard.StdoutPipe()
+	if err != nil {
+		b.Fatal(err)
+	}
+	env.guardOut = bufio.NewReader(guardOut)
+	if err = env.guard.Start(); err != nil {
+		b.Fatal(err)
+	}
+	if line, err := env.guardOut.ReadString('\n'); err != nil || line != "ready\n" {
+		b.Fatalf("guard failed to start: %q %v", line, err)
+	}
+}
+
+// guardCPU returns the CPU time the guard process has used so far.
+func (env *overheadEnv) guardCPU(b *testing.B) time.Duration {
+	if _, err := io.WriteString(env.guardIn, "cpu\n"); err != nil {
+		b.Fatal(err)
+	}
+	line, err := env.guardOut.ReadString('\n')
+	if err != nil {
+		b.Fatal(err)
+	}
+	cpu, err := strconv.ParseInt(strings.TrimSpace(line), 10, 64)
+	if err != nil {
+		b.Fatal(err)
+	}
+	return time.Duration(cpu)
+}
+
+func (env *overheadEnv) Close() {
+	env.guardIn.Close()
+	env.guard.Wait()
+	for _, c := range env.closers {
+		c.Close()
+	}
+	os.RemoveAll(env.dir)
+}
+
+// TestOverheadGuard is the guard process of BenchmarkOverhead, and does
+// nothing when run as a test. It serves guard.sock and answers each line on
+// its standard input with the CPU time it has used, until that is closed.
+func TestOverheadGuard(t *testing.T) {
+	dir := os.Getenv(overheadGuardEnv)
+	if dir == "" {
+		return
+	}
+	log.SetOutput(ioutil.Discard)
+	knownHostsPath := path.Join(dir, "known_hosts")
+	userKnownHostsPath = func(string) string { return knownHostsPath }
+	ag, err := NewGuardian(path.Join(dir, "sga_policy"), Display)
+	if err != nil {
+		t.Fatal(err)
+	}
+	l, err := net.Listen("unix", path.Join(dir, "guard.sock"))
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer l.Close()
+	go func() {
+		for {
+			c, err := l.Accept()
+			if err != nil {
+				return
+			}
+			go func() {
+				ag.HandleConnection(c)
+				c.Close()
+			}()
+		}
+	}()
+	fmt.Println("ready")
+	in := bufio.NewScanner(os.Stdin)
+	for in.Scan() {
+		fmt.Println(int64(processCPUTime()))
+	}
+}
+
+// startLink forwards each connection accepted on l to target, delaying both
+// directions by half of rtt, until l is closed.
+func startLink(l net.Listener, network string, target string, rtt time.Duration) {
+	go func() {
+		for {
+			c, err := l.Accept()
+			if err != nil {
+				return
+			}
+			go func() {
+				t, err := net.Dial(network, target)
+				if err != nil {
+					c.Close()
+					return
+				}
+				toTarget, toClient := newLatencyConn(t, rtt/2), newLatencyConn(c, rtt/2)
+				var wg sync.WaitGroup
+				wg.Add(2)
+				forward := func(dst *latencyConn, src net.Conn) {
+					defer wg.Done()
+					io.Copy(dst, src)
+					dst.CloseWrite()
+				}
+				go forward(toTarget, c)
+				go forward(toClient, t)
+				wg.Wait()
+				toTarget.Close()
+				toClient.Close()
+			}()
+		}
+	}()
+}
+
+// serveOverhead accepts clientKey, replies to no-more-sessions and runs exec
+// requests as local commands.
+func serveOverhead(l net.Listener, clientKey ssh.PublicKey, hostKey ssh.Signer) {
+	config := &ssh.ServerConfig{
+		PublicKeyCallback: func(conn ssh.ConnMetadata, key ssh.PublicKey) (*ssh.Permissions, error) {
+			if bytes.Equal(key.Marshal(), clientKey.Marshal()) {
+				return nil, nil
+			}
+			return nil, errors.New("unknown key")
+		},
+	}
+	config.AddHostKey(hostKey)
+	for {
+		c, err := l.Accept()
+		if err != nil {
+			return
+		}
+		go func() {
+			_, chans, reqs, err := ssh.NewServerConn(c, config)
+			if err != nil {
+				c.Close()
+				return
+			}
+			go func() {
+				for req := range reqs {
+					req.Reply(req.Type == ssh.NoMoreSessionRequestName, nil)
+				}
+			}()
+			for newChannel := range chans {
+				if newChannel.ChannelType() != "session" {
+					newChannel.Reject(ssh.UnknownChannelType, "")
+					continue
+				}
+				channel, requests, err := newChannel.Accept()
+				if err != nil {
+					continue
+				}
+				go serveOverheadSession(channel, requests)
+			}
+		}()
+	}
+}
+
+func serveOverheadSession(channel ssh.Channel, requests <-chan *ssh.Request) {
+	defer channel.Close()
+	for req := range requests {
+		switch req.Type {
+		case "exec":
+			var arg string
+			if len(req.Payload) >= 4 && int(binary.BigEndian.Uint32(req.Payload)) == len(req.Payload)-4 {
+				arg = string(req.Payload[4:])
+			}
+			req.Reply(true, nil)
+			fields := strings.Fields(arg)
+			cmd := exec.Command(fields[0], fields[1:]...)
+			cmd.Stdin = channel
+			cmd.Stdout = channel
+			cmd.Stderr = channel.Stderr()
+			status := uint32(0)
+			if err := cmd.Run(); err != nil {
+				status = 1
+			}
+			channel.CloseWrite()
+			channel.SendRequest("exit-status", false, ssh.Marshal(struct{ Status uint32 }{status}))
+			return
+		case "auth-agent-req@openssh.com", "env":
+			req.Reply(true, nil)
+		default:
+			req.Reply(false, nil)
+		}
+	}
+}
+
+// firstByteWriter discards a session's output, recording when it started.
+type firstByteWriter struct {
+	first time.Time
+	n     int64
+}
+
+func (w *firstByteWriter) Write(p []byte) (int, error) {
+	if w.first.IsZero() {
+		w.first = time.Now()
+	}
+	w.n += int64(len(p))
+	return len(p), nil
+}
+
+// runAgentForwarding runs cmd the way ssh -A does from the intermediary: the
+// x/crypto client signs with the forwarded agent and forwards it on. It
+// returns when the command was started.
+func runAgentForwarding(env *overheadEnv, cmd string, out io.Writer) (setup time.Duration, err error) {
+	start := time.Now()
+	agentConn, err := net.Dial("unix", path.Join(env.dir, "agent-link.sock"))
+	if err != nil {
+		return 0, err
+	}
+	defer agentConn.Close()
+	forwarded := agent.NewClient(agentConn)
+	client, err := ssh.Dial("tcp", env.serverLink, &ssh.ClientConfig{
+		User:            "bench",
+		Auth:            []ssh.AuthMethod{ssh.PublicKeysCallback(forwarded.Signers)},
+		HostKeyCallback: ssh.InsecureIgnoreHostKey(),
+	})
+	if err != nil {
+		return 0, err
+	}
+	defer client.Close()
+	if err = agent.ForwardToAgent(client, forwarded); err != nil {
+		return 0, err
+	}
+	session, err := client.NewSession()
+	if err != nil {
+		return 0, err
+	}
+	defer session.Close()
+	if err = agent.RequestAgentForwarding(session); err != nil {
+		return 0, err
+	}
+	session.Stdout = out
+	if err = session.Start(cmd); err != nil {
+		return 0, err
+	}
+	setup = time.Since(start)
+	return setup, session.Wait()
+}
+
+// reportedSetup returns the setup latency from a session's timing report.
+func reportedSetup(report string) (time.Duration, error) {
+	for _, field := range strings.Fields(report) {
+		if strings.HasPrefix(field, "setup=") {
+			return time.ParseDuration(strings.TrimPrefix(field, "setup="))
+		}
+	}
+	return 0, fmt.Errorf("no setup time in %q", report)
+}
+
+func BenchmarkOverhead(b *testing.B) {
+	log.SetOutput(ioutil.Discard)
+	defer log.SetOutput(os.Stderr)
+	env := startOverheadEnv(b)
+	defer env.Close()
+
+	knownHostsPath := path.Join(env.dir, "known_hosts")
+	defer func(saved func(string) string) { userKnownHostsPath = saved }(userKnownHostsPath)
+	userKnownHostsPath = func(string) string { return knownHostsPath }
+	for name, value := range map[string]string{
+		"SSH_AUTH_SOCK":   path.Join(env.dir, "agent-link.sock"),
+		"XDG_RUNTIME_DIR": env.dir,
+	} {
+		defer os.Setenv(name, os.Getenv(name))
+		os.Setenv(name, value)
+	}
+	// Drop an ssh-agent connection cached from outside the benchmark, and the
+	// benchmark's own when it ends.
+	resetAgent := func() {
+		userSigners.mu.Lock()
+		if userSigners.agentConn != nil {
+			userSigners.agentConn.Close()
+		}
+		userSigners.agentConn, userSigners.agentClient = nil, nil
+		userSigners.mu.Unlock()
+	}
+	resetAgent()
+	defer resetAgent()
+
+	cmd := fmt.Sprintf("head -c %d /dev/zero", *overheadSize)
+	run := func(b *testing.B, session func(out io.Writer) (time.Duration, error)) {
+		b.SetBytes(*overheadSize)
+		var setup, firstByte time.Duration
+		startGuardCPU := env.guardCPU(b)
+		startCPU := processCPUTime()
+		b.ResetTimer()
+		for i := 0; i < b.N; i++ {
+			start := time.Now()
+			out := &firstByteWriter{}
+			sessionSetup, err := session(out)
+			if err != nil {
+				b.Fatal(err)
+			}
+			if out.n != *overheadSize {
+				b.Fatalf("received %d bytes, expected %d", out.n, *overheadSize)
+			}
+			setup += sessionSetup
+			firstByte += out.first.Sub(start)
+		}
+		b.StopTimer()
+		perOp := func(d time.Duration) float64 { return float64(d) / float64(time.Millisecond) / float64(b.N) }
+		b.ReportMetric(perOp(setup), "setup-ms/op")
+		b.ReportMetric(perOp(firstByte), "first-byte-ms/op")
+		// Includes the in-process server and links, which are the same for
+		// every path.
+		b.ReportMetric(perOp(processCPUTime()-startCPU), "cpu-ms/op")
+		b.ReportMetric(perOp(env.guardCPU(b)-startGuardCPU), "guard-cpu-ms/op")
+	}
+	runSSHCommand := func(direct bool) func(out io.Writer) (time.Duration, error) {
+		return func(out io.Writer) (time.Duration, error) {
+			var report bytes.Buffer
+			err := RunSSHCommand(SSHCommand{
+				HostPort:  env.serverLink,
+				Username:  "bench",
+				Cmd:       cmd,
+				StdinNull: true,
+				Direct:    direct,
+				Timing:    &report,
+				Stdout:    out,
+				Stderr:    ioutil.Discard,
+			})
+			if err != nil {
+				return 0, err
+			}
+			if strings.Contains(report.String(), "path=direct") != direct {
+				return 0, fmt.Errorf("session took the wrong path: %s", report.String())
+			}
+			return reportedSetup(report.String())
+		}
+	}
+
+	b.Run("agentForwarding", func(b *testing.B) {
+		run(b, func(out io.Writer) (time.Duration, error) { return runAgentForwarding(env, cmd, out) })
+	})
+	b.Run("direct", func(b *testing.B) { run(b, runSSHCommand(true)) })
+	b.Run("delegated", func(b *testing.B) { run(b, runSSHCommand(false)) })
+}
@@ -1,25 +1,66 @@
 package guardianagent
 
 import (
+	"bytes"
 	"errors"
 	"fmt"
+	"strings"
 )
 
 type Policy struct {
 	Store *Store
 	UI    UI
+
+	// If set, called before prompting; a non-nil error refuses the request
+	// without asking.
+	admit func() error
+}
+
+// gated returns a copy of policy that calls admit before prompting.
+func (policy Policy) gated(admit func() error) *Policy {
+	policy.admit = admit
+	return &policy
+}
+
+func (policy *Policy) ask(prompt Prompt) (int, error) {
+	if policy.admit != nil {
+		if err := policy.admit(); err != nil {
+			return 0, err
+		}
+	}
+	return policy.UI.Ask(prompt)
+}
+
+// Commands longer than this are shown abbreviated, to their head and tail and
+// a digest prefix. Since the user cannot see such a command whole, it is never
+// offered for approval: only a rule allowing every command lets it run.
+const maxDisplayedCommand = 1024
+
+func displayCommand(cmd string) string {
+	if len(cmd) <= maxDisplayedCommand {
+		return cmd
+	}
+	digest := digestCommand(cmd)
+	half := maxDisplayedCommand / 2
+	return fmt.Sprintf("%s ...[%d bytes, sha256 %x]... %s",
+		cmd[:half], len(cmd), digest[:8], cmd[len(cmd)-half:])
 }
 
 func (policy *Policy) RequestApproval(scope Scope, cmd string) error {
+	shown := displayCommand(cmd)
 	if policy.Store.IsAllowed(scope, cmd) {
 		policy.UI.Inform(fmt.Sprintf("Request by %s to run '%s' on %s@%s AUTO-APPROVED by policy",
-			scope.Client, cmd, scope.ServiceUsername,
+			scope.Client, shown, scope.ServiceUsername,
 			scope.ServiceHostname))
 		return nil
 	}
+	if shown != cmd {
+		policy.UI.Alert(fmt.Sprintf("Request by %s to run '%s' on %s@%s DENIED: the command is too long to show in full",
+			scope.Client, shown, scope.ServiceUsername, scope.ServiceHostname))
+		return errors.New("Command too long to show for approval")
+	}
 	question := fmt.Sprintf("Allow %s to run '%s' on %s@%s?",
 		scope.Client, cmd, scope.ServiceUsername, scope.ServiceHostname)
-
 	prompt := Prompt{
 		Question: question,
 		Choices: []string{
@@ -28,7 +69,7 @@ func (policy *Policy) RequestApproval(scope Scope, cmd string) error {
 				scope.Client, scope.ServiceUsername, scope.ServiceHostname),
 		},
 	}
-	resp, err := policy.UI.Ask(prompt)
+	resp, err := policy.ask(prompt)
 	if err != nil {
 		return fmt.Errorf("Failed to get user approval: %s", err)
 	}
@@ -36,11 +77,11 @@ func (policy *Policy) RequestApproval(scope Scope, cmd string) error {
 	switch resp {
 	case 2:
 		policy.UI.Inform(fmt.Sprintf("Request by %s to run '%s' on %s@%s APPROVED by user",
-			scope.Client, cmd, scope.ServiceUsername, scope.ServiceHostname))
+			scope.Client, shown, scope.ServiceUsername, scope.ServiceHostname))
 		err = nil
 	case 3:
 		policy.UI.Inform(fmt.Sprintf("Request by %s to run '%s' on %s@%s PERMANENTLY APPROVED by user",
-			scope.Client, cmd, scope.ServiceUsername, scope.ServiceHostname))
+			scope.Client, shown, scope.ServiceUsername, scope.ServiceHostname))
 		err = policy.Store.AllowCommand(scope, cmd)
 	case 4:
 		policy.UI.Inform(fmt.Sprintf("Request by %s to run ANY COMMAND on %s@%s PERMANENTLY APPROVED by user",
@@ -48,42 +89,201 @@ func (policy *Policy) RequestApproval(scope Scope, cmd string) error {
 		err = policy.Store.AllowAll(scope)
 	default:
 		policy.UI.Inform(fmt.Sprintf("Request by %s to run '%s' on %s@%s DENIED by user",
-			scope.Client, cmd, scope.ServiceUsername, scope.ServiceHostname))
+			scope.Client, shown, scope.ServiceUsername, scope.ServiceHostname))
 		err = errors.New("User rejected client request")
 	}
 
 	return err
 }
 
-func (policy *Policy) RequestApprovalForAllCommands(scope Scope) error {
+func (policy *Policy) RequestSubsystemApproval(scope Scope, subsystem string) error {
+	if policy.Store.IsSubsystemAllowed(scope, subsystem) {
+		policy.UI.Inform(fmt.Sprintf("Request by %s to open subsystem '%s' on %s@%s AUTO-APPROVED by policy",
+			scope.Client, subsystem, scope.ServiceUsername, scope.ServiceHostname))
+		return nil
+	}
+	question := fmt.Sprintf("Allow %s to open subsystem '%s' on %s@%s?",
+		scope.Client, subsystem, scope.ServiceUsername, scope.ServiceHostname)
+
+	prompt := Prompt{
+		Question: question,
+		Choices:  []string{"Disallow", "Allow once", "Allow forever"},
+	}
+	resp, err := policy.ask(prompt)
+	if err != nil {
+		return fmt.Errorf("Failed to get user approval: %s", err)
+	}
+
+	switch resp {
+	case 2:
+		policy.UI.Inform(fmt.Sprintf("Request by %s to open subsystem '%s' on %s@%s APPROVED by user",
+			scope.Client, subsystem, scope.ServiceUsername, scope.ServiceHostname))
+		err = nil
+	case 3:
+		policy.UI.Inform(fmt.Sprintf("Request by %s to open subsystem '%s' on %s@%s PERMANENTLY APPROVED by user",
+			scope.Client, subsystem, scope.ServiceUsername, scope.ServiceHostname))
+		err = policy.Store.AllowSubsystem(scope, subsystem)
+	default:
+		policy.UI.Inform(fmt.Sprintf("Request by %s to open subsystem '%s' on %s@%s DENIED by user",
+			scope.Client, subsystem, scope.ServiceUsername, scope.ServiceHostname))
+		err = errors.New("User rejected subsystem request")
+	}
+
+	return err
+}
+
+func (policy *Policy) RequestForwardingApproval(scope Scope, targets []string) error {
+	shown := strings.Join(targets, ", ")
+	if containsString(targets, DynamicForwardTarget) {
+		shown = "ANY DESTINATION"
+	}
+	if policy.Store.AreAdvisoryForwardsAllowed(scope, targets) {
+		policy.UI.Inform(fmt.Sprintf("Request by %s to forward connections to %s through %s@%s AUTO-APPROVED by advisory policy",
+			scope.Client, shown, scope.ServiceUsername, scope.ServiceHostname))
+		return nil
+	}
+	question := fmt.Sprintf("Allow %s to forward connections to %s through %s@%s?\n"+
+		"This is advisory: %s opens the forwards itself after handoff, and the server does not enforce this decision.",
+		scope.Client, shown, scope.ServiceUsername, scope.ServiceHostname, scope.Client)
+
+	prompt := Prompt{
+		Question: question,
+		Choices:  []string{"Disallow", "Allow once", "Allow forever (advisory)"},
+	}
+	resp, err := policy.ask(prompt)
+	if err != nil {
+		return fmt.Errorf("Failed to get user approval: %s", err)
+	}
+
+	switch resp {
+	case 2:
+		policy.UI.Inform(fmt.Sprintf("Request by %s to forward connections to %s through %s@%s APPROVED by user",
+			scope.Client, shown, scope.ServiceUsername, scope.ServiceHostname))
+		err = nil
+	case 3:
+		policy.UI.Inform(fmt.Sprintf("Request by %s to forward connections to %s through %s@%s PERMANENTLY APPROVED by user (advisory)",
+			scope.Client, shown, scope.ServiceUsername, scope.ServiceHostname))
+		err = policy.Store.AllowAdvisoryForwards(scope, targets)
+	default:
+		policy.UI.Inform(fmt.Sprintf("Request by %s to forward connections to %s through %s@%s DENIED by user",
+			scope.Client, shown, scope.ServiceUsername, scope.ServiceHostname))
+		err = errors.New("User rejected forwarding request")
+	}
+
+	return err
+}
+
+// RequestApprovalForAllCommands asks to allow any command, when the server
+// cannot be made to enforce the one requested. request describes what the
+// client asked for, e.g. "run 'make'", so that the user sees it first.
+func (policy *Policy) RequestApprovalForAllCommands(scope Scope, request string) error {
 	if policy.Store.AreAllAllowed(scope) {
-		policy.UI.Inform(fmt.Sprintf("Request by %s to run ANY COMMAND on %s@%s AUTO-APPROVED by policy",
-			scope.Client, scope.ServiceUsername, scope.ServiceHostname))
+		policy.UI.Inform(fmt.Sprintf("Request by %s to %s, allowing ANY COMMAND on %s@%s, AUTO-APPROVED by policy",
+			scope.Client, request, scope.ServiceUsername, scope.ServiceHostname))
 		return nil
 	}
-	question := fmt.Sprintf("Can't enforce permission for a single command. Allow %s to run ANY COMMAND on %s@%s?",
+	question := fmt.Sprintf("%s asks to %s on %s@%s. Can't enforce permission for a single command there. Allow %s to run ANY COMMAND on %s@%s?",
+		scope.Client, request, scope.ServiceUsername, scope.ServiceHostname,
 		scope.Client, scope.ServiceUsername, scope.ServiceHostname)
 
 	prompt := Prompt{
 		Question: question,
 		Choices:  []string{"Disallow", "Allow once", "Allow forever"},
 	}
-	resp, err := policy.UI.Ask(prompt)
+	resp, err := policy.ask(prompt)
+	if err != nil {
+		return fmt.Errorf("Failed to get user approval: %s", err)
+	}
 
 	switch resp {
 	case 2:
-		policy.UI.Inform(fmt.Sprintf("Request by %s to run ANY COMMAND on %s@%s APPROVED by user",
-			scope.Client, scope.ServiceUsername, scope.ServiceHostname))
+		policy.UI.Inform(fmt.Sprintf("Request by %s to %s, allowing ANY COMMAND on %s@%s, APPROVED by user",
+			scope.Client, request, scope.ServiceUsername, scope.ServiceHostname))
 		err = nil
 	case 3:
-		policy.UI.Inform(fmt.Sprintf("Request by %s to run ANY COMMAND on %s@%s PERMANENTLY APPROVED by user",
-			scope.Client, scope.ServiceUsername, scope.ServiceHostname))
+		policy.UI.Inform(fmt.Sprintf("Request by %s to %s, allowing ANY COMMAND on %s@%s, PERMANENTLY APPROVED by user",
+			scope.Client, request, scope.ServiceUsername, scope.ServiceHostname))
 		err = policy.Store.AllowAll(scope)
 	default:
-		policy.UI.Inform(fmt.Sprintf("Request by %s to run ANY COMMAND on %s@%s DENIED by user",
-			scope.Client, scope.ServiceUsername, scope.ServiceHostname))
+		policy.UI.Inform(fmt.Sprintf("Request by %s to %s, allowing ANY COMMAND on %s@%s, DENIED by user",
+			scope.Client, request, scope.ServiceUsername, scope.ServiceHostname))
 		err = errors.New("User rejected approval escalation")
 	}
 
 	return err
 }
+
+// commandRequest and subsystemRequest describe requests for
+// RequestApprovalForAllCommands.
+func commandRequest(cmd string) string {
+	return fmt.Sprintf("run '%s'", displayCommand(cmd))
+}
+
+func subsystemRequest(subsystem string) string {
+	return fmt.Sprintf("open subsystem '%s'", subsystem)
+}
+
+type BatchItem struct {
+	Scope   Scope
+	Command string
+}
+
+// RequestBatchApproval asks for a whole plan of commands at once. Items already
+// allowed by the store are approved without asking; the rest are approved or
+// denied together, or individually if the user chooses so.
+func (policy *Policy) RequestBatchApproval(client string, items []BatchItem) []bool {
+	approved := make([]bool, len(items))
+	var pending []int
+	for idx, item := range items {
+		if policy.Store.IsAllowed(item.Scope, item.Command) {
+			approved[idx] = true
+		} else {
+			pending = append(pending, idx)
+		}
+	}
+	if len(pending) == 0 {
+		policy.UI.Inform(fmt.Sprintf("Batch of %d requests by %s AUTO-APPROVED by policy", len(items), client))
+		return approved
+	}
+
+	var question bytes.Buffer
+	fmt.Fprintf(&question, "Allow %s to run the following %d commands?", client, len(pending))
+	for _, idx := range pending {
+		fmt.Fprintf(&question, "\n  '%s' on %s@%s", items[idx].Command,
+			items[idx].Scope.ServiceUsername, items[idx].Scope.ServiceHostname)
+	}
+	prompt := Prompt{
+		Question: question.String(),
+		Choices:  []string{"Disallow all", "Allow all once", "Allow all forever", "Choose individually"},
+	}
+	resp, err := policy.ask(prompt)
+	if err != nil {
+		policy.UI.Inform(fmt.Sprintf("Failed to get user approval for batch by %s: %s", client, err))
+		return approved
+	}
+
+	switch resp {
+	case 2:
+		policy.UI.Inform(fmt.Sprintf("Batch of %d requests by %s APPROVED by user", len(pending), client))
+		for _, idx := range pending {
+			approved[idx] = true
+		}
+	case 3:
+		policy.UI.Inform(fmt.Sprintf("Batch of %d requests by %s PERMANENTLY APPROVED by user", len(pending), client))
+		for _, idx := range pending {
+			if err := policy.Store.AllowCommand(items[idx].Scope, items[idx].Command); err != nil {
+				policy.UI.Alert(fmt.Sprintf("Failed to save policy: %s", err))
+			}
+			approved[idx] = true
+		}
+	case 4:
+		// The user asked for these prompts, so they are not throttled.
+		individual := policy.gated(nil)
+		for _, idx := range pending {
+			approved[idx] = individual.RequestApproval(items[idx].Scope, items[idx].Command) == nil
+		}
+	default:
+		policy.UI.Inform(fmt.Sprintf("Batch of %d requests by %s DENIED by user", len(pending), client))
+	}
+	return approved
+}
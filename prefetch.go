@@ -0,0 +1,114 @@
+package guardianagent
+
+import (
+	"log"
+	"net"
+	"os"
+	"os/user"
+	"sync"
+	"time"
+
+	"golang.org/x/crypto/ssh/knownhosts"
+)
+
+// Number of recent targets remembered per client, most recent first.
+const prefetchHistory = 4
+
+// prefetcher uses the gap between a client's first message on a connection
+// and its first request to prepare the per-server state of the targets the client
+// used recently, so that it is ready when the request arrives.
+type prefetcher struct {
+	mu      sync.Mutex
+	history map[string][]Scope
+	algs    map[string]*hostKeyAlgsEntry
+}
+
+// hostKeyAlgsEntry caches the host key algorithm order for a server, which is
+// derived from known_hosts and is valid until that file changes.
+type hostKeyAlgsEntry struct {
+	algs       []string
+	modTime    time.Time
+	size       int64
+	cost       time.Duration
+	prefetched bool
+}
+
+func newPrefetcher() *prefetcher {
+	return &prefetcher{
+		history: make(map[string][]Scope),
+		algs:    make(map[string]*hostKeyAlgsEntry),
+	}
+}
+
+// record notes that client requested a session for scope.
+func (p *prefetcher) record(scope Scope) {
+	p.mu.Lock()
+	defer p.mu.Unlock()
+	recent := []Scope{scope}
+	for _, s := range p.history[scope.Client] {
+		if s != scope && len(recent) < prefetchHistory {
+			recent = append(recent, s)
+		}
+	}
+	p.history[scope.Client] = recent
+}
+
+// start prefetches in the background for the client's recent targets.
+func (p *prefetcher) start(client string, remote net.Addr) {
+	p.mu.Lock()
+	scopes := p.history[client]
+	p.mu.Unlock()
+	if len(scopes) == 0 {
+		return
+	}
+
+	go func() {
+		start := time.Now()
+		curuser, err := user.Current()
+		if err != nil {
+			return
+		}
+		knownHostsPath := userKnownHostsPath(curuser.HomeDir)
+		if _, err := userKnownHosts.callback(knownHostsPath); err != nil {
+			log.Printf("Failed to index known_hosts: %s", err)
+		}
+		userSigners.load(curuser.HomeDir)
+		for _, scope := range scopes {
+			p.hostKeyAlgs(scope.ServiceHostname, remote, knownHostsPath, true)
+		}
+		log.Printf("Prefetched %d targets for %s in %s", len(scopes), client, time.Since(start))
+	}()
+}
+
+// hostKeyAlgs returns the host key algorithm order for hostname. hit reports
+// whether it was prefetched, and saved how long computing it took.
+func (p *prefetcher) hostKeyAlgs(hostname string, remote net.Addr, knownHostsPath string, prefetch bool) (algs []string, hit bool, saved time.Duration) {
+	fi, err := os.Stat(knownHostsPath)
+	if err != nil {
+		return knownhosts.OrderHostKeyAlgs(hostname, remote, knownHostsPath), false, 0
+	}
+
+	p.mu.Lock()
+	entry, ok := p.algs[hostname]
+	if ok && entry.modTime.Equal(fi.ModTime()) && entry.size == fi.Size() {
+		hit, saved = entry.prefetched && !prefetch, entry.cost
+		entry.prefetched = entry.prefetched && prefetch
+		p.mu.Unlock()
+		return entry.algs, hit, saved
+	}
+	p.mu.Unlock()
+
+	start := time.Now()
+	algs = knownhosts.OrderHostKeyAlgs(hostname, remote, knownHostsPath)
+	entry = &hostKeyAlgsEntry{
+		algs:       algs,
+		modTime:    fi.ModTime(),
+		size:       fi.Size(),
+		cost:       time.Since(start),
+		prefetched: prefetch,
+	}
+	p.mu.Lock()
+	p.algs[hostname] = entry
+	p.mu.Unlock()
+	return algs, false, 0
+}
@@ -0,0 +1,179 @@
+package guardianagent
+
+import (
+	"fmt"
+	"sync"
+	"time"
+)
+
+const (
+	// Repeats of a denied request are refused without prompting for
+	// denialBackoffBase, doubling with every further denial up to denialBackoffMax.
+	denialBackoffBase = 2 * time.Second
+	denialBackoffMax  = 5 * time.Minute
+
+	// By default each client may prompt DefaultRequestBurst times at once,
+	// refilled at DefaultRequestRate prompts per second.
+	DefaultRequestRate  = 5
+	DefaultRequestBurst = 20
+
+	// Idle entries are dropped once the map grows past this size.
+	throttleMaxEntries = 4096
+)
+
+type denialKey struct {
+	Scope      Scope
+	Command    string
+	Subsystem  bool
+	Forwarding bool
+}
+
+type denialEntry struct {
+	count int
+	until time.Time
+}
+
+type tokenBucket struct {
+	tokens float64
+	last   time.Time
+}
+
+// throttle refuses request storms before they reach the UI: a negative cache
+// of recent denials with exponential backoff, and a token bucket per client.
+// Requests the policy decides without asking never consult it.
+type throttle struct {
+	mu      sync.Mutex
+	rate    float64
+	burst   float64
+	denials map[denialKey]*denialEntry
+	buckets map[string]*tokenBucket
+}
+
+func newThrottle() *throttle {
+	return &throttle{
+		rate:    DefaultRequestRate,
+		burst:   DefaultRequestBurst,
+		denials: make(map[denialKey]*denialEntry),
+		buckets: make(map[string]*tokenBucket),
+	}
+}
+
+// setRate sets the per-client token bucket. A rate of 0 disables it.
+func (t *throttle) setRate(rate float64, burst int) {
+	t.mu.Lock()
+	t.rate, t.burst = rate, float64(burst)
+	t.buckets = make(map[string]*tokenBucket)
+	t.mu.Unlock()
+}
+
+// admit returns a non-nil error if the request must be refused without
+// prompting.
+func (t *throttle) admit(key denialKey) error {
+	now := time.Now()
+	t.mu.Lock()
+	defer t.mu.Unlock()
+
+	if entry, ok := t.denials[key]; ok && now.Before(entry.until) {
+		return fmt.Errorf("Request was recently denied, retry in %s", entry.until.Sub(now).Truncate(time.Second))
+	}
+	if t.rate <= 0 {
+		return nil
+	}
+
+	bucket, ok := t.buckets[key.Scope.Client]
+	if !ok {
+		if len(t.buckets) >= throttleMaxEntries {
+			t.expireLocked(now)
+		}
+		bucket = &tokenBucket{tokens: t.burst, last: now}
+		t.buckets[key.Scope.Client] = bucket
+	}
+	bucket.tokens += now.Sub(bucket.last).Seconds() * t.rate
+	if bucket.tokens > t.burst {
+		bucket.tokens = t.burst
+	}
+	bucket.last = now
+	if bucket.tokens < 1 {
+		return fmt.Errorf("Too many requests from %s", key.Scope.Client)
+	}
+	bucket.tokens--
+	return nil
+}
+
+func (t *throttle) recordDenial(key denialKey) {
+	now := time.Now()
+	t.mu.Lock()
+	defer t.mu.Unlock()
+
+	entry, ok := t.denials[key]
+	if !ok {
+		if len(t.denials) >= throttleMaxEntries {
+			t.expireLocked(now)
+		}
+		entry = &denialEntry{}
+		t.denials[key] = entry
+	} else if now.Sub(entry.until) > denialBackoffMax {
+		entry.count = 0
+	}
+	backoff := denialBackoffMax
+	if entry.count < 16 {
+		backoff = denialBackoffBase << uint(entry.count)
+		if backoff > denialBackoffMax {
+			backoff = denialBackoffMax
+		}
+	}
+	entry.count++
+	entry.until = now.Add(backoff)
+}
+
+func (t *throttle) recordApproval(key denialKey) {
+	t.mu.Lock()
+	delete(t.denials, key)
+	t.mu.Unlock()
+}
+
+func (t *throttle) expireLocked(now time.Time) {
+	for key, entry := range t.denials {
+		// Keep the denial count around for one more max backoff so that a
+		// persistent storm keeps backing off.
+		if now.Sub(entry.until) > denialBackoffMax {
+			delete(t.denials, key)
+		}
+	}
+	for client, bucket := range t.buckets {
+		if now.Sub(bucket.last).Seconds()*t.rate > t.burst {
+			delete(t.buckets, client)
+		}
+	}
+}
+
+// throttleGate throttles the prompt of a single request, and records the
+// user's decision so that repeats of a denied request back off.
+type throttleGate struct {
+	t       *throttle
+	key     denialKey
+	refused bool
+}
+
+func (t *throttle) gate(key denialKey) *throttleGate {
+	return &throttleGate{t: t, key: key}
+}
+
+// admit is called by the policy just before prompting.
+func (g *throttleGate) admit() error {
+	err := g.t.admit(g.key)
+	g.refused = err != nil
+	return err
+}
+
+// done records the outcome of the request. Refusals by the throttle itself
+// do not count as further denials.
+func (g *throttleGate) done(err error) {
+	switch {
+	case g.refused:
+	case err != nil:
+		g.t.recordDenial(g.key)
+	default:
+		g.t.recordApproval(g.key)
+	}
+}
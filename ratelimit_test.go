@@ -0,0 +1,213 @@
+package guardianagent
+
+import (
+	"errors"
+	"fmt"
+	"io/ioutil"
+	"log"
+	"net"
+	"os"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"testing"
+	"time"
+
+	"golang.org/x/crypto/ssh"
+)
+
+// scriptedUI answers every prompt with reply and counts the prompts.
+type scriptedUI struct {
+	reply int
+	asked int
+	last  Prompt
+}
+
+func (ui *scriptedUI) Ask(prompt Prompt) (int, error) {
+	ui.asked++
+	ui.last = prompt
+	return ui.reply, nil
+}
+
+func (ui *scriptedUI) Confirm(msg string) bool                { return false }
+func (ui *scriptedUI) Inform(msg string)                      {}
+func (ui *scriptedUI) Alert(msg string)                       {}
+func (ui *scriptedUI) AskPassword(msg string) (string, error) { return "", errors.New("not supported") }
+
+func TestThrottleOnlyLimitsPrompts(t *testing.T) {
+	store, cleanup := newTestStore(t)
+	defer cleanup()
+	if err := store.AllowCommand(benchScope, "make"); err != nil {
+		t.Fatal(err)
+	}
+	ui := &scriptedUI{reply: 2}
+	ag := &Agent{policy: Policy{Store: store, UI: ui}, throttle: newThrottle()}
+	ag.SetRequestRate(0.001, 2)
+
+	request := func(cmd string) error {
+		gate := ag.throttle.gate(denialKey{Scope: benchScope, Command: cmd})
+		err := ag.policy.gated(gate.admit).RequestApproval(benchScope, cmd)
+		gate.done(err)
+		return err
+	}
+	for i := 0; i < 100; i++ {
+		if err := request("make"); err != nil {
+			t.Fatalf("request allowed by policy refused: %s", err)
+		}
+	}
+	for i := 0; i < 2; i++ {
+		if err := request("make install"); err != nil {
+			t.Fatalf("prompt %d within the burst refused: %s", i, err)
+		}
+	}
+	if err := request("make install"); err == nil {
+		t.Errorf("prompt beyond the burst admitted")
+	}
+	if ui.asked != 2 {
+		t.Errorf("user asked %d times, want 2", ui.asked)
+	}
+}
+
+func TestThrottleBacksOffDeniedRequest(t *testing.T) {
+	store, cleanup := newTestStore(t)
+	defer cleanup()
+	ui := &scriptedUI{reply: 1}
+	ag := &Agent{policy: Policy{Store: store, UI: ui}, throttle: newThrottle()}
+
+	for i := 0; i < 3; i++ {
+		gate := ag.throttle.gate(denialKey{Scope: benchScope, Command: "rm -rf /"})
+		gate.done(ag.policy.gated(gate.admit).RequestApproval(benchScope, "rm -rf /"))
+	}
+	if ui.asked != 1 {
+		t.Errorf("user asked %d times about a just-denied request, want 1", ui.asked)
+	}
+}
+
+// floodPromptTime is how long floodUI takes to answer a prompt.
+const floodPromptTime = time.Millisecond
+
+// floodUI answers one prompt at a time, as a dialog does. It denies the
+// flooding client and allows everyone else once.
+type floodUI struct {
+	scriptedUI
+	mu       sync.Mutex
+	flooder  string
+	prompted int64
+}
+
+func (ui *floodUI) Ask(prompt Prompt) (int, error) {
+	ui.mu.Lock()
+	defer ui.mu.Unlock()
+	time.Sleep(floodPromptTime)
+	if strings.HasPrefix(prompt.Question, "Allow "+ui.flooder+" ") {
+		atomic.AddInt64(&ui.prompted, 1)
+		return 1, nil
+	}
+	return 2, nil
+}
+
+// startFlood sends denied execution requests from client over one guard
+// connection until stop is called, which returns the number answered. With
+// distinct set every request is for a new command, so that only the token
+// bucket holds the client back.
+func startFlood(ag *Agent, client string, distinct bool) (stop func() int64) {
+	conn, guard := net.Pipe()
+	go func() {
+		ag.HandleConnection(guard)
+		guard.Close()
+	}()
+	var answered int64
+	go func() {
+		for {
+			if _, _, err := ReadControlPacket(conn); err != nil {
+				return
+			}
+			atomic.AddInt64(&answered, 1)
+		}
+	}()
+	done := make(chan struct{})
+	go func() {
+		defer close(done)
+		notice := ssh.Marshal(AgentForwardingNoticeMsg{Client: client})
+		if WriteControlPacket(conn, MsgAgentForwardingNotice, notice) != nil {
+			return
+		}
+		for i := 0; ; i++ {
+			cmd := "rm -rf /"
+			if distinct {
+				cmd = fmt.Sprintf("rm -rf /%d", i)
+			}
+			request := ExecutionRequestMessage{User: benchScope.ServiceUsername, Server: benchScope.ServiceHostname, Command: cmd}
+			if WriteControlPacket(conn, MsgExecutionRequest, ssh.Marshal(request)) != nil {
+				return
+			}
+		}
+	}()
+	return func() int64 {
+		conn.Close()
+		<-done
+		return atomic.LoadInt64(&answered)
+	}
+}
+
+// BenchmarkApprovalUnderFlood measures how long a request from other clients
+// waits for approval while one client floods the guard with requests the user
+// denies: the same denied command, which the denial cache refuses, or a new
+// command each time, which only the token bucket limits. The measured
+// requests go through the gate and policy as handleExecutionRequest does,
+// stopping at the approval, since an approved session would go on to connect
+// to a server.
+func BenchmarkApprovalUnderFlood(b *testing.B) {
+	log.SetOutput(ioutil.Discard)
+	defer log.SetOutput(os.Stderr)
+	for _, bc := range []struct {
+		name     string
+		flood    bool
+		distinct bool
+		rate     float64
+	}{
+		{"idle", false, false, DefaultRequestRate},
+		{"repeated", true, false, DefaultRequestRate},
+		{"distinct", true, true, DefaultRequestRate},
+		{"distinct-unlimited", true, true, 0},
+	} {
+		b.Run(bc.name, func(b *testing.B) {
+			store, cleanup := newTestStore(b)
+			defer cleanup()
+			ui := &floodUI{flooder: "flooder"}
+			ag := &Agent{
+				store:      store,
+				policy:     Policy{Store: store, UI: ui},
+				throttle:   newThrottle(),
+				accounting: newAccounting(),
+				prefetch:   newPrefetcher(),
+				servers:    loadServerCaps(store.path + ".servers"),
+			}
+			ag.SetRequestRate(bc.rate, DefaultRequestBurst)
+			start := time.Now()
+			stop := func() int64 { return 0 }
+			if bc.flood {
+				stop = startFlood(ag, ui.flooder, bc.distinct)
+			}
+			b.ResetTimer()
+			for i := 0; i < b.N; i++ {
+				// Spread over clients, so that the requests measured stay
+				// within their own clients' buckets.
+				scope := benchScope
+				scope.Client = fmt.Sprintf("client-%d", i%1000)
+				cmd := fmt.Sprintf("make test-%d", i)
+				gate := ag.throttle.gate(denialKey{Scope: scope, Command: cmd})
+				err := ag.policy.gated(gate.admit).RequestApproval(scope, cmd)
+				gate.done(err)
+				if err != nil {
+					b.Fatalf("request from another client refused: %s", err)
+				}
+			}
+			b.StopTimer()
+			flooded := stop()
+			elapsed := time.Since(start).Seconds()
+			b.ReportMetric(float64(flooded)/elapsed, "flood-req/s")
+			b.ReportMetric(float64(atomic.LoadInt64(&ui.prompted))/elapsed, "flood-prompts/s")
+		})
+	}
+}
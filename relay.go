@@ -0,0 +1,395 @@
+package guardianagent
+
+import (
+	"bytes"
+	"errors"
+	"fmt"
+	"io"
+	"log"
+	"net"
+	"os"
+	"runtime"
+	"sync"
+	"time"
+
+	"github.com/hashicorp/yamux"
+)
+
+// relayState is the phase of a delegated session's wiring between the local
+// SSH client, the agent and the server.
+type relayState int
+
+const (
+	// The SSH client talks to the agent, and the server connection is relayed
+	// through the agent.
+	relayPreHandoff relayState = iota
+	// The handoff key exchange has started. Server traffic still goes to the
+	// agent, and is also buffered in case the client must be sent bytes the
+	// agent received after its last message.
+	relayBuffering
+	// The SSH client talks to the server directly.
+	relayPostHandoff
+	// The handoff failed.
+	relayFailed
+)
+
+// handoffRelay moves a delegated session from the agent to the server. The
+// relay is itself the SSH client's connection: the client's reads and writes
+// go to the agent, and then to the server, without copy loops of their own.
+// Only the server's and the agent's outputs are pumped, by one loop each (the
+// agent's ends at handoff), and these loops and the SSH client's key exchange
+// callback coordinate only through the relay's state.
+type handoffRelay struct {
+	agentData      net.Conn
+	agentTransport *CustomConn
+	control        net.Conn
+	serverReader   io.Reader
+	serverWriter   io.WriteCloser
+
+	// Local SSH client -> agent data, then -> server.
+	sshOut settableWriter
+
+	// Only the SSH client's reading goroutine uses agentDrained.
+	agentDrained bool
+
+	// Held while server traffic is written to the agent transport, so that
+	// buffering starts between writes.
+	toAgent   sync.Mutex
+	agentGone bool
+
+	mu    sync.Mutex
+	cond  *sync.Cond
+	state relayState
+	err   error
+	// Set once the agent has forwarded its last bytes to the server, after
+	// which the client's output goes to the server directly.
+	transportDrained bool
+	transportErr     error
+	// Set if the session ended before the handoff completed.
+	ended    bool
+	endedErr error
+	// Set once the SSH client closed the relay.
+	closed bool
+
+	// Server traffic since buffering started, which after the handoff is
+	// trimmed to what the agent did not consume and then read by the client,
+	// followed by the rest of the server's traffic.
+	buffered       bytes.Buffer
+	bufferedOffset int
+	serverErr      error
+}
+
+// The server's traffic is buffered after handoff only until the SSH client
+// catches up to this many bytes; the client's channel windows bound it in
+// practice.
+const relayBufferLimit = 256 * 1024
+
+var errRelayClosed = errors.New("relay closed")
+
+func newHandoffRelay(control net.Conn, agentData net.Conn, agentTransport *CustomConn, serverReader io.Reader, serverWriter io.WriteCloser) *handoffRelay {
+	r := &handoffRelay{
+		agentData:      agentData,
+		agentTransport: agentTransport,
+		control:        control,
+		serverReader:   serverReader,
+		serverWriter:   serverWriter,
+		sshOut:         settableWriter{w: agentData},
+	}
+	r.cond = sync.NewCond(&r.mu)
+	return r
+}
+
+// start runs the copy loops; wg is done when all of them have finished.
+func (r *handoffRelay) start(wg *sync.WaitGroup) {
+	wg.Add(2)
+	go func() {
+		defer wg.Done()
+		r.copyFromServer()
+	}()
+	go func() {
+		defer wg.Done()
+		r.copyToServer()
+	}()
+}
+
+// setState moves to state unless the relay already reached a final state.
+func (r *handoffRelay) setState(state relayState, err error) {
+	r.mu.Lock()
+	if r.state < relayPostHandoff {
+		r.state = state
+		r.err = err
+	}
+	r.cond.Broadcast()
+	r.mu.Unlock()
+}
+
+// Read serves the SSH client the agent's side of the session. The agent ends
+// it after its part of the handoff key exchange, and then reports how much of
+// the server's traffic it consumed; the rest is served from the buffer,
+// followed by the server's traffic as it arrives.
+func (r *handoffRelay) Read(p []byte) (int, error) {
+	if !r.agentDrained {
+		n, err := r.agentData.Read(p)
+		if err == nil || n > 0 {
+			// Any error is returned again by the next read.
+			return n, nil
+		}
+		if debugClient {
+			log.Printf("Finished reading ssh data from agent: %s", err)
+		}
+		r.agentDrained = true
+		if err != io.EOF {
+			err = fmt.Errorf("failed to read ssh data from agent: %s", err)
+			r.setState(relayFailed, err)
+			return 0, err
+		}
+		if err = r.completeHandoff(); err != nil {
+			return 0, err
+		}
+	}
+
+	r.mu.Lock()
+	defer r.mu.Unlock()
+	for r.buffered.Len() == 0 && r.serverErr == nil && !r.closed {
+		r.cond.Wait()
+	}
+	if r.buffered.Len() == 0 {
+		if r.closed {
+			return 0, errRelayClosed
+		}
+		return 0, r.serverErr
+	}
+	n, _ := r.buffered.Read(p)
+	r.cond.Broadcast()
+	return n, nil
+}
+
+func (r *handoffRelay) completeHandoff() error {
+	handoffByte, err := getHandoffNextTransportByte(r.control)
+
+	r.mu.Lock()
+	defer r.mu.Unlock()
+	if err == nil {
+		err = syncBufferedTraffic(&r.buffered, r.bufferedOffset, handoffByte)
+	}
+	if err != nil {
+		r.state = relayFailed
+		r.err = err
+		r.cond.Broadcast()
+		return err
+	}
+	if debugClient {
+		log.Printf("Backfilling %d bytes from server to client", r.buffered.Len())
+	}
+	r.state = relayPostHandoff
+	r.cond.Broadcast()
+	r.agentTransport.Close()
+	return nil
+}
+
+// Write sends the SSH client's output to the agent, and once the agent has
+// drained its transport, to the server.
+func (r *handoffRelay) Write(p []byte) (int, error) {
+	return r.sshOut.Write(p)
+}
+
+// Close is called by the SSH client when the session ends.
+func (r *handoffRelay) Close() error {
+	r.sshOut.mu.Lock()
+	if r.sshOut.w != nil {
+		r.sshOut.Close()
+		r.sshOut.w = nil
+	}
+	r.sshOut.mu.Unlock()
+
+	r.mu.Lock()
+	r.closed = true
+	r.cond.Broadcast()
+	r.mu.Unlock()
+	// Unblocks a read still waiting on the agent.
+	return r.agentData.Close()
+}
+
+func (r *handoffRelay) LocalAddr() net.Addr  { return r.agentData.LocalAddr() }
+func (r *handoffRelay) RemoteAddr() net.Addr { return r.agentData.RemoteAddr() }
+
+func (r *handoffRelay) SetDeadline(t time.Time) error {
+	return errors.New("deadlines are not supported on relayed sessions")
+}
+
+func (r *handoffRelay) SetReadDeadline(t time.Time) error  { return r.SetDeadline(t) }
+func (r *handoffRelay) SetWriteDeadline(t time.Time) error { return r.SetDeadline(t) }
+
+// serverDelivery is the destination of the server's traffic; see deliver.
+type serverDelivery handoffRelay
+
+func (d *serverDelivery) Write(p []byte) (int, error) {
+	if err := (*handoffRelay)(d).deliver(p); err != nil {
+		return 0, err
+	}
+	return len(p), nil
+}
+
+func (r *handoffRelay) copyFromServer() {
+	err := copyPooled((*serverDelivery)(r), r.serverReader)
+	if debugClient {
+		log.Printf("Finished copying transport data from server")
+	}
+
+	r.toAgent.Lock()
+	r.mu.Lock()
+	preHandoff := r.state < relayPostHandoff && !r.agentGone
+	if err == nil {
+		r.serverErr = io.EOF
+	} else {
+		r.serverErr = fmt.Errorf("failed to read from server: %s", err)
+	}
+	r.cond.Broadcast()
+	r.mu.Unlock()
+	if preHandoff {
+		r.agentTransport.Close()
+	}
+	r.toAgent.Unlock()
+	if err != nil && err != errRelayClosed && err != os.ErrClosed && err != yamux.ErrStreamClosed && err != errMuxChannelClosed {
+		log.Printf("To agent transport forwarding failed: %s", err)
+	}
+}
+
+// deliver passes on traffic from the server: to the agent before the handoff,
+// and also into the buffer once the handoff key exchange has started; after
+// the handoff, only into the buffer, from which the SSH client reads it.
+func (r *handoffRelay) deliver(p []byte) error {
+	r.toAgent.Lock()
+	defer r.toAgent.Unlock()
+
+	r.mu.Lock()
+	for r.state == relayPostHandoff && r.buffered.Len() >= relayBufferLimit && !r.closed {
+		r.cond.Wait()
+	}
+	state := r.state
+	switch {
+	case r.closed:
+		r.mu.Unlock()
+		return errRelayClosed
+	case state == relayFailed:
+		r.mu.Unlock()
+		return r.err
+	case state >= relayBuffering:
+		r.buffered.Write(p)
+		r.cond.Broadcast()
+	}
+	r.mu.Unlock()
+
+	if state == relayPostHandoff || r.agentGone {
+		return nil
+	}
+	if _, err := r.agentTransport.Write(p); err != nil {
+		if state == relayPreHandoff {
+			err = fmt.Errorf("failed to relay server traffic to agent: %s", err)
+			r.setState(relayFailed, err)
+			return err
+		}
+		// The agent stops reading once it is done with the handoff; the
+		// rest is served from the buffer.
+		r.agentGone = true
+	}
+	return nil
+}
+
+func (r *handoffRelay) copyToServer() {
+	err := copyPooled(r.serverWriter, r.agentTransport)
+	if debugClient {
+		log.Printf("Finished copying transport data from agent")
+	}
+
+	r.sshOut.mu.Lock()
+	if r.sshOut.w != nil {
+		r.sshOut.Close()
+		r.sshOut.w = r.serverWriter
+	} else {
+		if cw, ok := r.serverWriter.(CloseWriter); ok {
+			log.Printf("CloseWrite serverWriter")
+			cw.CloseWrite()
+		} else {
+			log.Printf("Close serverWriter")
+			r.serverWriter.Close()
+		}
+	}
+	r.sshOut.mu.Unlock()
+
+	r.mu.Lock()
+	r.transportDrained = true
+	if err != nil {
+		r.transportErr = fmt.Errorf("failed to copy data from agent to server: %s", err)
+	}
+	r.cond.Broadcast()
+	r.mu.Unlock()
+}
+
+// startBuffering enters relayBuffering; the caller then starts the handoff key
+// exchange.
+func (r *handoffRelay) startBuffering() {
+	r.toAgent.Lock()
+	r.bufferedOffset = r.agentTransport.BytesWritten()
+	r.setState(relayBuffering, nil)
+	r.toAgent.Unlock()
+}
+
+// onKex is the SSH client's key exchange callback. During the handoff key
+// exchange it holds the client back until the agent has sent the server
+// everything it will, since the client's next bytes go to the server directly.
+func (r *handoffRelay) onKex() {
+	if debugClient {
+		log.Printf("KexCallback called")
+	}
+	r.mu.Lock()
+	defer r.mu.Unlock()
+	if r.state != relayBuffering {
+		return
+	}
+	if debugClient {
+		log.Printf("Starting transport rewiring")
+	}
+	for !r.transportDrained {
+		r.cond.Wait()
+	}
+	if r.transportErr != nil && r.state < relayPostHandoff {
+		r.state = relayFailed
+		r.err = r.transportErr
+		r.cond.Broadcast()
+	}
+}
+
+// sessionEnded records that the SSH client finished, possibly before the
+// handoff completed.
+func (r *handoffRelay) sessionEnded(err error) {
+	r.mu.Lock()
+	r.ended = true
+	r.endedErr = err
+	r.cond.Broadcast()
+	r.mu.Unlock()
+}
+
+// waitHandoff waits until the handoff completes or fails, or the session ends
+// first.
+func (r *handoffRelay) waitHandoff() error {
+	r.mu.Lock()
+	defer r.mu.Unlock()
+	for r.state < relayPostHandoff && !r.ended {
+		r.cond.Wait()
+	}
+	switch {
+	case r.state == relayPostHandoff:
+		if debugClient {
+			log.Printf("Handoff Complete (%d goroutines in process)", runtime.NumGoroutine())
+		}
+		return nil
+	case r.state == relayFailed:
+		return r.err
+	default:
+		if debugClient {
+			log.Printf("Command finished before handoff: %s", r.endedErr)
+		}
+		return r.endedErr
+	}
+}
@@ -0,0 +1,289 @@
+package guardianagent
+
+import (
+	"io"
+	"net"
+	"runtime"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"testing"
+	"time"
+
+	"golang.org/x/crypto/ssh"
+)
+
+// testRelay is a handoff relay wired to in-memory peers standing in for the
+// agent and the server. The agent's streams are fixed channels, as in a
+// session, so that the agent can end one with EOF.
+type testRelay struct {
+	relay          *handoffRelay
+	agentData      net.Conn
+	agentTransport net.Conn
+	server         net.Conn
+	control        net.Conn
+
+	clientMux *chanMux
+	agentMux  *chanMux
+}
+
+func newTestRelay() *testRelay {
+	clientEnd, agentEnd := net.Pipe()
+	clientMux, agentMux := newChanMux(clientEnd, nil), newChanMux(agentEnd, nil)
+	serverRelay, server := net.Pipe()
+	return &testRelay{
+		relay: newHandoffRelay(clientMux.Channel(controlChannel), clientMux.Channel(dataChannel),
+			&CustomConn{Conn: clientMux.Channel(transportChannel)}, serverRelay, serverRelay),
+		agentData:      agentMux.Channel(dataChannel),
+		agentTransport: agentMux.Channel(transportChannel),
+		server:         server,
+		control:        agentMux.Channel(controlChannel),
+		clientMux:      clientMux,
+		agentMux:       agentMux,
+	}
+}
+
+func (tr *testRelay) close() {
+	tr.relay.Close()
+	tr.server.Close()
+	tr.clientMux.Close()
+	tr.agentMux.Close()
+}
+
+// expectRelayed writes msg to from and checks that it arrives at to.
+func expectRelayed(t *testing.T, what string, from io.Writer, to io.Reader, msg string) {
+	go from.Write([]byte(msg))
+	got := make([]byte, len(msg))
+	if _, err := io.ReadFull(to, got); err != nil {
+		t.Fatalf("%s: %s", what, err)
+	}
+	if string(got) != msg {
+		t.Errorf("%s: got %q, want %q", what, got, msg)
+	}
+}
+
+func TestHandoffRelayBeforeHandoff(t *testing.T) {
+	tr := newTestRelay()
+	var wg sync.WaitGroup
+	tr.relay.start(&wg)
+
+	expectRelayed(t, "client to agent", tr.relay, tr.agentData, "client hello")
+	expectRelayed(t, "agent to client", tr.agentData, tr.relay, "agent hello")
+	expectRelayed(t, "server to agent", tr.server, tr.agentTransport, "server banner")
+	expectRelayed(t, "agent to server", tr.agentTransport, tr.server, "agent kexinit")
+
+	tr.close()
+	wg.Wait()
+}
+
+// handoff plays the agent's part of the handoff: the relay starts buffering,
+// serverBytes reach the agent during the key exchange, the agent stops
+// writing to the server, which releases the client's key exchange callback,
+// and then the agent ends its data stream and sends reply on the control
+// stream.
+func (tr *testRelay) handoff(t *testing.T, serverBytes string, reply []byte, replyNum byte) {
+	tr.relay.startBuffering()
+	expectRelayed(t, "server to agent while buffering", tr.server, tr.agentTransport, serverBytes)
+
+	kexDone := make(chan struct{})
+	go func() {
+		tr.relay.onKex()
+		close(kexDone)
+	}()
+	tr.agentTransport.Close()
+	select {
+	case <-kexDone:
+	case <-time.After(10 * time.Second):
+		t.Fatal("key exchange callback not released once the agent drained its transport")
+	}
+	go func() {
+		tr.agentData.Close()
+		WriteControlPacket(tr.control, replyNum, reply)
+	}()
+}
+
+func handoffComplete(nextTransportByte int) []byte {
+	return ssh.Marshal(HandoffCompleteMessage{NextTransportByte: uint32(nextTransportByte)})
+}
+
+func TestHandoffRelayBackfill(t *testing.T) {
+	tr := newTestRelay()
+	var wg sync.WaitGroup
+	tr.relay.start(&wg)
+	defer wg.Wait()
+	defer tr.close()
+
+	expectRelayed(t, "server to agent", tr.server, tr.agentTransport, "server banner")
+	offset := len("server banner")
+	// The agent consumed the server's NEWKEYS but not the packet after it,
+	// which is already encrypted for the client.
+	tr.handoff(t, "NEWKEYS|channel data", handoffComplete(offset+len("NEWKEYS|")), MsgHandoffComplete)
+
+	backfill := make([]byte, len("channel data"))
+	if _, err := io.ReadFull(tr.relay, backfill); err != nil || string(backfill) != "channel data" {
+		t.Fatalf("client read %q, %v after the handoff, want the backfilled %q", backfill, err, "channel data")
+	}
+	if err := tr.relay.waitHandoff(); err != nil {
+		t.Fatalf("handoff failed: %s", err)
+	}
+	expectRelayed(t, "server to client after handoff", tr.server, tr.relay, "more output")
+	expectRelayed(t, "client to server after handoff", tr.relay, tr.server, "client input")
+}
+
+func TestHandoffRelaySyncFailure(t *testing.T) {
+	tests := []struct {
+		name     string
+		reply    []byte
+		replyNum byte
+		want     string
+	}{
+		{"beyond the buffered traffic", handoffComplete(1000), MsgHandoffComplete, "unexpected backfill pos"},
+		{"before buffering started", handoffComplete(0), MsgHandoffComplete, "missing bytes to backfill"},
+		{"reported by the agent", ssh.Marshal(HandoffFailedMessage{Msg: "server refused"}), MsgHandoffFailed, "server refused"},
+	}
+	for _, test := range tests {
+		tr := newTestRelay()
+		var wg sync.WaitGroup
+		tr.relay.start(&wg)
+
+		expectRelayed(t, test.name, tr.server, tr.agentTransport, "server banner")
+		tr.handoff(t, "NEWKEYS", test.reply, test.replyNum)
+		if _, err := tr.relay.Read(make([]byte, 16)); err == nil || !strings.Contains(err.Error(), test.want) {
+			t.Errorf("%s: client read failed with %v, want %q", test.name, err, test.want)
+		}
+		if err := tr.relay.waitHandoff(); err == nil || !strings.Contains(err.Error(), test.want) {
+			t.Errorf("%s: handoff ended with %v, want %q", test.name, err, test.want)
+		}
+		tr.close()
+		wg.Wait()
+	}
+}
+
+func TestHandoffRelayBufferLimit(t *testing.T) {
+	tr := newTestRelay()
+	var wg sync.WaitGroup
+	tr.relay.start(&wg)
+	defer wg.Wait()
+	defer tr.close()
+
+	tr.handoff(t, "NEWKEYS", handoffComplete(len("NEWKEYS")), MsgHandoffComplete)
+	// The client's first read completes the handoff.
+	readDone := make(chan error, 1)
+	go func() {
+		_, err := tr.relay.Read(make([]byte, 1))
+		readDone <- err
+	}()
+	if err := tr.relay.waitHandoff(); err != nil {
+		t.Fatalf("handoff failed: %s", err)
+	}
+
+	// With the client not reading, the server is held back once the buffer
+	// reaches the limit.
+	var sent int64
+	output := make([]byte, 4*relayBufferLimit)
+	go func() {
+		for i := 0; i < len(output); i += forwardBufferSize {
+			n, err := tr.server.Write(output[i : i+forwardBufferSize])
+			atomic.AddInt64(&sent, int64(n))
+			if err != nil {
+				return
+			}
+		}
+	}()
+	var buffered int
+	for settled := 0; settled < 5; settled++ {
+		time.Sleep(20 * time.Millisecond)
+		tr.relay.mu.Lock()
+		if tr.relay.buffered.Len() != buffered {
+			settled = 0
+		}
+		buffered = tr.relay.buffered.Len()
+		tr.relay.mu.Unlock()
+	}
+	if buffered < relayBufferLimit || buffered >= relayBufferLimit+forwardBufferSize {
+		t.Errorf("%d bytes buffered for a client that is not reading, want the %d-byte limit", buffered, relayBufferLimit)
+	}
+	if atomic.LoadInt64(&sent) == int64(len(output)) {
+		t.Errorf("server was not held back")
+	}
+
+	// Reading resumes the server's traffic.
+	if err := <-readDone; err != nil {
+		t.Fatal(err)
+	}
+	if _, err := io.ReadFull(tr.relay, make([]byte, len(output)-1)); err != nil {
+		t.Fatal(err)
+	}
+}
+
+// relayedSessions is the number of concurrent sessions in
+// BenchmarkConcurrentRelays.
+const relayedSessions = 1000
+
+// startRelayedSession runs a test relay with the SSH client on its client
+// side and the guard's proxy on the agent's streams, as in a delegated session
+// before handoff; wg is done once all of their goroutines have finished.
+func startRelayedSession(wg *sync.WaitGroup) *testRelay {
+	tr := newTestRelay()
+	tr.relay.start(wg)
+	wg.Add(2)
+	go func() {
+		defer wg.Done()
+		config := &ssh.ClientConfig{
+			Config:                   ssh.Config{KexCallback: tr.relay.onKex},
+			HostKeyCallback:          ssh.InsecureIgnoreHostKey(),
+			DeferHostKeyVerification: true,
+		}
+		conn, _, _, err := ssh.NewClientConn(tr.relay, "server:22", config)
+		if err == nil && conn != nil {
+			conn.Wait()
+		}
+	}()
+	go func() {
+		defer wg.Done()
+		config := &ssh.ClientConfig{User: "user", HostKeyCallback: ssh.InsecureIgnoreHostKey()}
+		proxy, err := ssh.NewProxyConn("server", tr.agentData, tr.agentTransport, config, ssh.NewFilter("true", nil))
+		if err == nil && proxy != nil {
+			<-proxy.Run()
+		}
+	}()
+	return tr
+}
+
+// BenchmarkConcurrentRelays holds relayedSessions sessions open before the
+// handoff, when the relay pumps the most connection ends, and reports the
+// goroutines and memory that each session costs the client and the guard
+// together: the relay, the SSH client waiting for the server, the session's
+// fixed channels on both ends and the guard's proxy.
+func BenchmarkConcurrentRelays(b *testing.B) {
+	var goroutines, heap, stack float64
+	for i := 0; i < b.N; i++ {
+		var before, after runtime.MemStats
+		runtime.GC()
+		runtime.ReadMemStats(&before)
+		goroutinesBefore := runtime.NumGoroutine()
+
+		var wg sync.WaitGroup
+		relays := make([]*testRelay, relayedSessions)
+		for j := range relays {
+			relays[j] = startRelayedSession(&wg)
+		}
+		// Let the handshakes reach the point where they wait for the
+		// server.
+		time.Sleep(100 * time.Millisecond)
+		runtime.GC()
+		runtime.ReadMemStats(&after)
+		perSession := func(a, b uint64) float64 { return float64(int64(a)-int64(b)) / relayedSessions }
+		goroutines += float64(runtime.NumGoroutine()-goroutinesBefore) / relayedSessions
+		heap += perSession(after.HeapInuse, before.HeapInuse)
+		stack += perSession(after.StackInuse, before.StackInuse)
+
+		for _, tr := range relays {
+			tr.close()
+		}
+		wg.Wait()
+	}
+	b.ReportMetric(goroutines/float64(b.N), "goroutines/session")
+	b.ReportMetric(heap/float64(b.N), "heap-bytes/session")
+	b.ReportMetric(stack/float64(b.N), "stack-bytes/session")
+}
@@ -0,0 +1,312 @@
+package guardianagent
+
+import (
+	"bytes"
+	"encoding/binary"
+	"encoding/json"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"log"
+	"net"
+	"os"
+	"path"
+	"sort"
+	"strings"
+	"sync"
+	"time"
+)
+
+const (
+	msgKexInit = 20
+	// RFC 4253 bounds packets at 35000 bytes; the identification string and
+	// any lines before it are assumed to fit in the rest.
+	maxServerHello = 64 * 1024
+)
+
+// ServerCapabilities is what the guard has observed about a server in earlier
+// sessions.
+type ServerCapabilities struct {
+	// Version is the server's SSH identification string.
+	Version string `json:"Version,omitempty"`
+	// NoMoreSessions is unset until a session either reaches handoff without
+	// the filter falling back (supported) or falls back (not supported).
+	NoMoreSessions *bool `json:"NoMoreSessions,omitempty"`
+	// Algorithms offered in the server's KEXINIT, in its order of preference.
+	KexAlgorithms     []string `json:"KexAlgorithms,omitempty"`
+	HostKeyAlgorithms []string `json:"HostKeyAlgorithms,omitempty"`
+	Ciphers           []string `json:"Ciphers,omitempty"`
+	MACs              []string `json:"MACs,omitempty"`
+
+	Handoffs        int `json:"Handoffs"`
+	HandoffFailures int `json:"HandoffFailures"`
+	// Updated is when NoMoreSessions or the algorithms last changed.
+	Updated time.Time `json:"Updated"`
+}
+
+// serverCapsCache persists ServerCapabilities by server hostname, so that
+// sessions to a server known not to support no-more-sessions can ask for
+// approval of all commands upfront rather than when the filter falls back in
+// the middle of the handshake.
+type serverCapsCache struct {
+	mu      sync.Mutex
+	path    string
+	servers map[string]*ServerCapabilities
+}
+
+func loadServerCaps(path string) *serverCapsCache {
+	cache := &serverCapsCache{path: path, servers: make(map[string]*ServerCapabilities)}
+	data, err := ioutil.ReadFile(path)
+	if err != nil {
+		if !os.IsNotExist(err) {
+			log.Printf("Failed to read server capabilities: %s", err)
+		}
+		return cache
+	}
+	if err = json.Unmarshal(data, &cache.servers); err != nil {
+		log.Printf("Ignoring malformed server capabilities in %s: %s", path, err)
+		cache.servers = make(map[string]*ServerCapabilities)
+	}
+	return cache
+}
+
+// lacksNoMoreSessions reports whether server was seen not to support the
+// no-more-sessions request.
+func (c *serverCapsCache) lacksNoMoreSessions(server string) bool {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	caps, ok := c.servers[server]
+	return ok && caps.NoMoreSessions != nil && !*caps.NoMoreSessions
+}
+
+// record updates server's entry with what a finished session observed. The
+// hello is only taken from sessions that reached handoff, whose server passed
+// the host key check. The cache is saved only when no-more-sessions support or
+// the algorithms change; the handoff counts are saved along with such changes.
+func (c *serverCapsCache) record(server string, hello *serverHello, fellBack bool, handedOff bool) {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	caps, ok := c.servers[server]
+	if !ok {
+		caps = &ServerCapabilities{}
+		c.servers[server] = caps
+	}
+	changed := false
+	if hello != nil && handedOff {
+		caps.Version = hello.version
+		if kexInit := hello.kexInit; kexInit != nil && !(equalStrings(caps.KexAlgorithms, kexInit.kex) &&
+			equalStrings(caps.HostKeyAlgorithms, kexInit.hostKey) &&
+			equalStrings(caps.Ciphers, kexInit.ciphers) &&
+			equalStrings(caps.MACs, kexInit.macs)) {
+			caps.KexAlgorithms = kexInit.kex
+			caps.HostKeyAlgorithms = kexInit.hostKey
+			caps.Ciphers = kexInit.ciphers
+			caps.MACs = kexInit.macs
+			changed = true
+		}
+	}
+	if fellBack || handedOff {
+		supported := !fellBack
+		if caps.NoMoreSessions == nil || *caps.NoMoreSessions != supported {
+			if caps.NoMoreSessions != nil {
+				log.Printf("Server %s no-more-sessions support changed to %t", server, supported)
+			}
+			caps.NoMoreSessions = &supported
+			changed = true
+		}
+	}
+	if handedOff {
+		caps.Handoffs++
+	} else {
+		caps.HandoffFailures++
+	}
+	if !changed {
+		return
+	}
+	caps.Updated = time.Now()
+	if err := c.saveLocked(); err != nil {
+		log.Printf("Failed to save server capabilities: %s", err)
+	}
+}
+
+func equalStrings(a []string, b []string) bool {
+	if len(a) != len(b) {
+		return false
+	}
+	for i := range a {
+		if a[i] != b[i] {
+			return false
+		}
+	}
+	return true
+}
+
+func (c *serverCapsCache) writeDiagnostics(w io.Writer) {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	servers := make([]string, 0, len(c.servers))
+	for server := range c.servers {
+		servers = append(servers, server)
+	}
+	sort.Strings(servers)
+	for _, server := range servers {
+		caps := c.servers[server]
+		noMoreSessions := "unknown"
+		if caps.NoMoreSessions != nil {
+			noMoreSessions = fmt.Sprint(*caps.NoMoreSessions)
+		}
+		fmt.Fprintf(w, "Server %s (%s): no-more-sessions %s, %d handoffs, %d failed\n",
+			server, caps.Version, noMoreSessions, caps.Handoffs, caps.HandoffFailures)
+	}
+}
+
+// saveLocked writes the cache, after merging in the entries a guard draining
+// after a handover, or its successor, saved meanwhile: for each server the
+// most recently updated entry wins.
+func (c *serverCapsCache) saveLocked() error {
+	unlock, err := lockFile(c.path + ".lock")
+	if err != nil {
+		return err
+	}
+	defer unlock()
+	saved := make(map[string]*ServerCapabilities)
+	if data, err := ioutil.ReadFile(c.path); err == nil && json.Unmarshal(data, &saved) == nil {
+		for server, caps := range saved {
+			if current, ok := c.servers[server]; !ok || caps.Updated.After(current.Updated) {
+				c.servers[server] = caps
+			}
+		}
+	}
+
+	data, err := json.Marshal(c.servers)
+	if err != nil {
+		return err
+	}
+	tmp, err := ioutil.TempFile(path.Dir(c.path), path.Base(c.path))
+	if err != nil {
+		return err
+	}
+	_, err = tmp.Write(data)
+	if closeErr := tmp.Close(); err == nil {
+		err = closeErr
+	}
+	if err == nil {
+		err = os.Rename(tmp.Name(), c.path)
+	}
+	if err != nil {
+		os.Remove(tmp.Name())
+	}
+	return err
+}
+
+// kexInitLists are the algorithm name-lists of a KEXINIT message. The
+// server-to-client lists are ignored; servers offer the same in both
+// directions in practice.
+type kexInitLists struct {
+	kex     []string
+	hostKey []string
+	ciphers []string
+	macs    []string
+}
+
+// serverHello is the plaintext start of the server's side of a connection.
+type serverHello struct {
+	version string
+	kexInit *kexInitLists
+}
+
+// serverHelloSniffer records the start of what is read from the server, up to
+// its first KEXINIT, which is sent before any encryption is negotiated.
+type serverHelloSniffer struct {
+	net.Conn
+
+	mu    sync.Mutex
+	buf   []byte
+	hello *serverHello
+	done  bool
+}
+
+func (s *serverHelloSniffer) Read(p []byte) (int, error) {
+	n, err := s.Conn.Read(p)
+	if n > 0 {
+		s.mu.Lock()
+		if !s.done {
+			s.buf = append(s.buf, p[:n]...)
+			s.hello, s.done = parseServerHello(s.buf)
+			if s.done || len(s.buf) >= maxServerHello {
+				s.done = true
+				s.buf = nil
+			}
+		}
+		s.mu.Unlock()
+	}
+	return n, err
+}
+
+// result returns what was parsed, or nil if the identification string was not
+// seen.
+func (s *serverHelloSniffer) result() *serverHello {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	return s.hello
+}
+
+// parseServerHello parses the identification string and first packet in data.
+// complete is false while more data is needed.
+func parseServerHello(data []byte) (hello *serverHello, complete bool) {
+	off := 0
+	for {
+		eol := bytes.IndexByte(data[off:], '\n')
+		if eol < 0 {
+			return nil, false
+		}
+		line := strings.TrimRight(string(data[off:off+eol]), "\r")
+		off += eol + 1
+		if strings.HasPrefix(line, "SSH-") {
+			hello = &serverHello{version: line}
+			break
+		}
+	}
+
+	if len(data)-off < 5 {
+		return hello, false
+	}
+	length := int(binary.BigEndian.Uint32(data[off:]))
+	if length > maxServerHello {
+		return hello, true
+	}
+	if len(data)-off-4 < length {
+		return hello, false
+	}
+	padding := int(data[off+4])
+	if padding+1 > length {
+		return hello, true
+	}
+	payload := data[off+5 : off+4+length-padding]
+	// Message number and 16-byte cookie.
+	if len(payload) < 17 || payload[0] != msgKexInit {
+		return hello, true
+	}
+	payload = payload[17:]
+	var lists [6][]string
+	for i := range lists {
+		if len(payload) < 4 {
+			return hello, true
+		}
+		n := int(binary.BigEndian.Uint32(payload))
+		if len(payload)-4 < n {
+			return hello, true
+		}
+		if n > 0 {
+			lists[i] = strings.Split(string(payload[4:4+n]), ",")
+		}
+		payload = payload[4+n:]
+	}
+	hello.kexInit = &kexInitLists{
+		kex:     lists[0],
+		hostKey: lists[1],
+		ciphers: lists[2],
+		macs:    lists[4],
+	}
+	return hello, true
+}
@@ -0,0 +1,71 @@
+package guardianagent
+
+import (
+	"io/ioutil"
+	"os"
+	"path"
+	"testing"
+)
+
+func TestServerCapsMergedBetweenGenerations(t *testing.T) {
+	dir, err := ioutil.TempDir("", "sga-servers")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(dir)
+	capsPath := path.Join(dir, "sga_policy.servers")
+
+	// A draining guard and its successor, both loaded before either saved.
+	draining, successor := loadServerCaps(capsPath), loadServerCaps(capsPath)
+	successor.record("new.example.com", nil, true, false)
+	draining.record("old.example.com", nil, false, true)
+
+	loaded := loadServerCaps(capsPath)
+	if !loaded.lacksNoMoreSessions("new.example.com") {
+		t.Errorf("successor's entry lost")
+	}
+	if _, ok := loaded.servers["old.example.com"]; !ok {
+		t.Errorf("draining guard's entry lost")
+	}
+}
+
+func TestServerCapsSavedOnlyOnChange(t *testing.T) {
+	dir, err := ioutil.TempDir("", "sga-servers")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(dir)
+	capsPath := path.Join(dir, "sga_policy.servers")
+	saved := func() bool {
+		_, err := os.Stat(capsPath)
+		return err == nil
+	}
+
+	cache := loadServerCaps(capsPath)
+	hello := &serverHello{version: "SSH-2.0-OpenSSH_9.6", kexInit: &kexInitLists{kex: []string{"curve25519-sha256"}}}
+	cache.record("example.com", hello, false, true)
+	if !saved() {
+		t.Fatalf("first handoff not saved")
+	}
+
+	os.Remove(capsPath)
+	cache.record("example.com", hello, false, true)
+	if saved() {
+		t.Errorf("saved although nothing changed")
+	}
+
+	// Not handed off, so the hello is not taken.
+	other := &serverHello{version: "SSH-2.0-Other", kexInit: &kexInitLists{kex: []string{"diffie-hellman-group14-sha256"}}}
+	cache.record("example.com", other, false, false)
+	if caps := cache.servers["example.com"]; saved() || caps.Version != hello.version || caps.KexAlgorithms[0] != "curve25519-sha256" {
+		t.Errorf("hello of a failed session recorded: %+v", caps)
+	}
+
+	cache.record("example.com", hello, true, false)
+	if !saved() {
+		t.Errorf("change in no-more-sessions support not saved")
+	}
+	if caps := loadServerCaps(capsPath).servers["example.com"]; caps == nil || caps.Handoffs != 2 || caps.HandoffFailures != 2 {
+		t.Errorf("handoff counts not saved with the change: %+v", caps)
+	}
+}
@@ -2,6 +2,7 @@ package guardianagent
 
 import (
 	"bufio"
+	"hash/fnv"
 	"io"
 	"log"
 	"math/rand"
@@ -9,6 +10,7 @@ import (
 	"os/exec"
 	"path"
 	"syscall"
+	"time"
 
 	"golang.org/x/crypto/ssh"
 
@@ -29,15 +31,68 @@ type SSHFwd struct {
 	Host               string
 	RemoteReadableName string
 	RemoteStubName     string
+	// An existing ControlMaster for Host is always reused. Otherwise the guard
+	// starts its own master, which exits with the guard unless ControlPersist
+	// is set: then it is left running for that long (in ssh_config
+	// ControlPersist syntax) so that restarts can reuse it.
+	ControlPersist string
+	// PrePublish, if set, is called once the forward is established but before
+	// the stub publishes the socket to clients on the remote host.
+	PrePublish func() error
 
 	localSocket  string
 	remoteSocket string
 	listener     net.Listener
+	ownsMaster   bool
+
+	// Kept after handing over, to pass on to later generations.
+	listenerFile *os.File
+	// Closed when the guard that started this one asks it to drain.
+	drainRequested chan struct{}
+
+	// The stub exits, removing the forwarded socket, once its stdin closes, so
+	// both of its pipes are kept to be passed on a handover.
+	stubStdin  io.WriteCloser
+	stubStdout io.ReadCloser
+}
+
+func (fwd *SSHFwd) masterRunning(controlArgs []string) bool {
+	args := append(append(append([]string{}, fwd.SSHArgs...), controlArgs...), "-O", "check", fwd.Host)
+	return exec.Command(fwd.SSHProgram, args...).Run() == nil
+}
+
+// controlMaster picks the control socket to run the stub and the forward over.
+// controlArgs select it on every ssh invocation; masterArgs are only added when
+// starting the stub, to create the master if it does not exist yet.
+func (fwd *SSHFwd) controlMaster() (controlArgs []string, masterArgs []string, reused bool) {
+	// A master the user already has open per their ssh_config.
+	if fwd.masterRunning(nil) {
+		return nil, nil, true
+	}
+	if fwd.ControlPersist == "" {
+		fwd.ownsMaster = true
+		return []string{"-S", path.Join(UserTempDir(), strconv.Itoa(int(rand.Int31())))}, []string{"-M"}, false
+	}
+	// Our own persistent master, named after the destination and arguments.
+	h := fnv.New64a()
+	h.Write([]byte(fwd.Host))
+	for _, arg := range fwd.SSHArgs {
+		h.Write([]byte{0})
+		h.Write([]byte(arg))
+	}
+	controlArgs = []string{"-S", path.Join(UserRuntimeDir(), fmt.Sprintf(".sga-master-%x", h.Sum64()))}
+	if fwd.masterRunning(controlArgs) {
+		return controlArgs, nil, true
+	}
+	return controlArgs, []string{"-o", "ControlMaster=auto", "-o", "ControlPersist=" + fwd.ControlPersist}, false
 }
 
 func (fwd *SSHFwd) SetupForwarding() error {
-	fwd.SSHArgs = append(fwd.SSHArgs, "-S", path.Join(UserTempDir(), strconv.Itoa(int(rand.Int31()))), fwd.Host)
-	remoteStub := exec.Command(fwd.SSHProgram, append(fwd.SSHArgs, "-M", fwd.RemoteStubName)...)
+	start := time.Now()
+	controlArgs, masterArgs, reused := fwd.controlMaster()
+	fwd.SSHArgs = append(append(fwd.SSHArgs, controlArgs...), fwd.Host)
+	stubArgs := append(append(append([]string{}, fwd.SSHArgs...), masterArgs...), fwd.RemoteStubName)
+	remoteStub := exec.Command(fwd.SSHProgram, stubArgs...)
 	remoteStdErr, err := remoteStub.StderrPipe()
 	if err != nil {
 		return fmt.Errorf("Failed to get ssh stderr: %s", err)
@@ -92,6 +147,8 @@ func (fwd *SSHFwd) SetupForwarding() error {
 	fwd.localSocket = bindAddr
 	fwd.remoteSocket = string(remoteSocket)
 	fwd.listener = listener
+	fwd.stubStdin = remoteStdIn
+	fwd.stubStdout = remoteStdOut
 
 	go func() {
 		err = remoteStub.Wait()
@@ -110,6 +167,12 @@ func (fwd *SSHFwd) SetupForwarding() error {
 		return fmt.Errorf("Failed to run SSH forwarding: %s\n%s", err, stdErr)
 	}
 
+	if fwd.PrePublish != nil {
+		if err = fwd.PrePublish(); err != nil {
+			return err
+		}
+	}
+
 	_, err = fmt.Fprintln(remoteStdIn, "start")
 	if err != nil {
 		return fmt.Errorf("Failed to ack forwarding: %s", err)
@@ -119,6 +182,7 @@ func (fwd *SSHFwd) SetupForwarding() error {
 		allErr, _ := ioutil.ReadAll(remoteStdErr)
 		return fmt.Errorf("Failed to establish ssh forwarding with stub: %s\n%s", err, allErr)
 	}
+	log.Printf("Forwarding setup took %s (reused control master: %v)", time.Since(start), reused)
 	return nil
 }
 
@@ -173,7 +237,14 @@ func (fwd *SSHFwd) Accept() (net.Conn, error) {
 }
 
 func (fwd *SSHFwd) Close() {
-	child := exec.Command(fwd.SSHProgram, append(fwd.SSHArgs, "-O exit")...)
+	var child *exec.Cmd
+	if fwd.ownsMaster {
+		child = exec.Command(fwd.SSHProgram, append(fwd.SSHArgs, "-O exit")...)
+	} else {
+		// Leave the shared master running, only remove our forward from it.
+		child = exec.Command(fwd.SSHProgram, append(fwd.SSHArgs, "-O", "cancel",
+			fmt.Sprintf("-R %s:%s", fwd.remoteSocket, fwd.localSocket))...)
+	}
 	child.Run()
 	os.Remove(fwd.localSocket)
 	fwd.listener.Close()
@@ -0,0 +1,51 @@
+package guardianagent
+
+import (
+	"flag"
+	"os/exec"
+	"testing"
+)
+
+// BenchmarkSetupForwarding measures forwarding setup against a real host,
+// e.g. -setup-host=user@intermediary, which needs sga-stub installed and
+// non-interactive authentication. It compares starting a fresh master for
+// every setup with reusing a persistent one.
+var (
+	setupHost = flag.String("setup-host", "", "ssh destination for BenchmarkSetupForwarding")
+	setupStub = flag.String("setup-stub", "sga-stub", "remote stub command for BenchmarkSetupForwarding")
+)
+
+func setupForwarding(b *testing.B, controlPersist string) *SSHFwd {
+	fwd := &SSHFwd{
+		SSHProgram:     "ssh",
+		Host:           *setupHost,
+		RemoteStubName: *setupStub,
+		ControlPersist: controlPersist,
+	}
+	if err := fwd.SetupForwarding(); err != nil {
+		b.Fatal(err)
+	}
+	fwd.Close()
+	fwd.stubStdin.Close()
+	return fwd
+}
+
+func BenchmarkSetupForwarding(b *testing.B) {
+	if *setupHost == "" {
+		b.Skip("set -setup-host to an ssh destination with sga-stub installed")
+	}
+	b.Run("fresh-master", func(b *testing.B) {
+		for i := 0; i < b.N; i++ {
+			setupForwarding(b, "")
+		}
+	})
+	b.Run("reused-master", func(b *testing.B) {
+		// The first setup starts the persistent master.
+		fwd := setupForwarding(b, "1m")
+		defer exec.Command(fwd.SSHProgram, append(fwd.SSHArgs, "-O", "exit")...).Run()
+		b.ResetTimer()
+		for i := 0; i < b.N; i++ {
+			setupForwarding(b, "1m")
+		}
+	})
+}
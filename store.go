@@ -1,20 +1,61 @@
 package guardianagent
 
 import (
+	"crypto/sha256"
+	"encoding/hex"
 	"encoding/json"
+	"fmt"
+	"io/ioutil"
 	"os"
+	"path"
+	"sort"
+	"strings"
 	"sync"
+	"time"
 )
 
+// Approved commands are indexed by a digest of their text, so that lookups and
+// the policy file do not grow with the length of the command. The full text is
+// appended to a separate command log next to the policy file, which is only
+// written, for display and audit.
+type commandDigest [sha256.Size]byte
+
+func digestCommand(cmd string) commandDigest {
+	return sha256.Sum256([]byte(strings.TrimSpace(cmd)))
+}
+
 type Store struct {
 	mutex sync.RWMutex
-	rules map[Scope]AllowedCommands
+	rules map[Scope]*scopeRules
 	path  string
+
+	// Set when the loaded file still had full command texts.
+	migrated bool
 }
 
+type scopeRules struct {
+	allCommands bool
+	commands    map[commandDigest]struct{}
+	subsystems  []string
+	// Forwarding targets are advisory: the intermediary opens them after
+	// handoff, so only it can honor the rule.
+	advisoryForwards []string
+}
+
+func newScopeRules() *scopeRules {
+	return &scopeRules{commands: make(map[commandDigest]struct{})}
+}
+
+// AllowedCommands is the stored form of a scope's rules. Commands holds full
+// command texts as written by older versions; they are moved to the command
+// log and replaced by CommandDigests on the next save.
 type AllowedCommands struct {
-	AllCommands bool     `json:"AllCommands"`
-	Commands    []string `json:"Commands"`
+	AllCommands    bool     `json:"AllCommands"`
+	Commands       []string `json:"Commands"`
+	CommandDigests []string `json:"CommandDigests,omitempty"`
+	Subsystems     []string `json:"Subsystems,omitempty"`
+	// AdvisoryForwards are not enforced by the guard; see scopeRules.
+	AdvisoryForwards []string `json:"AdvisoryForwards,omitempty"`
 }
 
 type storageEntry struct {
@@ -22,12 +63,22 @@ type storageEntry struct {
 	PolicyRule  AllowedCommands `json:"AllowedCommands"`
 }
 
+type commandLogEntry struct {
+	Scope   Scope     `json:"Scope"`
+	Digest  string    `json:"Digest"`
+	Command string    `json:"Command"`
+	Time    time.Time `json:"Time"`
+}
+
 func NewStore(configPath string) (store *Store, err error) {
 	store = &Store{
 		path:  configPath,
-		rules: make(map[Scope]AllowedCommands),
+		rules: make(map[Scope]*scopeRules),
 	}
 	err = store.load()
+	if err == nil && store.migrated {
+		err = store.Save()
+	}
 
 	return store, err
 }
@@ -50,26 +101,115 @@ func (store *Store) load() (err error) {
 	return nil
 }
 
-func (store *Store) Save() (err error) {
-	file, err := os.OpenFile(store.path, os.O_WRONLY|os.O_CREATE, 0600)
+// Save writes the policy to a temporary file in the same directory, syncs it
+// and renames it over the policy file, so that a crash or a concurrent save
+// never leaves a truncated policy behind. A guard draining after a handover
+// saves to the same file as its successor, so the rules already in the file
+// are first merged into the store, under a lock held across the save.
+func (store *Store) Save() error {
+	unlock, err := lockFile(store.lockPath())
 	if err != nil {
 		return err
 	}
-	defer file.Close()
+	defer unlock()
+	saved := &Store{path: store.path, rules: make(map[Scope]*scopeRules)}
+	if err = saved.load(); err != nil {
+		return err
+	}
 
-	enc := json.NewEncoder(file)
 	store.mutex.Lock()
 	defer store.mutex.Unlock()
-	if err := enc.Encode(store); err != nil {
+	store.mergeLocked(saved)
+
+	tmp, err := ioutil.TempFile(path.Dir(store.path), path.Base(store.path))
+	if err != nil {
 		return err
 	}
+	err = json.NewEncoder(tmp).Encode(store)
+	if err == nil {
+		err = tmp.Sync()
+	}
+	if closeErr := tmp.Close(); err == nil {
+		err = closeErr
+	}
+	if err == nil {
+		err = os.Rename(tmp.Name(), store.path)
+	}
+	if err != nil {
+		os.Remove(tmp.Name())
+	}
+	return err
+}
+
+// mergeLocked adds other's rules to the store. Rules are only ever added, so
+// the union loses nothing either generation approved. The caller must hold
+// the write lock.
+func (store *Store) mergeLocked(other *Store) {
+	for scope, otherRules := range other.rules {
+		rules := store.rulesLocked(scope)
+		rules.allCommands = rules.allCommands || otherRules.allCommands
+		for digest := range otherRules.commands {
+			rules.commands[digest] = struct{}{}
+		}
+		for _, subsystem := range otherRules.subsystems {
+			if !containsString(rules.subsystems, subsystem) {
+				rules.subsystems = append(rules.subsystems, subsystem)
+			}
+		}
+		for _, target := range otherRules.advisoryForwards {
+			if !containsString(rules.advisoryForwards, target) {
+				rules.advisoryForwards = append(rules.advisoryForwards, target)
+			}
+		}
+	}
+}
+
+func (store *Store) logPath() string {
+	return store.path + ".commands"
+}
+
+func (store *Store) lockPath() string {
+	return store.path + ".lock"
+}
+
+// logCommands appends the full text of newly approved commands to the command
+// log.
+func (store *Store) logCommands(scope Scope, cmds []string) error {
+	file, err := os.OpenFile(store.logPath(), os.O_WRONLY|os.O_CREATE|os.O_APPEND, 0600)
+	if err != nil {
+		return err
+	}
+	defer file.Close()
+
+	enc := json.NewEncoder(file)
+	now := time.Now()
+	for _, cmd := range cmds {
+		digest := digestCommand(cmd)
+		entry := commandLogEntry{Scope: scope, Digest: hex.EncodeToString(digest[:]), Command: cmd, Time: now}
+		if err := enc.Encode(entry); err != nil {
+			return err
+		}
+	}
 	return nil
 }
 
 func (store *Store) MarshalJSON() ([]byte, error) {
 	ps := []storageEntry{}
 	for k, v := range store.rules {
-		ps = append(ps, storageEntry{PolicyScope: k, PolicyRule: v})
+		digests := make([]string, 0, len(v.commands))
+		for digest := range v.commands {
+			digests = append(digests, hex.EncodeToString(digest[:]))
+		}
+		sort.Strings(digests)
+		ps = append(ps, storageEntry{
+			PolicyScope: k,
+			PolicyRule: AllowedCommands{
+				AllCommands:      v.allCommands,
+				Commands:         []string{},
+				CommandDigests:   digests,
+				Subsystems:       v.subsystems,
+				AdvisoryForwards: v.advisoryForwards,
+			}})
 	}
 	val, err := json.Marshal(ps)
 
@@ -87,60 +227,129 @@ func (store *Store) UnmarshalJSON(b []byte) error {
 		return err
 	}
 	for _, v := range tmpStore {
-		store.rules[v.PolicyScope] = v.PolicyRule
+		rules := newScopeRules()
+		rules.allCommands = v.PolicyRule.AllCommands
+		rules.subsystems = v.PolicyRule.Subsystems
+		rules.advisoryForwards = v.PolicyRule.AdvisoryForwards
+		for _, digestStr := range v.PolicyRule.CommandDigests {
+			var digest commandDigest
+			raw, err := hex.DecodeString(digestStr)
+			if err != nil || len(raw) != len(digest) {
+				return fmt.Errorf("invalid command digest: %s", digestStr)
+			}
+			copy(digest[:], raw)
+			rules.commands[digest] = struct{}{}
+		}
+		if len(v.PolicyRule.Commands) > 0 {
+			if err := store.logCommands(v.PolicyScope, v.PolicyRule.Commands); err != nil {
+				return fmt.Errorf("failed to migrate commands to %s: %s", store.logPath(), err)
+			}
+			for _, cmd := range v.PolicyRule.Commands {
+				rules.commands[digestCommand(cmd)] = struct{}{}
+			}
+			store.migrated = true
+		}
+		store.rules[v.PolicyScope] = rules
 	}
 
 	return nil
 }
 
-func (store *Store) AllowAll(scope Scope) (err error) {
-	store.mutex.RLock()
-	allowed, ok := store.rules[scope]
+// rulesLocked returns the rules for scope, creating them if needed. The caller
+// must hold the write lock.
+func (store *Store) rulesLocked(scope Scope) *scopeRules {
+	rules, ok := store.rules[scope]
 	if !ok {
-		allowed = AllowedCommands{
-			AllCommands: false,
-			Commands:    []string{}}
+		rules = newScopeRules()
+		store.rules[scope] = rules
 	}
-	allowed.AllCommands = true
-	store.rules[scope] = allowed
-	store.mutex.RUnlock()
+	return rules
+}
+
+func (store *Store) AllowAll(scope Scope) (err error) {
+	store.mutex.Lock()
+	store.rulesLocked(scope).allCommands = true
+	store.mutex.Unlock()
 
 	return store.Save()
 }
 
 func (store *Store) AllowCommand(scope Scope, cmd string) (err error) {
+	digest := digestCommand(cmd)
 	store.mutex.Lock()
-	allowed, ok := store.rules[scope]
-	if !ok {
-		allowed = AllowedCommands{
-			AllCommands: false,
-			Commands:    []string{}}
+	rules := store.rulesLocked(scope)
+	if _, ok := rules.commands[digest]; ok {
+		store.mutex.Unlock()
+		return
 	}
-	for _, command := range allowed.Commands {
-		if cmd == command {
+	rules.commands[digest] = struct{}{}
+	store.mutex.Unlock()
+
+	if err = store.logCommands(scope, []string{cmd}); err != nil {
+		return err
+	}
+	return store.Save()
+}
+
+func (store *Store) AllowSubsystem(scope Scope, subsystem string) (err error) {
+	store.mutex.Lock()
+	rules := store.rulesLocked(scope)
+	for _, name := range rules.subsystems {
+		if subsystem == name {
+			store.mutex.Unlock()
 			return
 		}
 	}
-	allowed.Commands = append(allowed.Commands, cmd)
-	store.rules[scope] = allowed
+	rules.subsystems = append(rules.subsystems, subsystem)
+	store.mutex.Unlock()
+
+	return store.Save()
+}
+
+// AllowAdvisoryForwards records that the user allowed forwarding to targets.
+// The guard cannot enforce it, since the forwards are opened after handoff.
+func (store *Store) AllowAdvisoryForwards(scope Scope, targets []string) (err error) {
+	store.mutex.Lock()
+	rules := store.rulesLocked(scope)
+	for _, target := range targets {
+		if !containsString(rules.advisoryForwards, target) {
+			rules.advisoryForwards = append(rules.advisoryForwards, target)
+		}
+	}
 	store.mutex.Unlock()
 
 	return store.Save()
 }
 
 func (store *Store) IsAllowed(scope Scope, cmd string) bool {
+	digest := digestCommand(cmd)
 	store.mutex.RLock()
 	defer store.mutex.RUnlock()
-	allowed, ok := store.rules[scope]
+	rules, ok := store.rules[scope]
 	if !ok {
 		return false
 	}
 
-	if allowed.AllCommands {
+	if rules.allCommands {
 		return true
 	}
-	for _, storedCommand := range allowed.Commands {
-		if cmd == storedCommand {
+	_, ok = rules.commands[digest]
+	return ok
+}
+
+func (store *Store) IsSubsystemAllowed(scope Scope, subsystem string) bool {
+	store.mutex.RLock()
+	defer store.mutex.RUnlock()
+	rules, ok := store.rules[scope]
+	if !ok {
+		return false
+	}
+
+	if rules.allCommands {
+		return true
+	}
+	for _, name := range rules.subsystems {
+		if subsystem == name {
 			return true
 		}
 	}
@@ -150,10 +359,40 @@ func (store *Store) IsAllowed(scope Scope, cmd string) bool {
 func (store *Store) AreAllAllowed(scope Scope) bool {
 	store.mutex.RLock()
 	defer store.mutex.RUnlock()
-	allowed, ok := store.rules[scope]
+	rules, ok := store.rules[scope]
+	if !ok {
+		return false
+	}
+
+	return rules.allCommands
+}
+
+// AreAdvisoryForwardsAllowed reports whether direct-tcpip channels to all of
+// targets were allowed. DynamicForwardTarget is only allowed by itself.
+func (store *Store) AreAdvisoryForwardsAllowed(scope Scope, targets []string) bool {
+	store.mutex.RLock()
+	defer store.mutex.RUnlock()
+	rules, ok := store.rules[scope]
 	if !ok {
 		return false
 	}
 
-	return allowed.AllCommands
+	if rules.allCommands {
+		return true
+	}
+	for _, target := range targets {
+		if !containsString(rules.advisoryForwards, target) {
+			return false
+		}
+	}
+	return true
+}
+
+func containsString(list []string, s string) bool {
+	for _, item := range list {
+		if item == s {
+			return true
+		}
+	}
+	return false
 }
@@ -0,0 +1,206 @@
+package guardianagent
+
+import (
+	"fmt"
+	"io/ioutil"
+	"os"
+	"path"
+	"strings"
+	"sync"
+	"testing"
+)
+
+var benchScope = Scope{Client: "intermediary", ServiceUsername: "user", ServiceHostname: "server"}
+
+func newTestStore(t testing.TB) (store *Store, cleanup func()) {
+	dir, err := ioutil.TempDir("", "sga-store")
+	if err != nil {
+		t.Fatal(err)
+	}
+	store, err = NewStore(path.Join(dir, "sga_policy"))
+	if err != nil {
+		os.RemoveAll(dir)
+		t.Fatal(err)
+	}
+	return store, func() { os.RemoveAll(dir) }
+}
+
+// fillStore approves n distinct commands for benchScope without saving.
+func fillStore(store *Store, n int) {
+	store.mutex.Lock()
+	defer store.mutex.Unlock()
+	rules := store.rulesLocked(benchScope)
+	for i := 0; i < n; i++ {
+		rules.commands[digestCommand(fmt.Sprintf("git push origin branch-%d", i))] = struct{}{}
+	}
+}
+
+var ruleCounts = []int{10, 1000, 100000}
+
+func BenchmarkStoreIsAllowed(b *testing.B) {
+	for _, n := range ruleCounts {
+		b.Run(fmt.Sprintf("rules=%d", n), func(b *testing.B) {
+			store, cleanup := newTestStore(b)
+			defer cleanup()
+			fillStore(store, n)
+			b.ReportAllocs()
+			b.ResetTimer()
+			for i := 0; i < b.N; i++ {
+				store.IsAllowed(benchScope, "git push origin branch-1")
+			}
+		})
+	}
+}
+
+func BenchmarkStoreAllowCommand(b *testing.B) {
+	for _, n := range ruleCounts {
+		b.Run(fmt.Sprintf("rules=%d", n), func(b *testing.B) {
+			store, cleanup := newTestStore(b)
+			defer cleanup()
+			fillStore(store, n)
+			b.ReportAllocs()
+			b.ResetTimer()
+			for i := 0; i < b.N; i++ {
+				if err := store.AllowCommand(benchScope, fmt.Sprintf("git pull origin branch-%d", i)); err != nil {
+					b.Fatal(err)
+				}
+			}
+		})
+	}
+}
+
+func BenchmarkStoreLoadSave(b *testing.B) {
+	for _, n := range ruleCounts {
+		b.Run(fmt.Sprintf("rules=%d", n), func(b *testing.B) {
+			store, cleanup := newTestStore(b)
+			defer cleanup()
+			fillStore(store, n)
+			b.ReportAllocs()
+			b.ResetTimer()
+			for i := 0; i < b.N; i++ {
+				if err := store.Save(); err != nil {
+					b.Fatal(err)
+				}
+				if _, err := NewStore(store.path); err != nil {
+					b.Fatal(err)
+				}
+			}
+		})
+	}
+}
+
+// commandLengths are the lengths of the commands in the long-command
+// benchmarks, from a typical command line to a script passed inline.
+var commandLengths = []int{64, 4096, 16384}
+
+func longCommand(i int, length int) string {
+	cmd := fmt.Sprintf("bash -c 'script %d; ", i)
+	return cmd + strings.Repeat("x", length-len(cmd)-1) + "'"
+}
+
+// fileBytes returns the size of the file at path, or 0 if it does not exist.
+func fileBytes(b *testing.B, path string) int64 {
+	fi, err := os.Stat(path)
+	if os.IsNotExist(err) {
+		return 0
+	}
+	if err != nil {
+		b.Fatal(err)
+	}
+	return fi.Size()
+}
+
+// BenchmarkStoreLongCommand checks long commands against 1000 rules and
+// approves them, reporting what each approved rule costs on disk: only its
+// digest in the policy file, and its full text in the command log.
+func BenchmarkStoreLongCommand(b *testing.B) {
+	for _, length := range commandLengths {
+		b.Run(fmt.Sprintf("IsAllowed/len=%d", length), func(b *testing.B) {
+			store, cleanup := newTestStore(b)
+			defer cleanup()
+			fillStore(store, 1000)
+			cmd := longCommand(0, length)
+			b.SetBytes(int64(length))
+			b.ReportAllocs()
+			b.ResetTimer()
+			for i := 0; i < b.N; i++ {
+				store.IsAllowed(benchScope, cmd)
+			}
+		})
+		b.Run(fmt.Sprintf("AllowCommand/len=%d", length), func(b *testing.B) {
+			store, cleanup := newTestStore(b)
+			defer cleanup()
+			fillStore(store, 1000)
+			if err := store.Save(); err != nil {
+				b.Fatal(err)
+			}
+			policyBytes := fileBytes(b, store.path)
+			b.SetBytes(int64(length))
+			b.ReportAllocs()
+			b.ResetTimer()
+			for i := 0; i < b.N; i++ {
+				if err := store.AllowCommand(benchScope, longCommand(i, length)); err != nil {
+					b.Fatal(err)
+				}
+			}
+			b.StopTimer()
+			b.ReportMetric(float64(fileBytes(b, store.path)-policyBytes)/float64(b.N), "policy-bytes/rule")
+			b.ReportMetric(float64(fileBytes(b, store.logPath()))/float64(b.N), "log-bytes/rule")
+		})
+	}
+}
+
+func TestStoreRoundTrip(t *testing.T) {
+	store, cleanup := newTestStore(t)
+	defer cleanup()
+	if err := store.AllowCommand(benchScope, "  git push  "); err != nil {
+		t.Fatal(err)
+	}
+	loaded, err := NewStore(store.path)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if !loaded.IsAllowed(benchScope, "git push") {
+		t.Errorf("approved command not allowed after reload")
+	}
+	if loaded.IsAllowed(benchScope, "git pull") {
+		t.Errorf("unapproved command allowed after reload")
+	}
+}
+
+func TestStoreConcurrentSaves(t *testing.T) {
+	store, cleanup := newTestStore(t)
+	defer cleanup()
+	const saves = 50
+	var wg sync.WaitGroup
+	for i := 0; i < saves; i++ {
+		wg.Add(1)
+		go func(i int) {
+			defer wg.Done()
+			if err := store.AllowCommand(benchScope, fmt.Sprintf("make target-%d", i)); err != nil {
+				t.Error(err)
+			}
+		}(i)
+	}
+	wg.Wait()
+
+	loaded, err := NewStore(store.path)
+	if err != nil {
+		t.Fatalf("policy file unreadable after concurrent saves: %s", err)
+	}
+	for i := 0; i < saves; i++ {
+		if !loaded.IsAllowed(benchScope, fmt.Sprintf("make target-%d", i)) {
+			t.Errorf("command %d lost", i)
+		}
+	}
+	files, err := ioutil.ReadDir(path.Dir(store.path))
+	if err != nil {
+		t.Fatal(err)
+	}
+	for _, fi := range files {
+		if strings.HasPrefix(fi.Name(), path.Base(store.path)) && fi.Name() != path.Base(store.path) &&
+			fi.Name() != path.Base(store.logPath()) && fi.Name() != path.Base(store.lockPath()) {
+			t.Errorf("temporary file %s left behind", fi.Name())
+		}
+	}
+}
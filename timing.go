@@ -0,0 +1,76 @@
+package guardianagent
+
+import (
+	"fmt"
+	"io"
+	"sync"
+	"time"
+)
+
+// sessionTiming measures a session for the report written to
+// SSHCommand.Timing, so that the cost of delegation can be compared with a
+// direct connection and with plain ssh -A on the same command.
+type sessionTiming struct {
+	mu        sync.Mutex
+	path      string
+	start     time.Time
+	startCPU  time.Duration
+	ready     time.Time
+	firstByte time.Time
+	bytes     int64
+}
+
+func newSessionTiming() *sessionTiming {
+	return &sessionTiming{start: time.Now(), startCPU: processCPUTime()}
+}
+
+// sessionReady records that the command is running and, for delegated
+// sessions, handed off.
+func (t *sessionTiming) sessionReady() {
+	t.mu.Lock()
+	t.ready = time.Now()
+	t.mu.Unlock()
+}
+
+// countOutput wraps the session's stdout to time its first byte and count it.
+func (t *sessionTiming) countOutput(r io.Reader) io.Reader {
+	return timedReader{r: r, t: t}
+}
+
+type timedReader struct {
+	r io.Reader
+	t *sessionTiming
+}
+
+func (tr timedReader) Read(p []byte) (int, error) {
+	n, err := tr.r.Read(p)
+	if n > 0 {
+		tr.t.mu.Lock()
+		if tr.t.firstByte.IsZero() {
+			tr.t.firstByte = time.Now()
+		}
+		tr.t.bytes += int64(n)
+		tr.t.mu.Unlock()
+	}
+	return n, err
+}
+
+func (t *sessionTiming) report(w io.Writer) {
+	t.mu.Lock()
+	defer t.mu.Unlock()
+	end := time.Now()
+	fmt.Fprintf(w, "path=%s setup=%s", t.path, sinceStart(t.start, t.ready))
+	fmt.Fprintf(w, " first-byte=%s total=%s bytes=%d", sinceStart(t.start, t.firstByte), end.Sub(t.start), t.bytes)
+	if !t.firstByte.IsZero() && end.After(t.firstByte) {
+		fmt.Fprintf(w, " throughput=%.0fB/s", float64(t.bytes)/end.Sub(t.firstByte).Seconds())
+	}
+	// Only sga-ssh's own CPU time: the guard's runs on another machine.
+	fmt.Fprintf(w, " client-cpu=%s\n", processCPUTime()-t.startCPU)
+}
+
+func sinceStart(start time.Time, event time.Time) string {
+	if event.IsZero() {
+		return "-"
+	}
+	return event.Sub(start).String()
+}
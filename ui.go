@@ -37,7 +37,7 @@ func formatPrompt(params Prompt) (formattedPrompt string) {
 	var buf bytes.Buffer
 	buf.WriteString(params.Question)
 	for i, v := range params.Choices {
-		buf.WriteString(fmt.Sprintf("\n    %d) %s", i+1, v))
+		fmt.Fprintf(&buf, "\n    %d) %s", i+1, v)
 	}
 	buf.WriteString("\n\nAnswer (enter a number): ")
 	formattedPrompt = buf.String()
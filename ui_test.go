@@ -0,0 +1,16 @@
+package guardianagent
+
+import (
+	"testing"
+)
+
+func BenchmarkFormatPrompt(b *testing.B) {
+	prompt := Prompt{
+		Question: "Allow intermediary to run 'git push origin master' on user@server?",
+		Choices:  []string{"Disallow", "Allow once", "Allow forever", "Allow all for this server"},
+	}
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		formatPrompt(prompt)
+	}
+}
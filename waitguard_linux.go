@@ -0,0 +1,70 @@
+package guardianagent
+
+import (
+	"fmt"
+	"log"
+	"strings"
+	"time"
+	"unsafe"
+
+	"golang.org/x/sys/unix"
+)
+
+// waitForGuard waits up to timeout for a guard to become reachable through the
+// agent guard socket. Instead of polling, it watches UserRuntimeDir with
+// inotify and retries only when the stub (re)creates the socket link.
+func (c *client) waitForGuard(timeout time.Duration) error {
+	start := time.Now()
+	fd, err := unix.InotifyInit1(unix.IN_CLOEXEC)
+	if err != nil {
+		return fmt.Errorf("failed to watch for agent guard: %s", err)
+	}
+	defer unix.Close(fd)
+	// The watch is set up before retrying, so a guard appearing in between
+	// is not missed.
+	if _, err = unix.InotifyAddWatch(fd, UserRuntimeDir(), unix.IN_CREATE|unix.IN_MOVED_TO|unix.IN_CLOSE_WRITE); err != nil {
+		return fmt.Errorf("failed to watch for agent guard: %s", err)
+	}
+
+	var events [4096]byte
+	for {
+		if err = c.connectToAgent(); err == nil {
+			log.Printf("Agent guard available after waiting %s", time.Since(start))
+			return nil
+		}
+
+		changed := false
+		for !changed {
+			remaining := timeout - time.Since(start)
+			if remaining <= 0 {
+				return err
+			}
+			pollFds := []unix.PollFd{{Fd: int32(fd), Events: unix.POLLIN}}
+			n, pollErr := unix.Poll(pollFds, int(remaining/time.Millisecond)+1)
+			if pollErr == unix.EINTR {
+				continue
+			}
+			if pollErr != nil {
+				return fmt.Errorf("failed to watch for agent guard: %s", pollErr)
+			}
+			if n == 0 {
+				continue
+			}
+			length, readErr := unix.Read(fd, events[:])
+			if readErr != nil {
+				return fmt.Errorf("failed to watch for agent guard: %s", readErr)
+			}
+			for offset := 0; offset+unix.SizeofInotifyEvent <= length; {
+				event := (*unix.InotifyEvent)(unsafe.Pointer(&events[offset]))
+				nameStart := offset + unix.SizeofInotifyEvent
+				name := strings.TrimRight(string(events[nameStart:nameStart+int(event.Len)]), "\x00")
+				// Only the link itself: sga-stub's record and its temporary
+				// files share the link's name as a prefix.
+				if name == AgentGuardSockName {
+					changed = true
+				}
+				offset = nameStart + int(event.Len)
+			}
+		}
+	}
+}
@@ -0,0 +1,73 @@
+package guardianagent
+
+import (
+	"io/ioutil"
+	"net"
+	"os"
+	"path"
+	"testing"
+	"time"
+)
+
+// TestWaitForGuardWakesOnLink creates the socket link while a client waits
+// for the guard, and checks that the client reaches the guard promptly rather
+// than when its timeout runs out.
+func TestWaitForGuardWakesOnLink(t *testing.T) {
+	dir, err := ioutil.TempDir("", "sga-waitguard")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(dir)
+	defer os.Setenv("XDG_RUNTIME_DIR", os.Getenv("XDG_RUNTIME_DIR"))
+	os.Setenv("XDG_RUNTIME_DIR", dir)
+
+	guardSocket := path.Join(dir, "guard.sock")
+	l, err := net.Listen("unix", guardSocket)
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer l.Close()
+	ag := &Agent{}
+	go func() {
+		for {
+			c, err := l.Accept()
+			if err != nil {
+				return
+			}
+			go func() {
+				ag.HandleConnection(c)
+				c.Close()
+			}()
+		}
+	}()
+
+	const timeout = 10 * time.Second
+	cli := &client{}
+	done := make(chan error, 1)
+	go func() { done <- cli.waitForGuard(timeout) }()
+	time.Sleep(100 * time.Millisecond)
+	select {
+	case err := <-done:
+		t.Fatalf("returned before the link was created: %v", err)
+	default:
+	}
+
+	linked := time.Now()
+	if err = os.Symlink(guardSocket, path.Join(dir, AgentGuardSockName)); err != nil {
+		t.Fatal(err)
+	}
+	select {
+	case err := <-done:
+		if err != nil {
+			t.Fatalf("guard not reached: %s", err)
+		}
+		defer cli.agentConn.Close()
+		recovery := time.Since(linked)
+		t.Logf("guard reached %s after the link was created", recovery)
+		if recovery > time.Second {
+			t.Errorf("guard reached %s after the link was created, expected promptly", recovery)
+		}
+	case <-time.After(timeout):
+		t.Fatalf("still waiting for the guard after %s", timeout)
+	}
+}
@@ -0,0 +1,13 @@
+// +build !linux
+
+package guardianagent
+
+import (
+	"time"
+)
+
+// waitForGuard does not wait on platforms without inotify; it makes a single
+// further attempt to reach the guard.
+func (c *client) waitForGuard(timeout time.Duration) error {
+	return c.connectToAgent()
+}
@@ -0,0 +1,200 @@
+package guardianagent
+
+import (
+	"log"
+	"net"
+	"os"
+	"os/user"
+	"path"
+	"sync"
+	"time"
+
+	"golang.org/x/crypto/ssh"
+	"golang.org/x/crypto/ssh/agent"
+	"golang.org/x/crypto/ssh/knownhosts"
+)
+
+// knownHostsIndex caches the parsed known_hosts file, re-parsing it only when
+// the file changes on disk (e.g. after putHostKey appends a new host).
+type knownHostsIndex struct {
+	mu      sync.Mutex
+	path    string
+	modTime time.Time
+	size    int64
+	kh      ssh.HostKeyCallback
+}
+
+var userKnownHosts knownHostsIndex
+
+func (idx *knownHostsIndex) callback(knownHostsPath string) (ssh.HostKeyCallback, error) {
+	fi, err := os.Stat(knownHostsPath)
+	if err != nil {
+		return nil, err
+	}
+
+	idx.mu.Lock()
+	defer idx.mu.Unlock()
+	if idx.kh != nil && idx.path == knownHostsPath && idx.modTime.Equal(fi.ModTime()) && idx.size == fi.Size() {
+		return idx.kh, nil
+	}
+	kh, err := knownhosts.New(knownHostsPath)
+	if err != nil {
+		return nil, err
+	}
+	idx.path = knownHostsPath
+	idx.modTime = fi.ModTime()
+	idx.size = fi.Size()
+	idx.kh = kh
+	return kh, nil
+}
+
+// signerCache keeps the parsed unencrypted key files across sessions,
+// re-parsing a file only when it changes. ssh-agent is asked for its keys on
+// every session, since it may have restarted or gained keys since the last
+// one, and encrypted key files are decrypted per session so that the
+// decrypted keys do not stay in memory.
+type signerCache struct {
+	mu    sync.Mutex
+	files map[string]*keyFileEntry
+
+	agentConn   net.Conn
+	agentClient agent.ExtendedAgent
+}
+
+type keyFileEntry struct {
+	modTime   time.Time
+	size      int64
+	signer    ssh.Signer
+	encrypted bool
+}
+
+var userSigners signerCache
+
+var keyFiles = []string{"identity", "id_dsa", "id_rsa", "id_ecdsa", "id_ed25519"}
+
+// agentWithKeys returns a client for ssh-agent if it holds any keys. The
+// connection is kept between sessions, and dialed again if the agent fails.
+func (sc *signerCache) agentWithKeys() agent.ExtendedAgent {
+	realAgentPath := os.Getenv("SSH_AUTH_SOCK")
+	if realAgentPath == "" {
+		return nil
+	}
+	sc.mu.Lock()
+	defer sc.mu.Unlock()
+	for attempt := 0; attempt < 2; attempt++ {
+		if sc.agentClient == nil {
+			realAgent, err := net.Dial("unix", realAgentPath)
+			if err != nil {
+				return nil
+			}
+			sc.agentConn = realAgent
+			sc.agentClient = agent.NewClient(realAgent)
+		}
+		agentKeys, err := sc.agentClient.List()
+		if err == nil {
+			if len(agentKeys) == 0 {
+				return nil
+			}
+			return sc.agentClient
+		}
+		log.Printf("Failed to list ssh-agent keys: %s", err)
+		sc.agentConn.Close()
+		sc.agentConn, sc.agentClient = nil, nil
+	}
+	return nil
+}
+
+// keyFile returns the cached entry for keyPath, parsing the file if it is new
+// or changed. Encrypted files are only marked as such.
+func (sc *signerCache) keyFile(keyPath string) *keyFileEntry {
+	fi, err := os.Stat(keyPath)
+	if err != nil {
+		return nil
+	}
+	sc.mu.Lock()
+	entry, ok := sc.files[keyPath]
+	sc.mu.Unlock()
+	if ok && entry.modTime.Equal(fi.ModTime()) && entry.size == fi.Size() {
+		return entry
+	}
+
+	entry = &keyFileEntry{modTime: fi.ModTime(), size: fi.Size()}
+	signer, err := getKeyFileAuth(keyPath, nil)
+	switch {
+	case err == errEncryptedKey:
+		entry.encrypted = true
+	case err != nil:
+		log.Printf("Error parsing private key: %s: %s", keyPath, err)
+	default:
+		entry.signer = signer
+	}
+	sc.mu.Lock()
+	if sc.files == nil {
+		sc.files = make(map[string]*keyFileEntry)
+	}
+	sc.files[keyPath] = entry
+	sc.mu.Unlock()
+	return entry
+}
+
+// load connects to ssh-agent and parses the unencrypted key files ahead of
+// the first session.
+func (sc *signerCache) load(homeDir string) {
+	if sc.agentWithKeys() != nil {
+		return
+	}
+	for _, keyFile := range keyFiles {
+		sc.keyFile(path.Join(homeDir, ".ssh", keyFile))
+	}
+}
+
+func (sc *signerCache) authMethods(homeDir string, ui UI) []ssh.AuthMethod {
+	if agentClient := sc.agentWithKeys(); agentClient != nil {
+		return []ssh.AuthMethod{ssh.PublicKeysCallback(agentClient.Signers)}
+	}
+
+	var signers []ssh.Signer
+	for _, keyFile := range keyFiles {
+		keyPath := path.Join(homeDir, ".ssh", keyFile)
+		entry := sc.keyFile(keyPath)
+		switch {
+		case entry == nil:
+		case entry.encrypted:
+			signer, err := getKeyFileAuth(keyPath, ui)
+			if err != nil {
+				log.Printf("Error parsing private key: %s: %s", keyPath, err)
+				continue
+			}
+			signers = append(signers, signer)
+		case entry.signer != nil:
+			signers = append(signers, entry.signer)
+		}
+	}
+	return []ssh.AuthMethod{ssh.PublicKeys(signers...)}
+}
+
+// Warmup preloads the signers and the known_hosts index that would otherwise
+// be built when the first session arrives. Both are loaded concurrently.
+func (ag *Agent) Warmup() {
+	start := time.Now()
+	curuser, err := user.Current()
+	if err != nil {
+		log.Printf("Skipping warm start, failed to get current user: %s", err)
+		return
+	}
+
+	var wg sync.WaitGroup
+	wg.Add(2)
+	go func() {
+		defer wg.Done()
+		userSigners.load(curuser.HomeDir)
+	}()
+	go func() {
+		defer wg.Done()
+		if _, err := userKnownHosts.callback(userKnownHostsPath(curuser.HomeDir)); err != nil {
+			log.Printf("Failed to index known_hosts: %s", err)
+		}
+	}()
+	wg.Wait()
+	log.Printf("Warm state built in %s", time.Since(start))
+}
@@ -0,0 +1,83 @@
+package guardianagent
+
+import (
+	"encoding/binary"
+	"fmt"
+	"io"
+	"testing"
+	"time"
+)
+
+// The vendored ssh library opens every channel with a fixed receive window
+// of 64 packets of 32 KiB, which neither the client nor the guard can
+// change. A single stream can have at most one window in flight per round
+// trip.
+const (
+	libraryMaxPacket = 32 * 1024
+	libraryWindow    = 64 * libraryMaxPacket
+)
+
+// benchmarkChannelWindow sends b.N packets over an emulated link with the
+// given round-trip time under SSH channel flow control (RFC 4254 section
+// 5.2): the sender spends window credit on each packet and the receiver
+// grants it back with a window adjustment as it consumes the packet.
+func benchmarkChannelWindow(b *testing.B, rtt time.Duration, window int, maxPacket int) {
+	senderConn, receiverConn := tcpPair(b)
+	sender := newLatencyConn(senderConn, rtt/2)
+	receiver := newLatencyConn(receiverConn, rtt/2)
+	defer sender.Close()
+	defer receiver.Close()
+
+	// Each packet in flight holds one slot of credit until it is granted back.
+	credit := make(chan struct{}, window/maxPacket)
+	go func() {
+		adjust := make([]byte, 4)
+		for {
+			if _, err := io.ReadFull(sender, adjust); err != nil {
+				return
+			}
+			for n := int(binary.BigEndian.Uint32(adjust)); n > 0; n -= maxPacket {
+				<-credit
+			}
+		}
+	}()
+	go func() {
+		packet := make([]byte, maxPacket)
+		adjust := make([]byte, 4)
+		binary.BigEndian.PutUint32(adjust, uint32(maxPacket))
+		for {
+			if _, err := io.ReadFull(receiver, packet); err != nil {
+				return
+			}
+			if _, err := receiver.Write(adjust); err != nil {
+				return
+			}
+		}
+	}()
+
+	packet := make([]byte, maxPacket)
+	b.SetBytes(int64(maxPacket))
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		credit <- struct{}{}
+		if _, err := sender.Write(packet); err != nil {
+			b.Fatal(err)
+		}
+	}
+	// The transfer is complete once the whole window has been granted back.
+	for i := 0; i < cap(credit); i++ {
+		credit <- struct{}{}
+	}
+}
+
+// BenchmarkChannelWindow shows the throughput ceiling of one stream on a
+// 150ms link, with the library's window and with windows sized for the
+// bandwidth-delay product of faster links.
+func BenchmarkChannelWindow(b *testing.B) {
+	rtt := 150 * time.Millisecond
+	for _, window := range []int{libraryWindow, 4 * libraryWindow, 16 * libraryWindow} {
+		b.Run(fmt.Sprintf("%dKiB", window/1024), func(b *testing.B) {
+			benchmarkChannelWindow(b, rtt, window, libraryMaxPacket)
+		})
+	}
+}